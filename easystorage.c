@@ -1,17 +1,50 @@
 #include "easystorage.h"
+#include "easystorage_compress.h"
+#include "easystorage_io.h"
+#include "easystorage_mem.h"
+#include "easystorage_pipe.h"
+#include "easystorage_sha256.h"
 #include "ini.h"
 #include "libstorage.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MAX_RETRIES 1000
 #define POLL_INTERVAL_US (100 * 1000)
 #define DEFAULT_CHUNK_SIZE (64 * 1024)
+// In-place downloads: how much data may be waiting for the writer thread before libstorage's
+// thread is held back.
+#define WRITER_QUEUE_BYTES (8 * 1024 * 1024)
+// Verified downloads: how much data may be waiting for the hashing thread.
+#define HASH_QUEUE_BYTES (8 * 1024 * 1024)
+// Fan-out downloads: how long a sink may hold the transfer back without taking any data.
+#define DEFAULT_SINK_TIMEOUT_MS (30 * 1000)
+// Batch deletes in flight at once when the caller doesn't say.
+#define DEFAULT_DELETE_CONCURRENCY 16
+// Download policies: defaults, and how many recent download durations each node keeps (and
+// needs to have seen) to place the hedging threshold.
+#define DEFAULT_BACKOFF_MS 100
+#define DEFAULT_MAX_BACKOFF_MS 5000
+#define DEFAULT_HEDGE_PERCENTILE 95
+#define LATENCY_SAMPLES 64
+#define MIN_LATENCY_SAMPLES 8
+// Upload admission: how long the node's free space, as last queried from libstorage, is trusted.
+#define SPACE_TTL_MS 1000
 
 const node_config DEFAULT_STORAGE_NODE_CONFIG = {.api_port = 8080,
                                                  .disc_port = 8090,
@@ -20,37 +53,228 @@ const node_config DEFAULT_STORAGE_NODE_CONFIG = {.api_port = 8080,
                                                  .bootstrap_node = NULL,
                                                  .nat = "auto"};
 
+typedef struct async_op async_op;
+
+// Per-node state. STORAGE_NODE handles point at one of these, so nodes never
+// share locks or bookkeeping and can be driven from different threads.
+typedef struct {
+    void *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // broadcast whenever a request completes or is released
+    int inflight;        // requests whose resp has not been destroyed yet, plus async operations
+    bool closing;        // set by e_storage_destroy; rejects new requests
+    mem_account mem;     // what in-flight requests hold, and the cap on it
+
+    // Async operations: steps ready to run, transfers that may need cancelling, and the
+    // dispatcher thread running them (started on first use).
+    async_op *ready_head;
+    async_op *ready_tail;
+    async_op *transfers;
+    pthread_t dispatcher;
+    bool dispatcher_running;
+    bool dispatcher_stop;
+
+    // Durations of recent successful downloads in ms, a ring buffer.
+    long long latencies[LATENCY_SAMPLES];
+    int n_latencies;
+    int next_latency;
+
+    // Upload admission: the node's free space as last queried, and how much of it uploads in
+    // flight have reserved.
+    size_t space_free;
+    bool space_known;      // the last query succeeded
+    bool space_querying;   // a query is in flight
+    long long space_at;    // when the last query completed, in ms
+    size_t space_reserved;
+} storage_node;
+
 typedef struct {
+    storage_node *owner;
     int ret;
     char *msg;
     size_t len;
     progress_callback pcb;
-    int bytes_done;
+    size_t bytes_done;
     bool unreferenced;
+
+    // Transfers only: caller options, and how to cancel the libstorage operation.
+    transfer_opts *opts;
+    int (*cancel)(void *ctx, const char *id, StorageCallback callback, void *userData);
+    const char *cancel_id;
+    bool cancel_sent;
+    chunk_pipe *pipe; // receives the transfer's chunks, if set
+    bool pushing;     // a chunk is being pushed into the pipe, without the lock
+    bool aborted;     // the pipe has nobody left to take the data; cancel the transfer
+    // Hold the start of the content back from the pipe until it's known not to be compressed.
+    bool sniff;
+    bool compressed; // it was, and the transfer was abandoned
+    size_t head_len;
+    char head[COMPRESSED_HEAD_SIZE];
+    int stall_ms;     // cancel the transfer when no data arrived for this long, if set
+    long long last_progress;
+
+    async_op *op; // set for steps of async operations, which nobody waits on
 } resp;
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t nim_once = PTHREAD_ONCE_INIT;
+
+static void nim_init(void) {
+    extern void libstorageNimMain(void);
+    libstorageNimMain();
+}
+
+static storage_node *node_alloc(void) {
+    storage_node *n = mem_calloc(NULL, 1, sizeof(storage_node));
+    if (!n)
+        return NULL;
+    pthread_mutex_init(&n->lock, NULL);
+    pthread_cond_init(&n->cond, NULL);
+    mem_account_init(&n->mem);
+    return n;
+}
+
+static void node_free(storage_node *n) {
+    mem_account_destroy(&n->mem);
+    pthread_cond_destroy(&n->cond);
+    pthread_mutex_destroy(&n->lock);
+    mem_free(n);
+}
+
+// Waits on the node's condition variable for at most one poll interval.
+// Must be called with n->lock held.
+static void node_wait_tick(storage_node *n) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += POLL_INTERVAL_US * 1000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&n->cond, &n->lock, &ts);
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Waits until every request issued against the node has been released.
+// Returns true if the node drained before the timeout. Must be called with n->lock held.
+static bool node_drain(storage_node *n) {
+    for (int i = 0; i < MAX_RETRIES && n->inflight > 0; i++) {
+        node_wait_tick(n);
+    }
+    return n->inflight == 0;
+}
+
+// How long new operations wait for memory under the node's cap.
+#define MEM_WAIT_MS (MAX_RETRIES * (POLL_INTERVAL_US / 1000))
+
+// Allocates a request bound to the node. Returns NULL if the node is being destroyed, or if
+// it's at its memory cap and admit is set (i.e. the request starts a new operation).
+static resp *resp_new(storage_node *n, bool admit) {
+    if (admit && mem_admit(&n->mem, MEM_WAIT_MS) != RET_OK)
+        return NULL;
 
-static resp *resp_alloc(void) {
-    resp *r = calloc(1, sizeof(resp));
-    r->ret = -1;
+    pthread_mutex_lock(&n->lock);
+    if (n->closing) {
+        pthread_mutex_unlock(&n->lock);
+        return NULL;
+    }
+    resp *r = mem_calloc(&n->mem, 1, sizeof(resp));
+    if (r) {
+        r->owner = n;
+        r->ret = -1;
+        n->inflight++;
+    }
+    pthread_mutex_unlock(&n->lock);
     return r;
 }
 
+static resp *resp_alloc(storage_node *n) { return resp_new(n, true); }
+
+// Must be called with r->owner->lock held.
 static void resp_destroy(resp *r) {
     if (!r)
         return;
-    if (r->msg)
-        free(r->msg);
-    free(r);
+    storage_node *n = r->owner;
+    mem_free(r->msg);
+    mem_free(r);
+    n->inflight--;
+    pthread_cond_broadcast(&n->cond);
+}
+
+static void on_complete(int ret, const char *msg, size_t len, void *userData);
+static void async_resume(resp *r, int ret, const char *msg, size_t len);
+
+static bool transfer_cancelled(transfer_opts *opts) {
+    return opts && __atomic_load_n(&opts->cancelled, __ATOMIC_ACQUIRE);
+}
+
+// Asks libstorage to abort the operation behind r, which will then complete with an
+// error, and aborts its pipe so that a push blocked on it returns. The cancel request's
+// own resp is released by its callback. Must be called with r->owner->lock held; the
+// lock is dropped while dispatching.
+static void resp_cancel(resp *r) {
+    storage_node *n = r->owner;
+    r->cancel_sent = true;
+    pipe_abort(r->pipe);
+
+    resp *c = mem_calloc(&n->mem, 1, sizeof(resp));
+    if (!c)
+        return;
+    c->owner = n;
+    c->ret = -1;
+    c->unreferenced = true;
+    n->inflight++;
+
+    // Async operations don't keep r alive while the lock is dropped.
+    int (*cancel)(void *, const char *, StorageCallback, void *) = r->cancel;
+    const char *id = r->cancel_id;
+    pthread_mutex_unlock(&n->lock);
+    int ret = cancel(n->ctx, id, (StorageCallback) on_complete, c);
+    pthread_mutex_lock(&n->lock);
+    if (ret != RET_OK)
+        resp_destroy(c);
+}
+
+// Whether the transfer behind r went quiet for longer than it may. Time spent waiting on
+// our own pipe doesn't count. Must be called with r->owner->lock held.
+static bool resp_stalled(resp *r) {
+    return r->stall_ms > 0 && !r->pushing && now_ms() - r->last_progress >= r->stall_ms;
 }
 
+// Returns true on timeout. Must be called with r->owner->lock held.
 static bool resp_wait(resp *r) {
     int i;
     for (i = 0; i < MAX_RETRIES && r->ret == -1; i++) {
-        usleep(POLL_INTERVAL_US);
+        if (r->cancel && !r->cancel_sent && (r->aborted || transfer_cancelled(r->opts) || resp_stalled(r))) {
+            resp_cancel(r);
+            continue;
+        }
+        node_wait_tick(r->owner);
+    }
+    if (r->ret == -1 && r->pipe) {
+        // The caller frees the pipe next, so no push may be left inside it.
+        pipe_abort(r->pipe);
+        while (r->pushing) {
+            pthread_cond_wait(&r->owner->cond, &r->owner->lock);
+        }
+    }
+    return r->ret == -1;
+}
+
+// Records the final result of a request and wakes up its waiter. Must be
+// called with r->owner->lock held.
+static void resp_complete(resp *r, int ret, const char *msg, size_t len) {
+    if (msg && len > 0) {
+        r->msg = mem_strndup(&r->owner->mem, msg, len);
+        if (r->msg)
+            r->len = len;
     }
-    return i == MAX_RETRIES;
+
+    r->ret = ret;
+    r->unreferenced = true;
+    pthread_cond_broadcast(&r->owner->cond);
 }
 
 // Callback for simple (non-progress) async operations.
@@ -59,25 +283,50 @@ static void on_complete(int ret, const char *msg, size_t len, void *userData) {
     if (!r)
         return;
 
-    pthread_mutex_lock(&mutex);
+    storage_node *n = r->owner;
+    pthread_mutex_lock(&n->lock);
     if (r->unreferenced) {
         resp_destroy(r);
-        pthread_mutex_unlock(&mutex);
+        pthread_mutex_unlock(&n->lock);
         return;
     }
 
-    if (msg && len > 0) {
-        r->msg = malloc(len + 1);
-        if (r->msg) {
-            memcpy(r->msg, msg, len);
-            r->msg[len] = '\0';
-            r->len = len;
-        }
-    }
+    if (r->op)
+        async_resume(r, ret, msg, len);
+    else
+        resp_complete(r, ret, msg, len);
+    pthread_mutex_unlock(&n->lock);
+}
 
-    r->ret = ret;
-    r->unreferenced = true;
-    pthread_mutex_unlock(&mutex);
+// Pushes a chunk of r's transfer into its pipe, aborting the transfer if nobody is left to
+// take it. Pushing may block until the pipe's stages catch up, which throttles the transfer;
+// it's done without the lock, so that the rest of the node, and the waiter's cancellation
+// and stall checks, carry on meanwhile. Must be called with r->owner->lock held.
+static void resp_push(resp *r, const char *data, size_t len, size_t offset) {
+    storage_node *n = r->owner;
+    chunk_pipe *pipe = r->pipe;
+    r->pushing = true;
+    pthread_mutex_unlock(&n->lock);
+    int pushed = pipe_push(pipe, data, len, offset);
+    pthread_mutex_lock(&n->lock);
+    r->pushing = false;
+    if (pushed != RET_OK)
+        r->aborted = true;
+    pthread_cond_broadcast(&n->cond);
+}
+
+// Passes the start of the content on once it's all there, unless it turns out to be
+// compressed, which the pipe's consumers can't expand: then the transfer is abandoned.
+// Must be called with r->owner->lock held.
+static void resp_sniffed(resp *r) {
+    r->sniff = false;
+    if (is_compressed_head(r->head, r->head_len)) {
+        r->compressed = true;
+        r->aborted = true;
+        pthread_cond_broadcast(&r->owner->cond);
+        return;
+    }
+    resp_push(r, r->head, r->head_len, 0);
 }
 
 // Callback for operations that report progress before completing.
@@ -86,35 +335,53 @@ static void on_progress(int ret, const char *msg, size_t len, void *userData) {
     if (!r)
         return;
 
-    pthread_mutex_lock(&mutex);
+    storage_node *n = r->owner;
+    pthread_mutex_lock(&n->lock);
+    // Chunks go into the pipe in the order they arrive.
+    while (r->pushing) {
+        pthread_cond_wait(&n->cond, &n->lock);
+    }
     if (r->unreferenced) {
         resp_destroy(r);
-        pthread_mutex_unlock(&mutex);
+        pthread_mutex_unlock(&n->lock);
         return;
     }
 
     if (ret == RET_PROGRESS) {
-        r->bytes_done += (int) len;
+        size_t offset = r->bytes_done;
+        r->bytes_done += len;
+        if (r->pipe && !r->aborted && msg && len > 0 && r->sniff) {
+            size_t take = len < COMPRESSED_HEAD_SIZE - r->head_len ? len : COMPRESSED_HEAD_SIZE - r->head_len;
+            memcpy(r->head + r->head_len, msg, take);
+            r->head_len += take;
+            msg += take;
+            len -= take;
+            offset += take;
+            if (r->head_len == COMPRESSED_HEAD_SIZE)
+                resp_sniffed(r);
+        }
+        if (r->pipe && !r->aborted && !r->sniff && msg && len > 0)
+            resp_push(r, msg, len, offset);
+        if (r->stall_ms > 0)
+            r->last_progress = now_ms();
         if (r->pcb) {
-            r->pcb(0, r->bytes_done, ret);
+            r->pcb(0, (int) r->bytes_done, ret);
         }
-        pthread_mutex_unlock(&mutex);
-        return; // don't set r->ret yet — still in progress
-    }
-
-    if (msg && len > 0) {
-        r->msg = malloc(len + 1);
-        if (r->msg) {
-            memcpy(r->msg, msg, len);
-            r->msg[len] = '\0';
-            r->len = len;
+        if (r->opts && r->opts->progress) {
+            r->opts->progress(r->opts->user, r->bytes_done);
         }
+        pthread_mutex_unlock(&n->lock);
+        return; // don't set r->ret yet — still in progress
     }
 
-    r->ret = ret;
-    r->unreferenced = true;
-
-    pthread_mutex_unlock(&mutex);
+    // Content shorter than the head is only complete now.
+    if (ret == RET_OK && r->sniff && !r->aborted && r->head_len > 0)
+        resp_sniffed(r);
+    if (r->op)
+        async_resume(r, ret, msg, len);
+    else
+        resp_complete(r, ret, msg, len);
+    pthread_mutex_unlock(&n->lock);
 }
 
 // Dispatches an async call, waits for completion, extracts the result.
@@ -126,8 +393,11 @@ static void on_progress(int ret, const char *msg, size_t len, void *userData) {
 // succeeds but the callback then fails to run.
 #define call_wait(dispatch_ret, r, out) call_wait_impl(__func__, __LINE__,  dispatch_ret, r, out)
 static int call_wait_impl(const char *caller_name, int caller_line, int dispatch_ret, resp *r, char **out) {
+    storage_node *n = r->owner;
+    pthread_mutex_lock(&n->lock);
     if (dispatch_ret != RET_OK) {
         resp_destroy(r);
+        pthread_mutex_unlock(&n->lock);
         return RET_ERR;
     }
 
@@ -135,8 +405,7 @@ static int call_wait_impl(const char *caller_name, int caller_line, int dispatch
         fprintf(stderr, "CRITICAL: Call timed out at %s, line %d\n", caller_name, caller_line);
     }
 
-    pthread_mutex_lock(&mutex);
-    int result = (r->ret == RET_OK) ? RET_OK : RET_ERR;
+    int result = r->compressed ? RET_COMPRESSED : r->ret == RET_OK ? RET_OK : RET_ERR;
 
     if (out) {
         *out = r->msg ? strdup(r->msg) : NULL;
@@ -147,154 +416,1036 @@ static int call_wait_impl(const char *caller_name, int caller_line, int dispatch
     } else {
         r->unreferenced = true;
     }
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&n->lock);
     return result;
 }
 
-static int nim_initialized = 0;
+// Growable buffer for building the JSON config. Appends become no-ops once an
+// allocation fails; the caller checks `failed` at the end.
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool failed;
+} json_buf;
 
-STORAGE_NODE e_storage_new(node_config config) {
-    if (!nim_initialized) {
-        extern void libstorageNimMain(void);
-        libstorageNimMain();
-        nim_initialized = 1;
+static void jb_append(json_buf *b, const char *s, size_t n) {
+    if (b->failed)
+        return;
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap < b->len + n + 1) cap *= 2;
+        char *buf = mem_realloc(NULL, b->buf, cap);
+        if (!buf) {
+            b->failed = true;
+            return;
+        }
+        b->buf = buf;
+        b->cap = cap;
     }
+    memcpy(b->buf + b->len, s, n);
+    b->len += n;
+    b->buf[b->len] = '\0';
+}
+
+static void jb_puts(json_buf *b, const char *s) { jb_append(b, s, strlen(s)); }
 
-    // Build JSON config string.
-    // Format: {"api-port":N,"disc-port":N,"data-dir":"...","log-level":"...","bootstrap-node":["..."], "nat": "..."}
-    char json[3096];
-    int pos = 0;
+// Appends s as a quoted, escaped JSON string.
+static void jb_string(json_buf *b, const char *s) {
+    jb_puts(b, "\"");
+    for (; *s; s++) {
+        unsigned char ch = (unsigned char) *s;
+        char esc[8];
+        if (ch == '"' || ch == '\\') {
+            esc[0] = '\\';
+            esc[1] = (char) ch;
+            jb_append(b, esc, 2);
+        } else if (ch < 0x20) {
+            snprintf(esc, sizeof(esc), "\\u%04x", ch);
+            jb_puts(b, esc);
+        } else {
+            jb_append(b, s, 1);
+        }
+    }
+    jb_puts(b, "\"");
+}
 
-    pos += snprintf(json + pos, sizeof(json) - pos, "{\"api-port\":%d,\"disc-port\":%d", config.api_port,
-                    config.disc_port);
+// Starts a new member: ,"key":
+static void jb_key(json_buf *b, const char *key) {
+    if (b->len > 1)
+        jb_puts(b, ",");
+    jb_string(b, key);
+    jb_puts(b, ":");
+}
 
-    if (config.data_dir) {
-        pos += snprintf(json + pos, sizeof(json) - pos, ",\"data-dir\":\"%s\"", config.data_dir);
+static bool is_json_number(const char *s) {
+    if (*s == '-')
+        s++;
+    if (!isdigit((unsigned char) *s))
+        return false;
+    while (isdigit((unsigned char) *s)) s++;
+    if (*s == '.') {
+        s++;
+        if (!isdigit((unsigned char) *s))
+            return false;
+        while (isdigit((unsigned char) *s)) s++;
     }
+    if (*s == 'e' || *s == 'E') {
+        s++;
+        if (*s == '+' || *s == '-')
+            s++;
+        if (!isdigit((unsigned char) *s))
+            return false;
+        while (isdigit((unsigned char) *s)) s++;
+    }
+    return *s == '\0';
+}
 
-    if (config.log_level) {
-        pos += snprintf(json + pos, sizeof(json) - pos, ",\"log-level\":\"%s\"", config.log_level);
+// Passthrough values that look like JSON numbers or booleans are sent as such,
+// everything else as a string.
+static void jb_value(json_buf *b, const char *value) {
+    if (is_json_number(value) || strcmp(value, "true") == 0 || strcmp(value, "false") == 0) {
+        jb_puts(b, value);
+    } else {
+        jb_string(b, value);
     }
+}
 
-    if (config.bootstrap_node) {
-        pos += snprintf(json + pos, sizeof(json) - pos, ",\"bootstrap-node\":[\"%s\"]", config.bootstrap_node);
+// Keys config_json writes from node_config fields. Passthrough options can't repeat them: a
+// duplicate key in the JSON would leave it up to the parser which one wins.
+static bool config_field(const char *key) {
+    static const char *const fields[] = {"api-port", "disc-port", "data-dir", "log-level", "bootstrap-node", "nat"};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (strcmp(key, fields[i]) == 0)
+            return true;
     }
+    return false;
+}
+
+// Builds the JSON config string for storage_new (caller must free), or returns NULL.
+// Format: {"api-port":N,"disc-port":N,"data-dir":"...","log-level":"...","bootstrap-node":["...",...],"nat":"...",...}
+static char *config_json(const node_config *config) {
+    json_buf b = {0};
+    char num[32];
 
-    if (config.nat) {
-        pos += snprintf(json + pos, sizeof(json) - pos, ",\"nat\":\"%s\"", config.nat);
+    jb_puts(&b, "{");
+    snprintf(num, sizeof(num), "%d", config->api_port);
+    jb_key(&b, "api-port");
+    jb_puts(&b, num);
+    snprintf(num, sizeof(num), "%d", config->disc_port);
+    jb_key(&b, "disc-port");
+    jb_puts(&b, num);
+
+    if (config->data_dir) {
+        jb_key(&b, "data-dir");
+        jb_string(&b, config->data_dir);
     }
 
-    snprintf(json + pos, sizeof(json) - pos, "}");
+    if (config->log_level) {
+        jb_key(&b, "log-level");
+        jb_string(&b, config->log_level);
+    }
 
-    resp *r = resp_alloc();
-    void *ctx = storage_new(json, (StorageCallback) on_complete, r);
+    if (config->bootstrap_node || config->n_bootstrap_nodes > 0) {
+        bool first = true;
+        jb_key(&b, "bootstrap-node");
+        jb_puts(&b, "[");
+        if (config->bootstrap_node) {
+            jb_string(&b, config->bootstrap_node);
+            first = false;
+        }
+        for (size_t i = 0; i < config->n_bootstrap_nodes; i++) {
+            if (!first)
+                jb_puts(&b, ",");
+            jb_string(&b, config->bootstrap_nodes[i]);
+            first = false;
+        }
+        jb_puts(&b, "]");
+    }
 
-    if (!ctx) {
-        resp_destroy(r);
+    if (config->nat) {
+        jb_key(&b, "nat");
+        jb_string(&b, config->nat);
+    }
+
+    for (size_t i = 0; i < config->n_options; i++) {
+        if (config->options[i].key && config->options[i].value && !config_field(config->options[i].key)) {
+            jb_key(&b, config->options[i].key);
+            jb_value(&b, config->options[i].value);
+        }
+    }
+
+    jb_puts(&b, "}");
+
+    if (b.failed) {
+        mem_free(b.buf);
         return NULL;
     }
+    return b.buf;
+}
+
+STORAGE_NODE e_storage_new(node_config config) {
+    pthread_once(&nim_once, nim_init);
 
-    resp_wait(r);
+    char *json = config_json(&config);
+    if (!json)
+        return NULL;
 
-    if (r->ret != RET_OK) {
-        resp_destroy(r);
+    storage_node *n = node_alloc();
+    if (!n) {
+        mem_free(json);
         return NULL;
     }
 
-    resp_destroy(r);
-    return ctx;
+    resp *r = resp_alloc(n);
+    if (!r) {
+        mem_free(json);
+        node_free(n);
+        return NULL;
+    }
+
+    n->ctx = storage_new(json, (StorageCallback) on_complete, r);
+    mem_free(json);
+    if (call_wait(n->ctx ? RET_OK : RET_ERR, r, NULL) != RET_OK) {
+        // A late callback would still reference the node, so only release it once drained.
+        pthread_mutex_lock(&n->lock);
+        bool drained = node_drain(n);
+        pthread_mutex_unlock(&n->lock);
+        if (drained)
+            node_free(n);
+        return NULL;
+    }
+
+    return n;
 }
 
 int e_storage_start(STORAGE_NODE node) {
     if (!node)
         return RET_ERR;
-    resp *r = resp_alloc();
-    return call_wait(storage_start(node, (StorageCallback) on_complete, r), r, NULL);
+    storage_node *n = node;
+    resp *r = resp_alloc(n);
+    if (!r)
+        return RET_ERR;
+    return call_wait(storage_start(n->ctx, (StorageCallback) on_complete, r), r, NULL);
+}
+
+// Whether the caller is n's dispatcher thread, e.g. running a completion callback.
+static bool on_dispatcher(storage_node *n) {
+    pthread_mutex_lock(&n->lock);
+    bool on = n->dispatcher_running && pthread_equal(pthread_self(), n->dispatcher);
+    pthread_mutex_unlock(&n->lock);
+    return on;
 }
 
 int e_storage_stop(STORAGE_NODE node) {
-    if (!node)
+    // From the dispatcher, draining would wait for the very operation it is completing.
+    if (!node || on_dispatcher(node))
         return RET_ERR;
-    resp *r = resp_alloc();
-    return call_wait(storage_stop(node, (StorageCallback) on_complete, r), r, NULL);
+    storage_node *n = node;
+
+    // Let this node's in-flight requests finish before stopping it underneath them.
+    pthread_mutex_lock(&n->lock);
+    node_drain(n);
+    pthread_mutex_unlock(&n->lock);
+
+    resp *r = resp_alloc(n);
+    if (!r)
+        return RET_ERR;
+    return call_wait(storage_stop(n->ctx, (StorageCallback) on_complete, r), r, NULL);
 }
 
 int e_storage_close(STORAGE_NODE node) {
     if (!node)
         return RET_ERR;
-    resp *r = resp_alloc();
-    return call_wait(storage_close(node, (StorageCallback) on_complete, r), r, NULL);
+    storage_node *n = node;
+    resp *r = resp_alloc(n);
+    if (!r)
+        return RET_ERR;
+    return call_wait(storage_close(n->ctx, (StorageCallback) on_complete, r), r, NULL);
 }
 
 int e_storage_destroy(STORAGE_NODE node) {
-    if (!node)
+    if (!node || on_dispatcher(node))
+        return RET_ERR;
+    storage_node *n = node;
+
+    pthread_mutex_lock(&n->lock);
+    n->closing = true;
+    bool drained = node_drain(n);
+    pthread_mutex_unlock(&n->lock);
+
+    // Callbacks may still arrive for requests that never completed; keep the
+    // node alive for them rather than freeing memory they will touch.
+    if (!drained)
         return RET_ERR;
-    return storage_destroy(node);
+
+    if (n->dispatcher_running) {
+        pthread_mutex_lock(&n->lock);
+        n->dispatcher_stop = true;
+        pthread_cond_broadcast(&n->cond);
+        pthread_mutex_unlock(&n->lock);
+        pthread_join(n->dispatcher, NULL);
+    }
+
+    int ret = storage_destroy(n->ctx);
+    node_free(n);
+    return ret;
 }
 
 char *e_storage_spr(STORAGE_NODE node) {
     if (!node)
         return NULL;
-    resp *r = resp_alloc();
+    storage_node *n = node;
+    resp *r = resp_alloc(n);
+    if (!r)
+        return NULL;
     char *spr = NULL;
-    int ret = call_wait(storage_spr(node, (StorageCallback) on_complete, r), r, &spr);
+    int ret = call_wait(storage_spr(n->ctx, (StorageCallback) on_complete, r), r, &spr);
     if (ret != RET_OK) {
         return NULL;
     }
     return spr;
 }
 
-char *e_storage_upload(STORAGE_NODE node, const char *filepath, progress_callback cb) {
-    if (!node || !filepath)
+// Reads a numeric field, e.g. "datasetSize", from a flat JSON object.
+static int json_size(const char *json, const char *key, size_t *value) {
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    const char *field = json ? strstr(json, quoted) : NULL;
+    if (!field)
+        return RET_ERR;
+    field = strchr(field, ':');
+    char *end = NULL;
+    unsigned long long v = field ? strtoull(field + 1, &end, 10) : 0;
+    if (!field || end == field + 1)
+        return RET_ERR;
+    *value = v;
+    return RET_OK;
+}
+
+// --- Upload admission ---
+// Uploads reserve their size against the node's free space before anything is sent, so that
+// one that can't fit is turned away at once rather than failing once the node runs out, and
+// concurrent ones can't together claim more than is free. The free space is queried from
+// libstorage at most every SPACE_TTL_MS; in between, the cached figure is used.
+
+// Queries the node's free quota.
+static int space_query(storage_node *n, size_t *free_bytes) {
+    resp *r = resp_alloc(n);
+    if (!r)
+        return RET_ERR;
+    char *space = NULL;
+    int ret = call_wait(storage_space(n->ctx, (StorageCallback) on_complete, r), r, &space);
+    size_t max = 0, used = 0, reserved = 0;
+    if (ret == RET_OK && (json_size(space, "quotaMaxBytes", &max) != RET_OK ||
+                          json_size(space, "quotaUsedBytes", &used) != RET_OK))
+        ret = RET_ERR;
+    json_size(space, "quotaReservedBytes", &reserved); // held for storage contracts, if any
+    *free_bytes = max > used && max - used > reserved ? max - used - reserved : 0;
+    free(space);
+    return ret;
+}
+
+// Reserves size bytes of the node's free space, refreshing the cached figure first if it's
+// stale and query is set (one query at a time; others wait for it). Returns RET_NOSPACE if they
+// don't fit next to the reservations already made. Without a current figure, e.g. because
+// libstorage can't tell, the upload is let through and left to the node. Leaves the time of the
+// reservation in *at (may be NULL), for space_release.
+static int space_reserve(storage_node *n, size_t size, bool query, long long *at) {
+    pthread_mutex_lock(&n->lock);
+    while (query && n->space_querying) node_wait_tick(n);
+    bool stale = now_ms() - n->space_at >= SPACE_TTL_MS;
+    if (query && stale) {
+        n->space_querying = true;
+        pthread_mutex_unlock(&n->lock);
+        size_t free_bytes = 0;
+        int ret = space_query(n, &free_bytes);
+        pthread_mutex_lock(&n->lock);
+        n->space_querying = false;
+        n->space_known = ret == RET_OK;
+        n->space_free = free_bytes;
+        n->space_at = now_ms();
+        stale = false;
+        pthread_cond_broadcast(&n->cond);
+    }
+
+    if (n->space_known && !stale) {
+        size_t available = n->space_free > n->space_reserved ? n->space_free - n->space_reserved : 0;
+        if (size > available) {
+            pthread_mutex_unlock(&n->lock);
+            return RET_NOSPACE;
+        }
+    }
+    n->space_reserved += size;
+    if (at)
+        *at = now_ms();
+    pthread_mutex_unlock(&n->lock);
+    return RET_OK;
+}
+
+// Releases a reservation made at time at. Uploaded bytes count as used until the next query,
+// unless one completed since then and so already counted them.
+static void space_release(storage_node *n, size_t size, long long at, bool uploaded) {
+    pthread_mutex_lock(&n->lock);
+    n->space_reserved -= size;
+    if (uploaded && n->space_at <= at)
+        n->space_free -= size < n->space_free ? size : n->space_free;
+    pthread_mutex_unlock(&n->lock);
+}
+
+// Makes the next upload query the free space again, e.g. after a delete freed some.
+static void space_invalidate(storage_node *n) {
+    pthread_mutex_lock(&n->lock);
+    n->space_at = 0;
+    pthread_mutex_unlock(&n->lock);
+}
+
+// Size of the file to upload, or 0 if it can't be told (the upload then fails on its own).
+static size_t upload_size(const char *filepath) {
+    struct stat st;
+    return stat(filepath, &st) == 0 && st.st_size > 0 ? (size_t) st.st_size : 0;
+}
+
+// Records the outcome of a transfer in opts and returns it.
+static int transfer_finish(transfer_opts *opts, int ret) {
+    if (ret != RET_OK && transfer_cancelled(opts))
+        ret = RET_CANCELLED;
+    if (opts)
+        opts->status = ret;
+    return ret;
+}
+
+static char *upload_session(storage_node *n, const char *filepath, progress_callback cb, transfer_opts *opts) {
+    if (transfer_cancelled(opts)) {
+        transfer_finish(opts, RET_ERR);
         return NULL;
+    }
 
     // Init upload session
-    resp *r = resp_alloc();
+    resp *r = resp_alloc(n);
+    if (!r) {
+        transfer_finish(opts, RET_ERR);
+        return NULL;
+    }
     char *session_id = NULL;
-    int ret = call_wait(storage_upload_init(node, filepath, DEFAULT_CHUNK_SIZE, (StorageCallback) on_complete, r), r,
+    int ret = call_wait(storage_upload_init(n->ctx, filepath, DEFAULT_CHUNK_SIZE, (StorageCallback) on_complete, r), r,
                         &session_id);
-    if (ret != RET_OK || !session_id) {
+    if (ret != RET_OK || !session_id || transfer_cancelled(opts)) {
         free(session_id);
+        transfer_finish(opts, RET_ERR);
         return NULL;
     }
 
     // Upload file with progress
-    r = resp_alloc();
+    r = resp_alloc(n);
+    if (!r) {
+        free(session_id);
+        transfer_finish(opts, RET_ERR);
+        return NULL;
+    }
     r->pcb = cb;
+    r->opts = opts;
+    r->cancel = storage_upload_cancel;
+    r->cancel_id = session_id;
     char *cid = NULL;
-    ret = call_wait(storage_upload_file(node, session_id, (StorageCallback) on_progress, r), r, &cid);
+    ret = call_wait(storage_upload_file(n->ctx, session_id, (StorageCallback) on_progress, r), r, &cid);
     free(session_id);
 
-    if (ret != RET_OK) {
+    if (transfer_finish(opts, ret) != RET_OK) {
         free(cid);
         return NULL;
     }
 
-    if (cb) {
-        printf("\n"); // newline after progress output
+    return cid;
+}
+
+// Uploads the file as is, once it has been admitted.
+static char *upload_file(storage_node *n, const char *filepath, progress_callback cb, transfer_opts *opts) {
+    size_t size = upload_size(filepath);
+    long long at;
+    if (space_reserve(n, size, true, &at) != RET_OK) {
+        transfer_finish(opts, RET_NOSPACE);
+        return NULL;
     }
 
+    char *cid = upload_session(n, filepath, cb, opts);
+    space_release(n, size, at, cid != NULL);
+    if (cid && opts)
+        opts->stored_size = size;
     return cid;
 }
 
-int e_storage_download(STORAGE_NODE node, const char *cid, const char *filepath, progress_callback cb) {
-    if (!node || !cid || !filepath)
-        return RET_ERR;
+// Creates a temporary file in TMPDIR (or /tmp), leaving its path in tmp. Returns its descriptor,
+// or -1 on failure.
+static int tmp_file(char tmp[PATH_MAX]) {
+    const char *dir = getenv("TMPDIR");
+    if (snprintf(tmp, PATH_MAX, "%s/easystorage-XXXXXX", dir && *dir ? dir : "/tmp") >= PATH_MAX)
+        return -1;
+    return mkstemp(tmp);
+}
+
+// Compresses the file into a temporary one (see easystorage_compress.h) and uploads that.
+static char *upload_compressed(storage_node *n, const char *filepath, progress_callback cb, transfer_opts *opts) {
+    char tmp[PATH_MAX];
+    int fd = tmp_file(tmp);
+    if (fd < 0) {
+        transfer_finish(opts, RET_ERR);
+        return NULL;
+    }
+
+    size_t size = 0;
+    int ret = compress_file(filepath, fd, opts->compress, &n->mem, &opts->cancelled, &size);
+    if (close(fd) != 0)
+        ret = RET_ERR;
+    char *cid = ret == RET_OK ? upload_file(n, tmp, cb, opts) : NULL;
+    if (ret != RET_OK)
+        transfer_finish(opts, RET_ERR);
+    unlink(tmp);
+    return cid;
+}
+
+static char *upload(storage_node *n, const char *filepath, progress_callback cb, transfer_opts *opts) {
+    if (opts && opts->compress > 0)
+        return upload_compressed(n, filepath, cb, opts);
+    return upload_file(n, filepath, cb, opts);
+}
 
+// Initialises a download and streams it to filepath (nothing is written if it's empty)
+// and to pipe, if given. With plain_only, content uploaded with compression is abandoned as
+// soon as it's recognised, before any of it reaches the pipe, with RET_COMPRESSED.
+static int stream(storage_node *n, const char *cid, const char *filepath, progress_callback cb, transfer_opts *opts,
+                  chunk_pipe *pipe, bool plain_only) {
     // Init download
-    resp *r = resp_alloc();
-    int ret = call_wait(storage_download_init(node, cid, DEFAULT_CHUNK_SIZE, false, (StorageCallback) on_complete, r),
-                        r, NULL);
+    resp *r = resp_alloc(n);
+    if (!r)
+        return RET_ERR;
+    int ret = call_wait(
+            storage_download_init(n->ctx, cid, DEFAULT_CHUNK_SIZE, false, (StorageCallback) on_complete, r), r, NULL);
     if (ret != RET_OK)
         return RET_ERR;
 
-    // Stream to file with progress
-    r = resp_alloc();
+    // Stream with progress
+    r = resp_alloc(n);
+    if (!r)
+        return RET_ERR;
     r->pcb = cb;
-    ret = call_wait(
-            storage_download_stream(node, cid, DEFAULT_CHUNK_SIZE, false, filepath, (StorageCallback) on_progress, r),
-            r, NULL);
+    r->opts = opts;
+    r->cancel = storage_download_cancel;
+    r->cancel_id = cid;
+    r->pipe = pipe;
+    r->sniff = pipe && plain_only;
+    r->stall_ms = opts && opts->policy ? opts->policy->stall_ms : 0;
+    r->last_progress = now_ms();
+    return call_wait(storage_download_stream(n->ctx, cid, DEFAULT_CHUNK_SIZE, false, filepath,
+                                             (StorageCallback) on_progress, r),
+                     r, NULL);
+}
+
+// Reads the dataset size from the CID's manifest.
+static int dataset_size(storage_node *n, const char *cid, size_t *size) {
+    resp *r = resp_alloc(n);
+    if (!r)
+        return RET_ERR;
+    char *manifest = NULL;
+    int ret = call_wait(storage_download_manifest(n->ctx, cid, (StorageCallback) on_complete, r), r, &manifest);
+    if (ret == RET_OK)
+        ret = json_size(manifest, "datasetSize", size);
+    free(manifest);
+    return ret;
+}
+
+static int write_to_sink(void *user, const char *data, size_t len, size_t offset) {
+    return sink_write(user, data, len, offset);
+}
+
+typedef struct {
+    sha256_ctx ctx;
+    size_t hashed;
+} hasher;
+
+static int hash_chunk(void *user, const char *data, size_t len, size_t offset) {
+    hasher *h = user;
+    if (offset != h->hashed)
+        return RET_ERR; // the stream is expected to deliver data in order
+    sha256_update(&h->ctx, data, len);
+    h->hashed += len;
+    return RET_OK;
+}
+
+// Publishes the digest of a verified download and checks it against the expected one.
+static int check_digest(hasher *h, transfer_opts *opts) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256_final(&h->ctx, digest);
+    sha256_hex(digest, opts->sha256);
+    if (opts->expected_sha256 && strcasecmp(opts->expected_sha256, opts->sha256) != 0)
+        return RET_MISMATCH;
+    return RET_OK;
+}
+
+// Streams the download to filepath, passing the chunks through pipe (if any) on the way.
+static int download_streamed(storage_node *n, const char *cid, const char *filepath, progress_callback cb,
+                             transfer_opts *opts, chunk_pipe *pipe, hasher *h) {
+    int ret = pipe && pipe_start(pipe) != RET_OK ? RET_ERR : RET_OK;
+    if (ret == RET_OK)
+        ret = stream(n, cid, filepath, cb, opts, pipe, false);
+    if (pipe && pipe_finish(pipe) != RET_OK)
+        ret = RET_ERR;
+    if (ret == RET_OK && h)
+        ret = check_digest(h, opts);
+    return ret;
+}
+
+// Lets only one of several downloads to the same destination, e.g. the attempts of a hedged
+// one, move its file into place: fn returns whether the caller may.
+typedef struct {
+    bool (*fn)(void *user);
+    void *user;
+} inplace_claim;
+
+// A file written in place: a temporary file next to the destination, preallocated to the
+// dataset size and filled through a file sink (see easystorage_io.h), then renamed over the
+// destination once complete, so readers never see a partial (or, when verifying, corrupt) file.
+typedef struct {
+    const char *path;
+    char tmp[PATH_MAX];
+    int fd;
+    file_sink *sink;
+    const inplace_claim *claim; // if set, must grant the rename
+} inplace_file;
+
+static int inplace_open(storage_node *n, inplace_file *f, const char *path, bool sized, size_t size, bool direct) {
+    f->path = path;
+    f->sink = NULL;
+    f->fd = -1;
+    f->claim = NULL;
+    if (snprintf(f->tmp, sizeof(f->tmp), "%s.XXXXXX", path) >= (int) sizeof(f->tmp))
+        return RET_ERR;
+    f->fd = mkstemp(f->tmp);
+    if (f->fd < 0)
+        return RET_ERR;
+    fchmod(f->fd, 0644);
+
+    if (sized && size > 0) {
+        // Filesystems without fallocate support just grow the file as it's written.
+        int err = posix_fallocate(f->fd, 0, (off_t) size);
+        if (err != 0 && err != EOPNOTSUPP && err != EINVAL)
+            return RET_ERR;
+    }
+    f->sink = sink_open(f->fd, direct ? SINK_DIRECT : 0, &n->mem);
+    return f->sink ? RET_OK : RET_ERR;
+}
+
+// Adds the pipe stage writing the file. The sink needs the chunks in order, so there is one
+// writer; it keeps several writes in flight.
+static int inplace_stage(chunk_pipe *pipe, inplace_file *f, size_t max_queued) {
+    return pipe_add_stage(pipe, write_to_sink, f->sink, 1, max_queued);
+}
+
+// Once the pipe has finished: moves the file into place if ret is RET_OK and all of it was
+// written, and removes it otherwise. Returns the outcome.
+static int inplace_close(inplace_file *f, int ret, bool sized, size_t size) {
+    if (f->sink && (sink_finish(f->sink) != RET_OK || (sized && sink_written(f->sink) != size)))
+        ret = RET_ERR;
+    if (!f->sink)
+        ret = RET_ERR;
+    sink_free(f->sink);
+    f->sink = NULL;
+    if (f->fd < 0)
+        return RET_ERR;
+
+    if (ret == RET_OK && fdatasync(f->fd) != 0)
+        ret = RET_ERR;
+    if (close(f->fd) != 0)
+        ret = RET_ERR;
+    if (ret == RET_OK && f->claim && !f->claim->fn(f->claim->user))
+        ret = RET_ERR;
+    if (ret == RET_OK && rename(f->tmp, f->path) != 0)
+        ret = RET_ERR;
+    if (ret != RET_OK)
+        unlink(f->tmp);
+    return ret;
+}
+
+static int download_in_place(storage_node *n, const char *cid, const char *filepath, progress_callback cb,
+                             transfer_opts *opts, chunk_pipe *pipe, hasher *h, const inplace_claim *claim) {
+    size_t size = 0;
+    bool sized = dataset_size(n, cid, &size) == RET_OK;
+
+    inplace_file f;
+    int ret = inplace_open(n, &f, filepath, sized, size, opts && opts->direct_io);
+    f.claim = claim;
+    if (ret != RET_OK || inplace_stage(pipe, &f, WRITER_QUEUE_BYTES) != RET_OK || pipe_start(pipe) != RET_OK)
+        ret = RET_ERR;
+
+    if (ret == RET_OK)
+        ret = stream(n, cid, "", cb, opts, pipe, false);
+    if (pipe_finish(pipe) != RET_OK)
+        ret = RET_ERR;
+    if (ret == RET_OK && h)
+        ret = check_digest(h, opts);
+    return inplace_close(&f, ret, sized, size);
+}
+
+// Records how long a successful download took, for placing the hedging threshold.
+static void latency_record(storage_node *n, long long ms) {
+    pthread_mutex_lock(&n->lock);
+    n->latencies[n->next_latency] = ms;
+    n->next_latency = (n->next_latency + 1) % LATENCY_SAMPLES;
+    if (n->n_latencies < LATENCY_SAMPLES)
+        n->n_latencies++;
+    pthread_mutex_unlock(&n->lock);
+}
+
+static int cmp_ms(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+// How long to let a download run before hedging it, or -1 not to hedge.
+static long long hedge_delay(storage_node *n, const download_policy *p) {
+    long long samples[LATENCY_SAMPLES];
+    pthread_mutex_lock(&n->lock);
+    int count = n->n_latencies;
+    memcpy(samples, n->latencies, sizeof(samples));
+    pthread_mutex_unlock(&n->lock);
+
+    if (count < MIN_LATENCY_SAMPLES)
+        return p->hedge_after_ms > 0 ? p->hedge_after_ms : -1;
+    int pct = p->hedge_percentile > 0 && p->hedge_percentile <= 100 ? p->hedge_percentile : DEFAULT_HEDGE_PERCENTILE;
+    qsort(samples, count, sizeof(long long), cmp_ms);
+    return samples[(count - 1) * pct / 100];
+}
+
+// claim, if set, is asked before an in-place download moves its file into place.
+static int download_attempt(storage_node *n, const char *cid, const char *filepath, progress_callback cb,
+                            transfer_opts *opts, const inplace_claim *claim) {
+    if (transfer_cancelled(opts))
+        return transfer_finish(opts, RET_ERR);
+
+    long long started = now_ms();
+    bool in_place = opts && opts->preallocate;
+    bool verify = opts && (opts->verify || opts->expected_sha256);
+    int ret;
+    if (!in_place && !verify) {
+        ret = stream(n, cid, filepath, cb, opts, NULL, false);
+    } else {
+        // Hashing runs on a thread of its own, overlapped with the transfer and any disk writes.
+        hasher h;
+        chunk_pipe *pipe = pipe_new(&n->mem);
+        ret = pipe ? RET_OK : RET_ERR;
+        if (ret == RET_OK && verify) {
+            sha256_init(&h.ctx);
+            h.hashed = 0;
+            ret = pipe_add_stage(pipe, hash_chunk, &h, 1, HASH_QUEUE_BYTES);
+        }
+
+        if (ret == RET_OK && in_place)
+            ret = download_in_place(n, cid, filepath, cb, opts, pipe, verify ? &h : NULL, claim);
+        else if (ret == RET_OK)
+            ret = download_streamed(n, cid, filepath, cb, opts, pipe, &h);
+        pipe_free(pipe);
+    }
+
+    if (ret == RET_OK)
+        latency_record(n, now_ms() - started);
+    return transfer_finish(opts, ret);
+}
+
+// --- Hedged downloads ---
+
+// Both attempts of a hedged download run on threads of their own, with options of their own
+// so that each can be cancelled alone, while the caller's thread decides when to hedge.
+typedef struct hedge hedge;
+
+typedef struct {
+    hedge *h;
+    storage_node *n;
+    transfer_opts opts;
+    pthread_t thread;
+    bool started;
+    bool done;
+    bool won; // got to move its file into place
+    int ret;
+} hedge_attempt;
+
+struct hedge {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const char *cid;
+    const char *filepath;
+    transfer_opts *caller;
+    size_t reported; // progress passed on to the caller so far
+    hedge_attempt attempts[2];
+};
+
+// Passes on progress from whichever attempt is furthest along.
+static void hedge_progress(void *user, size_t complete) {
+    hedge_attempt *a = user;
+    hedge *h = a->h;
+    pthread_mutex_lock(&h->lock);
+    if (complete > h->reported) {
+        h->reported = complete;
+        h->caller->progress(h->caller->user, complete);
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+// Grants the rename to the first attempt that asks, so that the other can't replace its file
+// once it has finished too.
+static bool hedge_claim(void *user) {
+    hedge_attempt *a = user;
+    hedge *h = a->h;
+    pthread_mutex_lock(&h->lock);
+    if (!h->attempts[0].won && !h->attempts[1].won)
+        a->won = true;
+    bool won = a->won;
+    pthread_mutex_unlock(&h->lock);
+    return won;
+}
+
+static void *hedge_run(void *arg) {
+    hedge_attempt *a = arg;
+    hedge *h = a->h;
+    inplace_claim claim = {hedge_claim, a};
+    int ret = download_attempt(a->n, h->cid, h->filepath, NULL, &a->opts, &claim);
+
+    pthread_mutex_lock(&h->lock);
+    a->ret = ret;
+    a->done = true;
+    pthread_cond_broadcast(&h->cond);
+    pthread_mutex_unlock(&h->lock);
+    return NULL;
+}
+
+// Must be called with h->lock held.
+static void hedge_start(hedge *h, int i, storage_node *n) {
+    hedge_attempt *a = &h->attempts[i];
+    a->h = h;
+    a->n = n;
+    a->opts = *h->caller;
+    a->opts.preallocate = true; // each attempt writes a file of its own, renamed into place when done
+    a->opts.cancelled = 0;
+    if (h->caller->progress) {
+        a->opts.progress = hedge_progress;
+        a->opts.user = a;
+    }
+    a->started = pthread_create(&a->thread, NULL, hedge_run, a) == 0;
+    if (!a->started) {
+        a->done = true;
+        a->ret = RET_ERR;
+    }
+}
+
+static int download_hedged(storage_node *n, const char *cid, const char *filepath, transfer_opts *opts) {
+    const download_policy *p = opts->policy;
+    hedge h = {.cid = cid, .filepath = filepath, .caller = opts};
+    pthread_mutex_init(&h.lock, NULL);
+    pthread_cond_init(&h.cond, NULL);
+    long long delay = hedge_delay(n, p);
+    long long started = now_ms();
+
+    pthread_mutex_lock(&h.lock);
+    hedge_start(&h, 0, n);
+    int winner = -1;
+    while (1) {
+        hedge_attempt *first = &h.attempts[0], *second = &h.attempts[1];
+        if (first->done && first->ret == RET_OK)
+            winner = 0;
+        else if (second->done && second->ret == RET_OK)
+            winner = 1;
+        // A failure before hedging is left to the retry policy.
+        if (winner >= 0 || (first->done && (!second->started || second->done)))
+            break;
+
+        if (transfer_cancelled(opts)) {
+            e_storage_cancel(&first->opts);
+            e_storage_cancel(&second->opts);
+        }
+        long long elapsed = now_ms() - started;
+        if (!second->started && !first->done && delay >= 0 && elapsed >= delay && !transfer_cancelled(opts)) {
+            hedge_start(&h, 1, p->hedge_node);
+            continue;
+        }
+
+        // Wake up for the hedge deadline, and to check the caller's cancellation.
+        long long wait_ms = POLL_INTERVAL_US / 1000;
+        if (!second->started && delay >= 0 && delay - elapsed < wait_ms)
+            wait_ms = delay - elapsed;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += wait_ms * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&h.cond, &h.lock, &ts);
+    }
+    // The loser is cancelled; it leaves no file behind, and can't rename its own over the
+    // winner's even if it completes as well.
+    for (int i = 0; i < 2; i++) {
+        if (i != winner)
+            e_storage_cancel(&h.attempts[i].opts);
+    }
+    pthread_mutex_unlock(&h.lock);
+
+    for (int i = 0; i < 2; i++) {
+        if (h.attempts[i].started)
+            pthread_join(h.attempts[i].thread, NULL);
+    }
+    int ret = h.attempts[winner >= 0 ? winner : 0].ret;
+    if (winner >= 0)
+        memcpy(opts->sha256, h.attempts[winner].opts.sha256, sizeof(opts->sha256));
+    pthread_cond_destroy(&h.cond);
+    pthread_mutex_destroy(&h.lock);
+    return ret;
+}
+
+// --- Retries ---
+
+// Sleeps for the backoff before retry number `retry` (from 1), jittered down by up to half so
+// that clients failing together don't retry together. Returns false if cancelled meanwhile.
+static bool backoff_wait(const download_policy *p, int retry, transfer_opts *opts) {
+    long long base = p->backoff_ms > 0 ? p->backoff_ms : DEFAULT_BACKOFF_MS;
+    long long cap = p->max_backoff_ms > 0 ? p->max_backoff_ms : DEFAULT_MAX_BACKOFF_MS;
+    long long ms = base;
+    for (int i = 1; i < retry && ms < cap; i++) {
+        ms *= 2;
+    }
+    if (ms > cap)
+        ms = cap;
+
+    static _Thread_local unsigned int seed;
+    if (seed == 0)
+        seed = (unsigned int) now_ms() ^ (unsigned int) (uintptr_t) &seed;
+    ms -= rand_r(&seed) % (ms / 2 + 1);
+
+    for (long long deadline = now_ms() + ms; now_ms() < deadline;) {
+        if (transfer_cancelled(opts))
+            return false;
+        long long left = deadline - now_ms();
+        usleep((useconds_t) (left < POLL_INTERVAL_US / 1000 ? left : POLL_INTERVAL_US / 1000) * 1000);
+    }
+    return !transfer_cancelled(opts);
+}
+
+static int download_retried(storage_node *n, const char *cid, const char *filepath, progress_callback cb,
+                            transfer_opts *opts) {
+    const download_policy *p = opts ? opts->policy : NULL;
+    if (!p)
+        return download_attempt(n, cid, filepath, cb, opts, NULL);
+
+    int attempts = p->max_attempts > 1 ? p->max_attempts : 1;
+    bool hedged = p->hedge_node && p->hedge_node != (STORAGE_NODE) n;
+    int ret = RET_ERR;
+    for (int i = 0; i < attempts; i++) {
+        if (i > 0 && !backoff_wait(p, i, opts))
+            break;
+        ret = hedged ? download_hedged(n, cid, filepath, opts) : download_attempt(n, cid, filepath, cb, opts, NULL);
+        // Cancellations and digest mismatches wouldn't go differently the next time.
+        if (ret != RET_ERR)
+            break;
+    }
+    return transfer_finish(opts, ret);
+}
+
+// Replaces the contents of the file at path with those of src (from its start).
+static int copy_into(int src, const char *path) {
+    int out = open(path, O_WRONLY);
+    if (out < 0)
+        return RET_ERR;
+    int ret = lseek(src, 0, SEEK_SET) == 0 && ftruncate(out, 0) == 0 ? RET_OK : RET_ERR;
+    char buf[64 * 1024];
+    while (ret == RET_OK) {
+        ssize_t len = read(src, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            ret = len == 0 ? RET_OK : RET_ERR;
+            break;
+        }
+        for (ssize_t done = 0, w; ret == RET_OK && done < len; done += w) {
+            w = write(out, buf + done, (size_t) (len - done));
+            if (w < 0 && errno == EINTR)
+                w = 0;
+            else if (w < 0)
+                ret = RET_ERR;
+        }
+    }
+    if (close(out) != 0)
+        ret = RET_ERR;
+    return ret;
+}
+
+// Expands the downloaded file in place if it holds content uploaded with compression, through a
+// temporary file next to it that is renamed over it; anything else is left as is, and so is the
+// file if expanding fails. Where no file can be created next to it, e.g. for a descriptor passed
+// to the daemon as /proc/self/fd/N, it is expanded into TMPDIR and copied back instead.
+static int expand(storage_node *n, const char *filepath, transfer_opts *opts) {
+    int src = open(filepath, O_RDONLY);
+    if (src < 0)
+        return errno == ENOENT ? RET_OK : RET_ERR; // nothing was written, e.g. for empty content
+    if (!is_compressed(src)) {
+        close(src);
+        return RET_OK;
+    }
+
+    char tmp[PATH_MAX];
+    int dst = -1;
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", filepath) < (int) sizeof(tmp))
+        dst = mkstemp(tmp);
+    bool copy_back = dst < 0;
+    if (copy_back)
+        dst = tmp_file(tmp);
+    if (dst < 0) {
+        close(src);
+        return RET_ERR;
+    }
+    fchmod(dst, 0644);
+
+    int ret = decompress_file(src, dst, &n->mem, opts ? &opts->cancelled : NULL);
+    close(src);
+    if (ret == RET_OK && copy_back)
+        ret = copy_into(dst, filepath);
+    if (close(dst) != 0)
+        ret = RET_ERR;
+    if (ret == RET_OK && !copy_back && rename(tmp, filepath) != 0)
+        ret = RET_ERR;
+    if (ret != RET_OK || copy_back)
+        unlink(tmp);
+    return ret;
+}
+
+static int download(storage_node *n, const char *cid, const char *filepath, progress_callback cb,
+                    transfer_opts *opts) {
+    int ret = download_retried(n, cid, filepath, cb, opts);
+    if (ret == RET_OK && !(opts && opts->keep_compressed))
+        ret = transfer_finish(opts, expand(n, filepath, opts));
+    return ret;
+}
+
+char *e_storage_upload(STORAGE_NODE node, const char *filepath, progress_callback cb) {
+    if (!node || !filepath)
+        return NULL;
+
+    char *cid = upload(node, filepath, cb, NULL);
+    if (cid && cb) {
+        printf("\n"); // newline after progress output
+    }
 
+    return cid;
+}
+
+char *e_storage_upload_opts(STORAGE_NODE node, const char *filepath, transfer_opts *opts) {
+    if (!node || !filepath) {
+        transfer_finish(opts, RET_ERR);
+        return NULL;
+    }
+    return upload(node, filepath, NULL, opts);
+}
+
+int e_storage_download(STORAGE_NODE node, const char *cid, const char *filepath, progress_callback cb) {
+    if (!node || !cid || !filepath)
+        return RET_ERR;
+
+    int ret = download(node, cid, filepath, cb, NULL);
     if (cb) {
         printf("\n");
     }
@@ -302,24 +1453,698 @@ int e_storage_download(STORAGE_NODE node, const char *cid, const char *filepath,
     return ret;
 }
 
+int e_storage_download_opts(STORAGE_NODE node, const char *cid, const char *filepath, transfer_opts *opts) {
+    if (!node || !cid || !filepath)
+        return transfer_finish(opts, RET_ERR);
+    return download(node, cid, filepath, NULL, opts);
+}
+
+// --- Fan-out downloads ---
+
+_Static_assert(DOWNLOAD_MAX_SINKS < PIPE_MAX_STAGES, "a stage is kept for hashing");
+
+typedef struct {
+    download_sink *sink;
+    int stage;         // index in the pipe, or -1 if the sink couldn't be set up
+    inplace_file file; // file sinks
+    int timeout_ms;
+    int fd_flags; // fd sinks: the file status flags to restore, or -1
+    bool sigpipe_blocked;
+} sink_stage;
+
+// Writes to a consumer's fd. SIGPIPE is blocked on the writer thread, so a consumer that went
+// away fails the sink with EPIPE rather than killing the process. The fd is non-blocking while
+// the download runs, so that a consumer that stopped reading fails the sink after its timeout
+// rather than leaving the writer stuck.
+static int write_to_fd(void *user, const char *data, size_t len, size_t offset) {
+    sink_stage *st = user;
+    if (!st->sigpipe_blocked) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+        st->sigpipe_blocked = true;
+    }
+    for (size_t done = 0; done < len;) {
+        ssize_t n = write(st->sink->fd, data + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = {.fd = st->sink->fd, .events = POLLOUT};
+            int ready = poll(&pfd, 1, st->timeout_ms);
+            if (ready > 0 || (ready < 0 && errno == EINTR))
+                continue;
+            return RET_ERR;
+        }
+        if (n <= 0)
+            return RET_ERR;
+        done += n;
+    }
+    return RET_OK;
+}
+
+static int call_sink(void *user, const char *data, size_t len, size_t offset) {
+    download_sink *sink = ((sink_stage *) user)->sink;
+    return sink->fn(sink->user, data, len, offset) == RET_OK ? RET_OK : RET_ERR;
+}
+
+static bool sink_valid(const download_sink *sink) {
+    switch (sink->type) {
+    case DOWNLOAD_SINK_FILE:
+        return sink->path != NULL;
+    case DOWNLOAD_SINK_FD:
+        return sink->fd >= 0;
+    case DOWNLOAD_SINK_CALLBACK:
+        return sink->fn != NULL;
+    default:
+        return false;
+    }
+}
+
+int e_storage_download_sinks(STORAGE_NODE node, const char *cid, download_sink *sinks, size_t n_sinks,
+                             transfer_opts *opts) {
+    if (!node || !cid || !sinks || n_sinks == 0 || n_sinks > DOWNLOAD_MAX_SINKS || transfer_cancelled(opts))
+        return transfer_finish(opts, RET_ERR);
+    storage_node *n = node;
+
+    bool files = false;
+    for (size_t i = 0; i < n_sinks; i++) {
+        if (!sink_valid(&sinks[i]))
+            return transfer_finish(opts, RET_ERR);
+        sinks[i].status = RET_ERR;
+        files = files || sinks[i].type == DOWNLOAD_SINK_FILE;
+    }
+    size_t size = 0;
+    bool sized = files && dataset_size(n, cid, &size) == RET_OK;
+
+    sink_stage *stages = mem_calloc(&n->mem, n_sinks, sizeof(sink_stage));
+    chunk_pipe *pipe = stages ? pipe_new(&n->mem) : NULL;
+    int ret = pipe ? RET_OK : RET_ERR;
+
+    // Hashing, if asked for, is the first stage, and each sink that could be set up gets one after it.
+    hasher h;
+    bool verify = opts && (opts->verify || opts->expected_sha256);
+    // It doesn't keep the transfer going by itself, so that it's abandoned once no sink is left.
+    int n_stages = 0;
+    if (ret == RET_OK && verify) {
+        sha256_init(&h.ctx);
+        h.hashed = 0;
+        ret = pipe_add_stage(pipe, hash_chunk, &h, 1, HASH_QUEUE_BYTES);
+        if (ret == RET_OK)
+            ret = pipe_set_auxiliary(pipe, n_stages);
+        n_stages++;
+    }
+
+    bool any = false;
+    for (size_t i = 0; ret == RET_OK && i < n_sinks; i++) {
+        sink_stage *st = &stages[i];
+        st->sink = &sinks[i];
+        st->stage = -1;
+        st->fd_flags = -1;
+        st->timeout_ms = sinks[i].timeout_ms != 0 ? sinks[i].timeout_ms : DEFAULT_SINK_TIMEOUT_MS;
+        if (st->timeout_ms < 0)
+            st->timeout_ms = -1;
+        size_t max_queued = sinks[i].max_queued > 0 ? sinks[i].max_queued : WRITER_QUEUE_BYTES;
+        int added;
+        if (sinks[i].type == DOWNLOAD_SINK_FILE) {
+            added = inplace_open(n, &st->file, sinks[i].path, sized, size, opts && opts->direct_io);
+            if (added == RET_OK)
+                added = inplace_stage(pipe, &st->file, max_queued);
+        } else {
+            added = pipe_add_stage(pipe, sinks[i].type == DOWNLOAD_SINK_FD ? write_to_fd : call_sink, st, 1,
+                                   max_queued);
+        }
+        if (added == RET_OK && st->timeout_ms > 0)
+            pipe_set_timeout(pipe, n_stages, st->timeout_ms);
+        if (added == RET_OK && sinks[i].type == DOWNLOAD_SINK_FD) {
+            int flags = fcntl(sinks[i].fd, F_GETFL);
+            if (flags >= 0 && !(flags & O_NONBLOCK) && fcntl(sinks[i].fd, F_SETFL, flags | O_NONBLOCK) == 0)
+                st->fd_flags = flags;
+        }
+        if (added == RET_OK) {
+            st->stage = n_stages++;
+            any = true;
+        }
+    }
+    if (!any)
+        ret = RET_ERR;
+
+    if (ret == RET_OK)
+        ret = pipe_start(pipe);
+    if (ret == RET_OK)
+        ret = stream(n, cid, "", NULL, opts, pipe, !(opts && opts->keep_compressed));
+    pipe_finish(pipe);
+    if (ret == RET_OK && verify)
+        ret = check_digest(&h, opts);
+    if (ret != RET_OK && transfer_cancelled(opts))
+        ret = RET_CANCELLED;
+
+    bool all = true;
+    for (size_t i = 0; stages && i < n_sinks; i++) {
+        int status = ret != RET_OK ? ret : stages[i].stage < 0 ? RET_ERR : pipe_stage_status(pipe, stages[i].stage);
+        if (stages[i].file.path)
+            status = inplace_close(&stages[i].file, status, sized, size);
+        if (stages[i].fd_flags >= 0)
+            fcntl(sinks[i].fd, F_SETFL, stages[i].fd_flags);
+        sinks[i].status = status;
+        all = all && status == RET_OK;
+    }
+    pipe_free(pipe);
+    mem_free(stages);
+    return transfer_finish(opts, ret != RET_OK ? ret : all ? RET_OK : RET_ERR);
+}
+
+void e_storage_cancel(transfer_opts *opts) {
+    if (opts)
+        __atomic_store_n(&opts->cancelled, 1, __ATOMIC_RELEASE);
+}
+
 int e_storage_delete(STORAGE_NODE node, const char *cid) {
     if (!node || !cid)
         return RET_ERR;
+    storage_node *n = node;
+
+    resp *r = resp_alloc(n);
+    if (!r)
+        return RET_ERR;
+    int ret = call_wait(storage_delete(n->ctx, cid, on_complete, r), r, NULL);
+    if (ret != RET_OK) {
+        return RET_ERR;
+    }
+
+    space_invalidate(n);
+    return ret;
+}
+
+int e_storage_exists(STORAGE_NODE node, const char *cid, bool *exists) {
+    if (!node || !cid || !exists)
+        return RET_ERR;
+    storage_node *n = node;
+
+    resp *r = resp_alloc(n);
+    if (!r)
+        return RET_ERR;
+    char *found = NULL;
+    int ret = call_wait(storage_exists(n->ctx, cid, on_complete, r), r, &found);
+    if (ret == RET_OK)
+        *exists = found && strcmp(found, "true") == 0;
+    free(found);
+    return ret == RET_OK ? RET_OK : RET_ERR;
+}
+
+int e_storage_space_available(STORAGE_NODE node, size_t *bytes) {
+    if (!node || !bytes)
+        return RET_ERR;
+    storage_node *n = node;
+    space_reserve(n, 0, true, NULL); // refreshes the figure if it's stale
+
+    pthread_mutex_lock(&n->lock);
+    int ret = n->space_known ? RET_OK : RET_ERR;
+    *bytes = n->space_free > n->space_reserved ? n->space_free - n->space_reserved : 0;
+    pthread_mutex_unlock(&n->lock);
+    return ret;
+}
+
+size_t e_storage_memory_used(STORAGE_NODE node) {
+    if (!node)
+        return mem_total();
+    storage_node *n = node;
+    return __atomic_load_n(&n->mem.used, __ATOMIC_RELAXED);
+}
+
+int e_storage_set_memory_limit(STORAGE_NODE node, size_t bytes, bool wait) {
+    if (!node)
+        return RET_ERR;
+    storage_node *n = node;
+    __atomic_store_n(&n->mem.wait, wait, __ATOMIC_RELAXED);
+    __atomic_store_n(&n->mem.limit, bytes, __ATOMIC_RELAXED);
+    // Waiters re-check against the new limit.
+    pthread_mutex_lock(&n->mem.lock);
+    pthread_cond_broadcast(&n->mem.cond);
+    pthread_mutex_unlock(&n->mem.lock);
+    return RET_OK;
+}
+
+// Async operations run as a chain of steps, one libstorage call each. Completion callbacks
+// only queue the next step; the node's dispatcher thread makes the calls (libstorage must not
+// be called from its own callbacks) and invokes the caller's completion once the chain ends.
+// Nothing blocks on an operation, so any number of them can be in flight on one thread.
+enum { ASYNC_UPLOAD, ASYNC_DOWNLOAD, ASYNC_DELETE, ASYNC_SPR };
+
+struct async_op {
+    async_op *next;          // in the node's ready queue
+    async_op *next_transfer; // in the node's transfer list
+    storage_node *owner;
+    int kind;
+    int step;
+    char *path;
+    char *id; // CID, or the upload session once known
+    transfer_opts *opts;
+    storage_completion done;
+    void *user;
+
+    resp *r;   // current step's request, while it's a cancellable transfer
+    int ret;   // outcome of the last step
+    char *msg; // and its message
+
+    size_t reserved;       // uploads: bytes reserved of the node's free space
+    long long reserved_at; // and when
+    bool expanded;         // downloads: compressed content was expanded (op->ret has the outcome)
+};
+
+// Queues op's next step. Must be called with op->owner->lock held.
+static void async_ready(async_op *op) {
+    storage_node *n = op->owner;
+    op->next = NULL;
+    if (n->ready_tail)
+        n->ready_tail->next = op;
+    else
+        n->ready_head = op;
+    n->ready_tail = op;
+    pthread_cond_broadcast(&n->cond);
+}
+
+// Must be called with op->owner->lock held.
+static void async_untrack(async_op *op) {
+    async_op **t = &op->owner->transfers;
+    while (*t && *t != op) t = &(*t)->next_transfer;
+    if (*t)
+        *t = op->next_transfer;
+    op->r = NULL;
+}
+
+// Records the outcome of a step and queues the next one. Must be called with r->owner->lock held.
+static void async_resume(resp *r, int ret, const char *msg, size_t len) {
+    async_op *op = r->op;
+    async_untrack(op);
+    op->ret = ret;
+    mem_free(op->msg);
+    op->msg = msg && len > 0 ? mem_strndup(&op->owner->mem, msg, len) : NULL;
+    resp_destroy(r);
+    async_ready(op);
+}
+
+static void async_free(async_op *op) {
+    mem_free(op->path);
+    mem_free(op->id);
+    mem_free(op->msg);
+    mem_free(op);
+}
+
+// Ends the operation and hands its outcome (and result string, if any) to the caller.
+static void async_finish(async_op *op, int ret) {
+    storage_node *n = op->owner;
+    char *result = NULL;
+    if (op->kind == ASYNC_UPLOAD)
+        space_release(n, op->reserved, op->reserved_at, ret == RET_OK);
+    if (op->kind == ASYNC_DELETE && ret == RET_OK)
+        space_invalidate(n);
+    if (op->kind == ASYNC_UPLOAD || op->kind == ASYNC_DOWNLOAD)
+        ret = transfer_finish(op->opts, ret);
+    if (ret == RET_OK && (op->kind == ASYNC_UPLOAD || op->kind == ASYNC_SPR)) {
+        // Handed to the caller, so it comes from malloc rather than the allocator.
+        result = op->msg ? strdup(op->msg) : NULL;
+        if (!result)
+            ret = RET_ERR;
+    }
+
+    op->done(op->user, ret, result);
+    async_free(op);
+
+    pthread_mutex_lock(&n->lock);
+    n->inflight--;
+    pthread_cond_broadcast(&n->cond);
+    pthread_mutex_unlock(&n->lock);
+}
+
+// Expanding a large download takes a while, so it runs on a thread of its own rather than
+// holding up the dispatcher, which then finishes the operation.
+static void *async_expand(void *arg) {
+    async_op *op = arg;
+    int ret = expand(op->owner, op->path, op->opts);
+    pthread_mutex_lock(&op->owner->lock);
+    op->ret = ret;
+    async_ready(op);
+    pthread_mutex_unlock(&op->owner->lock);
+    return NULL;
+}
+
+// Whether op is a completed download whose content still needs expanding.
+static bool async_needs_expanding(async_op *op) {
+    if (op->kind != ASYNC_DOWNLOAD || op->expanded || (op->opts && op->opts->keep_compressed))
+        return false;
+    int fd = open(op->path, O_RDONLY);
+    bool compressed = fd >= 0 && is_compressed(fd);
+    if (fd >= 0)
+        close(fd);
+    return compressed;
+}
+
+// Makes the libstorage call for op's current step.
+static void async_step(async_op *op) {
+    storage_node *n = op->owner;
+    if (op->step > 0 && op->ret != RET_OK) {
+        async_finish(op, RET_ERR);
+        return;
+    }
+    if (transfer_cancelled(op->opts)) {
+        async_finish(op, RET_ERR);
+        return;
+    }
+
+    bool last = (op->kind == ASYNC_UPLOAD || op->kind == ASYNC_DOWNLOAD) ? op->step == 2 : op->step == 1;
+    if (last && async_needs_expanding(op)) {
+        op->expanded = true;
+        pthread_t t;
+        if (pthread_create(&t, NULL, async_expand, op) == 0) {
+            pthread_detach(t);
+            return;
+        }
+        op->ret = expand(n, op->path, op->opts);
+        async_finish(op, op->ret);
+        return;
+    }
+    if (last) {
+        async_finish(op, RET_OK);
+        return;
+    }
+
+    bool transfer = op->step == 1;
+    if (transfer && op->kind == ASYNC_UPLOAD && !op->msg) {
+        async_finish(op, RET_ERR); // no session ID
+        return;
+    }
+
+    // Steps of running operations aren't held back by the memory cap.
+    resp *r = resp_new(n, false);
+    if (!r) {
+        async_finish(op, RET_ERR);
+        return;
+    }
+    r->op = op;
+    StorageCallback cb = (StorageCallback) on_complete;
+    if (transfer) {
+        cb = (StorageCallback) on_progress;
+        r->opts = op->opts;
+        r->cancel = op->kind == ASYNC_UPLOAD ? storage_upload_cancel : storage_download_cancel;
+        if (op->kind == ASYNC_UPLOAD) {
+            // The session ID returned by the init step.
+            mem_free(op->id);
+            op->id = op->msg;
+            op->msg = NULL;
+        }
+        r->cancel_id = op->id;
+
+        pthread_mutex_lock(&n->lock);
+        op->r = r;
+        op->next_transfer = n->transfers;
+        n->transfers = op;
+        pthread_mutex_unlock(&n->lock);
+    }
+    op->step++;
+
+    int ret = RET_ERR;
+    switch (op->kind) {
+        case ASYNC_UPLOAD:
+            ret = transfer ? storage_upload_file(n->ctx, op->id, cb, r)
+                           : storage_upload_init(n->ctx, op->path, DEFAULT_CHUNK_SIZE, cb, r);
+            break;
+        case ASYNC_DOWNLOAD:
+            ret = transfer ? storage_download_stream(n->ctx, op->id, DEFAULT_CHUNK_SIZE, false, op->path, cb, r)
+                           : storage_download_init(n->ctx, op->id, DEFAULT_CHUNK_SIZE, false, cb, r);
+            break;
+        case ASYNC_DELETE:
+            ret = storage_delete(n->ctx, op->id, cb, r);
+            break;
+        case ASYNC_SPR:
+            ret = storage_spr(n->ctx, cb, r);
+            break;
+    }
 
-    resp *r = resp_alloc();
-    int ret = call_wait(storage_delete(node, cid, on_complete, r), r, NULL);
     if (ret != RET_OK) {
+        // The callback won't run; fail the step ourselves.
+        pthread_mutex_lock(&n->lock);
+        async_resume(r, RET_ERR, NULL, 0);
+        pthread_mutex_unlock(&n->lock);
+    }
+}
+
+static void *dispatcher_run(void *arg) {
+    storage_node *n = arg;
+    pthread_mutex_lock(&n->lock);
+    while (1) {
+        async_op *op = n->ready_head;
+        if (op) {
+            n->ready_head = op->next;
+            if (!n->ready_head)
+                n->ready_tail = NULL;
+            pthread_mutex_unlock(&n->lock);
+            async_step(op);
+            pthread_mutex_lock(&n->lock);
+            continue;
+        }
+
+        // Nobody waits on async transfers, so cancellations are picked up here.
+        bool cancelled = false;
+        for (async_op *t = n->transfers; t && !cancelled; t = t->next_transfer) {
+            if (!t->r->cancel_sent && transfer_cancelled(t->opts)) {
+                resp_cancel(t->r); // drops the lock, so start over afterwards
+                cancelled = true;
+            }
+        }
+        if (cancelled)
+            continue;
+
+        if (n->dispatcher_stop)
+            break;
+        node_wait_tick(n);
+    }
+    pthread_mutex_unlock(&n->lock);
+    return NULL;
+}
+
+// Registers a new operation and queues its first step. Takes ownership of op.
+static int async_start(storage_node *n, async_op *op) {
+    // The dispatcher can't wait for memory that only it would release.
+    if (mem_admit(&n->mem, on_dispatcher(n) ? 0 : MEM_WAIT_MS) != RET_OK) {
+        async_free(op);
+        return RET_ERR;
+    }
+
+    pthread_mutex_lock(&n->lock);
+    if (n->closing || (!n->dispatcher_running && pthread_create(&n->dispatcher, NULL, dispatcher_run, n) != 0)) {
+        pthread_mutex_unlock(&n->lock);
+        async_free(op);
         return RET_ERR;
     }
+    n->dispatcher_running = true;
+    n->inflight++;
+    async_ready(op);
+    pthread_mutex_unlock(&n->lock);
+    return RET_OK;
+}
 
+static async_op *async_new(storage_node *n, int kind, const char *path, const char *id, transfer_opts *opts,
+                           storage_completion done, void *user) {
+    async_op *op = mem_calloc(&n->mem, 1, sizeof(async_op));
+    if (!op)
+        return NULL;
+    op->owner = n;
+    op->kind = kind;
+    op->opts = opts;
+    op->done = done;
+    op->user = user;
+    op->path = path ? mem_strdup(&n->mem, path) : NULL;
+    op->id = id ? mem_strdup(&n->mem, id) : NULL;
+    if ((path && !op->path) || (id && !op->id)) {
+        async_free(op);
+        return NULL;
+    }
+    return op;
+}
+
+// Turns down an async transfer before it has started: always RET_ERR, with the reason left in
+// opts->status (if given).
+static int async_refuse(transfer_opts *opts, int status) {
+    if (opts)
+        opts->status = status;
+    return RET_ERR;
+}
+
+int e_storage_upload_async(STORAGE_NODE node, const char *filepath, transfer_opts *opts, storage_completion done,
+                           void *user) {
+    if (!node || !filepath || !done ||
+        (opts && (opts->preallocate || opts->verify || opts->expected_sha256 || opts->compress > 0)))
+        return async_refuse(opts, RET_ERR);
+    storage_node *n = node;
+    async_op *op = async_new(n, ASYNC_UPLOAD, filepath, NULL, opts, done, user);
+    if (!op)
+        return async_refuse(opts, RET_ERR);
+
+    // Only the cached figure is looked at, so that this never blocks on a query.
+    op->reserved = upload_size(filepath);
+    if (space_reserve(n, op->reserved, false, &op->reserved_at) != RET_OK) {
+        async_free(op);
+        return async_refuse(opts, RET_NOSPACE);
+    }
+    size_t reserved = op->reserved;
+    long long reserved_at = op->reserved_at;
+    if (async_start(n, op) != RET_OK) {
+        space_release(n, reserved, reserved_at, false);
+        return async_refuse(opts, RET_ERR);
+    }
+    return RET_OK;
+}
+
+int e_storage_download_async(STORAGE_NODE node, const char *cid, const char *filepath, transfer_opts *opts,
+                             storage_completion done, void *user) {
+    if (!node || !cid || !filepath || !done ||
+        (opts && (opts->preallocate || opts->verify || opts->expected_sha256 || opts->policy)))
+        return RET_ERR;
+    async_op *op = async_new(node, ASYNC_DOWNLOAD, filepath, cid, opts, done, user);
+    return op ? async_start(node, op) : RET_ERR;
+}
+
+int e_storage_delete_async(STORAGE_NODE node, const char *cid, storage_completion done, void *user) {
+    if (!node || !cid || !done)
+        return RET_ERR;
+    async_op *op = async_new(node, ASYNC_DELETE, NULL, cid, NULL, done, user);
+    return op ? async_start(node, op) : RET_ERR;
+}
+
+int e_storage_spr_async(STORAGE_NODE node, storage_completion done, void *user) {
+    if (!node || !done)
+        return RET_ERR;
+    async_op *op = async_new(node, ASYNC_SPR, NULL, NULL, NULL, done, user);
+    return op ? async_start(node, op) : RET_ERR;
+}
+
+// --- Batch deletes ---
+
+// Deletes of a batch run as async operations, with the caller's thread waiting for a free slot.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int inflight;
+} delete_batch;
+
+typedef struct {
+    delete_batch *batch;
+    int status;
+} delete_slot;
+
+static void delete_done(void *user, int status, char *result) {
+    delete_slot *slot = user;
+    delete_batch *b = slot->batch;
+    free(result);
+    pthread_mutex_lock(&b->lock);
+    slot->status = status;
+    b->inflight--;
+    pthread_cond_signal(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+}
+
+int e_storage_delete_many(STORAGE_NODE node, const char *const *cids, size_t n_cids, int concurrency, int *status) {
+    if (!node || (!cids && n_cids > 0))
+        return RET_ERR;
+    storage_node *n = node;
+    if (concurrency <= 0)
+        concurrency = DEFAULT_DELETE_CONCURRENCY;
+
+    delete_slot *slots = mem_calloc(&n->mem, n_cids > 0 ? n_cids : 1, sizeof(delete_slot));
+    if (!slots)
+        return RET_ERR;
+    delete_batch b = {.inflight = 0};
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.cond, NULL);
+
+    pthread_mutex_lock(&b.lock);
+    for (size_t i = 0; i < n_cids; i++) {
+        while (b.inflight >= concurrency) {
+            pthread_cond_wait(&b.cond, &b.lock);
+        }
+        slots[i] = (delete_slot) {.batch = &b, .status = RET_ERR};
+        b.inflight++;
+        pthread_mutex_unlock(&b.lock);
+        int started = cids[i] ? e_storage_delete_async(n, cids[i], delete_done, &slots[i]) : RET_ERR;
+        pthread_mutex_lock(&b.lock);
+        if (started != RET_OK)
+            b.inflight--;
+    }
+    while (b.inflight > 0) {
+        pthread_cond_wait(&b.cond, &b.lock);
+    }
+    pthread_mutex_unlock(&b.lock);
+
+    int ret = RET_OK;
+    for (size_t i = 0; i < n_cids; i++) {
+        if (status)
+            status[i] = slots[i].status;
+        if (slots[i].status != RET_OK)
+            ret = RET_ERR;
+    }
+    pthread_cond_destroy(&b.cond);
+    pthread_mutex_destroy(&b.lock);
+    mem_free(slots);
     return ret;
 }
 
+// Repeated bootstrap-node keys after the first go to bootstrap_nodes.
+static int add_bootstrap_node(node_config *cfg, const char *value) {
+    if (!cfg->bootstrap_node) {
+        cfg->bootstrap_node = strdup(value);
+        return cfg->bootstrap_node ? RET_OK : RET_ERR;
+    }
+
+    char **nodes = realloc(cfg->bootstrap_nodes, (cfg->n_bootstrap_nodes + 1) * sizeof(char *));
+    if (!nodes)
+        return RET_ERR;
+    cfg->bootstrap_nodes = nodes;
+    if (!(nodes[cfg->n_bootstrap_nodes] = strdup(value)))
+        return RET_ERR;
+    cfg->n_bootstrap_nodes++;
+    return RET_OK;
+}
+
+// Any other key is passed through to libstorage; a repeated key replaces the earlier value.
+static int add_option(node_config *cfg, const char *key, const char *value) {
+    if (config_field(key))
+        return RET_ERR;
+    for (size_t i = 0; i < cfg->n_options; i++) {
+        if (strcmp(cfg->options[i].key, key) == 0) {
+            char *v = strdup(value);
+            if (!v)
+                return RET_ERR;
+            free(cfg->options[i].value);
+            cfg->options[i].value = v;
+            return RET_OK;
+        }
+    }
+
+    config_option *options = realloc(cfg->options, (cfg->n_options + 1) * sizeof(config_option));
+    if (!options)
+        return RET_ERR;
+    cfg->options = options;
+    config_option *opt = &options[cfg->n_options];
+    opt->key = strdup(key);
+    opt->value = strdup(value);
+    if (!opt->key || !opt->value) {
+        free(opt->key);
+        free(opt->value);
+        return RET_ERR;
+    }
+    cfg->n_options++;
+    return RET_OK;
+}
+
 static int handler(void *user, const char *section, const char *name, const char *value) {
     node_config *cfg = (node_config *) user;
-#define MATCH(n) strcmp(section, "easystorage") == 0 && strcmp(name, n) == 0
+    if (strcmp(section, "easystorage") != 0) {
+        return RET_OK;
+    }
+#define MATCH(n) strcmp(name, n) == 0
     if (MATCH("bootstrap-node")) {
-        cfg->bootstrap_node = strdup(value);
+        return add_bootstrap_node(cfg, value) == RET_OK ? RET_ERR : RET_OK;
     } else if (MATCH("data-dir")) {
         cfg->data_dir = strdup(value);
     } else if (MATCH("log-level")) {
@@ -331,8 +2156,9 @@ static int handler(void *user, const char *section, const char *name, const char
     } else if (MATCH("disc-port")) {
         cfg->disc_port = atoi(value);
     } else {
-        return RET_OK;
+        return add_option(cfg, name, value) == RET_OK ? RET_ERR : RET_OK;
     }
+#undef MATCH
 
     return RET_ERR;
 }
@@ -340,6 +2166,29 @@ static int handler(void *user, const char *section, const char *name, const char
 int e_storage_read_config(char *filepath, node_config *conf) { return ini_parse(filepath, handler, conf); }
 int e_storage_read_config_file(FILE *fp, node_config *config) { return ini_parse_file(fp, handler, config); }
 
+void e_storage_merge_config(node_config *config, const node_config *loaded) {
+    if (loaded->api_port)
+        config->api_port = loaded->api_port;
+    if (loaded->disc_port)
+        config->disc_port = loaded->disc_port;
+    if (loaded->data_dir)
+        config->data_dir = loaded->data_dir;
+    if (loaded->log_level)
+        config->log_level = loaded->log_level;
+    if (loaded->bootstrap_node)
+        config->bootstrap_node = loaded->bootstrap_node;
+    if (loaded->nat)
+        config->nat = loaded->nat;
+    if (loaded->n_bootstrap_nodes > 0) {
+        config->bootstrap_nodes = loaded->bootstrap_nodes;
+        config->n_bootstrap_nodes = loaded->n_bootstrap_nodes;
+    }
+    if (loaded->n_options > 0) {
+        config->options = loaded->options;
+        config->n_options = loaded->n_options;
+    }
+}
+
 void e_storage_free_config(node_config *conf) {
     if (!conf) {
         return;
@@ -360,4 +2209,17 @@ void e_storage_free_config(node_config *conf) {
         free(conf->nat);
         conf->nat = NULL;
     }
+    for (size_t i = 0; i < conf->n_bootstrap_nodes; i++) {
+        free(conf->bootstrap_nodes[i]);
+    }
+    free(conf->bootstrap_nodes);
+    conf->bootstrap_nodes = NULL;
+    conf->n_bootstrap_nodes = 0;
+    for (size_t i = 0; i < conf->n_options; i++) {
+        free(conf->options[i].key);
+        free(conf->options[i].value);
+    }
+    free(conf->options);
+    conf->options = NULL;
+    conf->n_options = 0;
 }
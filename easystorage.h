@@ -1,11 +1,33 @@
 #ifndef EASYSTORAGE_H
 #define EASYSTORAGE_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define STORAGE_NODE void *
+#define STORAGE_POOL void *
+#define STORAGE_SYNC void *
+#define STORAGE_GC void *
 #define RET_OK 0
 #define RET_ERR 1
+#define RET_CANCELLED 4
+#define RET_MISMATCH 5
+#define RET_NOSPACE 6
+#define RET_COMPRESSED 7 // the content was uploaded with compression, which download sinks can't expand
+
+// A libstorage setting passed through as-is, e.g. {"cache-size", "1073741824"} or
+// {"max-peers", "160"}. Values that look like JSON numbers or booleans are sent as
+// such, anything else as a string. Keys naming a node_config field (api-port, data-dir, ...)
+// are skipped; set the field instead.
+typedef struct {
+    char *key;
+    char *value;
+} config_option;
 
 typedef struct {
     int api_port;
@@ -14,18 +36,80 @@ typedef struct {
     char *log_level;
     char *bootstrap_node;
     char *nat;
+    // Further bootstrap SPRs, tried alongside bootstrap_node.
+    char **bootstrap_nodes;
+    size_t n_bootstrap_nodes;
+    // Extra libstorage settings (cache/repo sizes, maintenance intervals, peer limits, ...).
+    config_option *options;
+    size_t n_options;
 } node_config;
 
 extern const node_config DEFAULT_STORAGE_NODE_CONFIG;
 
 typedef void (*progress_callback)(int total, int complete, int status);
 
+// Receives the number of bytes transferred so far.
+typedef void (*transfer_callback)(void *user, size_t complete);
+
+// How a download copes with slow or stuck peers. Zero-initialise, then set the fields you need.
+typedef struct {
+    int stall_ms;     // abort an attempt after this long without any data arriving (0: never)
+    int max_attempts; // attempts in all, retrying after failures other than cancellation and
+                      // digest mismatches (default 1)
+    int backoff_ms;   // delay before the first retry, doubled for each further one and jittered
+                      // by up to half (default 100)
+    int max_backoff_ms; // cap on that delay (default 5000)
+
+    // Hedging: if the download is still running once it has taken longer than hedge_percentile
+    // (default 95) of the node's recent downloads, a second attempt is started on hedge_node,
+    // which must have access to the same content and outlive the call, and whichever finishes
+    // first is kept. Until the node has seen a few downloads, hedge_after_ms is used instead
+    // (0: don't hedge until then). Hedged downloads are always written in place, as with
+    // preallocate.
+    STORAGE_NODE hedge_node;
+    int hedge_percentile;
+    int hedge_after_ms;
+} download_policy;
+
+// Per-transfer options and state for the *_opts variants. Zero-initialise, then set the
+// fields you need. The struct must stay alive until the call returns.
+typedef struct {
+    transfer_callback progress; // optional; called from libstorage's thread as data moves
+    void *user;                 // passed through to progress
+    int cancelled;              // set through e_storage_cancel only
+    int status;                 // out: RET_OK, RET_ERR or one of the specific RET_* codes
+
+    // Uploads only.
+    int compress;       // zstd level (1-22) to compress the file with before uploading it, on several
+                        // threads for large files; downloads recognise and expand it. 0: upload as is
+    size_t stored_size; // out: size of the content as uploaded, after compression
+
+    // Downloads only.
+    bool preallocate; // look up the size first, preallocate the output and write it in place from
+                      // a writer thread; the file appears at filepath only once complete
+    bool direct_io;   // with preallocate: write with O_DIRECT, keeping very large files out of the
+                      // page cache (ignored where the filesystem doesn't support it)
+    bool verify;      // hash the data on a worker thread as it arrives and leave the digest in sha256
+    const char *expected_sha256; // optional hex digest (implies verify); a mismatch fails the download
+                                 // with RET_MISMATCH, and with preallocate leaves no file behind
+    char sha256[65];             // out: hex SHA-256 of the downloaded data when verifying
+    const download_policy *policy; // optional stall detection, retries and hedging
+    bool keep_compressed; // leave content uploaded with compress as stored instead of expanding it;
+                          // the digest when verifying is always that of the stored content
+} transfer_opts;
+
 // Creates a new storage node. Returns opaque pointer, or NULL on failure.
+// Any number of nodes may be created and operated concurrently from different threads.
 STORAGE_NODE e_storage_new(node_config config);
 
 int e_storage_start(STORAGE_NODE node);
+// Waits for the node's in-flight requests to finish before stopping it. Fails with RET_ERR
+// on the node's dispatcher thread (see e_storage_upload_async), where that would deadlock.
 int e_storage_stop(STORAGE_NODE node);
 int e_storage_close(STORAGE_NODE node);
+// Rejects new requests, drains in-flight ones and releases the node. Returns RET_ERR
+// (and keeps the node allocated) if some request never completed, or on the node's
+// dispatcher thread.
 int e_storage_destroy(STORAGE_NODE node);
 
 // Retrieves the node's SPR (caller must free), or NULL on failure.
@@ -34,16 +118,224 @@ char *e_storage_spr(STORAGE_NODE node);
 // Uploads a file. Returns CID string on success (caller must free), or NULL on failure.
 char *e_storage_upload(STORAGE_NODE node, const char *filepath, progress_callback cb);
 
-// Downloads content identified by cid to filepath. Returns 0 on success.
+// Downloads content identified by cid to filepath. Returns 0 on success. Content uploaded with
+// compression is expanded once it has arrived; should that fail, the file is left as stored,
+// unless it can't be renamed over (e.g. /proc/self/fd/N) and writing it back fails midway.
 int e_storage_download(STORAGE_NODE node, const char *cid, const char *filepath, progress_callback cb);
 
+// Same as e_storage_upload/e_storage_download, but report progress with user data,
+// can be cancelled from another thread and leave their outcome in opts->status. Uploads are
+// admitted against the node's free space first: one that doesn't fit, next to the uploads
+// already in flight, fails with RET_NOSPACE before anything is sent.
+char *e_storage_upload_opts(STORAGE_NODE node, const char *filepath, transfer_opts *opts);
+int e_storage_download_opts(STORAGE_NODE node, const char *cid, const char *filepath, transfer_opts *opts);
+// Aborts the transfer using opts, which then fails with RET_CANCELLED. Safe to call from any thread.
+void e_storage_cancel(transfer_opts *opts);
+
+// Destinations for e_storage_download_sinks.
+#define DOWNLOAD_SINK_FILE 0     // written in place, as with preallocate; appears at path once complete
+#define DOWNLOAD_SINK_FD 1       // e.g. a pipe or socket to a consumer process; written in order, left open
+#define DOWNLOAD_SINK_CALLBACK 2 // handed each chunk in order
+#define DOWNLOAD_MAX_SINKS 15
+
+// Receives a chunk of the download found at offset. Returning RET_ERR drops the sink.
+typedef int (*chunk_callback)(void *user, const char *data, size_t len, size_t offset);
+
+typedef struct {
+    int type;          // DOWNLOAD_SINK_*
+    const char *path;  // DOWNLOAD_SINK_FILE
+    int fd;            // DOWNLOAD_SINK_FD
+    chunk_callback fn; // DOWNLOAD_SINK_CALLBACK, with user
+    void *user;
+    size_t max_queued; // bytes that may wait for this sink before the transfer is held back (default 8 MiB)
+    int timeout_ms;    // drop the sink once it held the transfer back this long (default 30 s; < 0: never)
+    int status;        // out: RET_OK if the sink received all of the data
+} download_sink;
+
+// Downloads cid once and tees each chunk to all the sinks (up to DOWNLOAD_MAX_SINKS), each fed
+// from a thread of its own. A slow sink holds the transfer back only once it has max_queued
+// bytes waiting, and a failing or stuck one is dropped without affecting the others; the
+// transfer is abandoned only once all have failed. Fd sinks are made non-blocking for the
+// duration; a callback that never returns can't be dropped, and the call waits for it. Returns
+// the transfer's outcome if it failed, and otherwise RET_OK if every sink succeeded. opts may be
+// NULL. Its verification, progress, cancellation and direct_io (for file sinks) work as for
+// e_storage_download_opts, but of a download policy only stall detection applies, since data
+// handed to sinks can't be taken back. For the same reason, sinks can't have content uploaded
+// with compression expanded: such downloads fail with RET_COMPRESSED before any sink receives
+// data, unless keep_compressed is set, in which case the sinks receive the content as stored.
+int e_storage_download_sinks(STORAGE_NODE node, const char *cid, download_sink *sinks, size_t n_sinks,
+                             transfer_opts *opts);
+
 // Deletes a previously uploaded file from the node.
 int e_storage_delete(STORAGE_NODE node, const char *cid);
+// Tells whether the node holds the content identified by cid.
+int e_storage_exists(STORAGE_NODE node, const char *cid, bool *exists);
+
+// Bytes the node can still take for uploads: its free quota, as queried from libstorage at most
+// once a second, less what uploads in flight have reserved. Returns RET_ERR if libstorage
+// can't tell, in which case uploads aren't held back.
+int e_storage_space_available(STORAGE_NODE node, size_t *bytes);
+
+// Memory for the wrapper's own bookkeeping: requests, their buffers, async operations and
+// transfer pipelines. Strings handed to the caller (CIDs, SPRs, config values) always come
+// from malloc, so that they can be released with free().
+typedef struct {
+    void *(*alloc)(void *ctx, size_t size);
+    void (*release)(void *ctx, void *ptr);
+    void *ctx;
+} storage_allocator;
+
+// Routes the wrapper's allocations through allocator (NULL restores malloc/free). Returns
+// RET_ERR if memory from the current allocator is still in use or being allocated, i.e. call it
+// before creating any node or once all have been destroyed.
+int e_storage_set_allocator(const storage_allocator *allocator);
+// Bytes the wrapper holds for the node's in-flight operations, or for the whole process
+// (nodes included) if node is NULL.
+size_t e_storage_memory_used(STORAGE_NODE node);
+// Caps the memory the node's in-flight operations may hold; 0, the default, means no cap.
+// At the cap, new operations wait for memory to be released if wait is set, and otherwise
+// fail right away with RET_ERR. Operations already running are never held back.
+int e_storage_set_memory_limit(STORAGE_NODE node, size_t bytes, bool wait);
+
+// Completion of an async operation: its status, and for uploads and SPR requests the CID or
+// SPR on success (caller must free), NULL otherwise.
+typedef void (*storage_completion)(void *user, int status, char *result);
+
+// Non-blocking variants: these return as soon as the operation is queued, and done is then
+// called exactly once, from the node's dispatcher thread. A return of RET_ERR means the operation
+// was not started and done won't be called; an upload that doesn't fit leaves RET_NOSPACE in opts->status.
+// Operations can be started from done, but stopping or destroying the node from it fails,
+// and those started from done don't wait for memory under a limit but fail instead. Async
+// uploads are admitted against the free space as last queried (see e_storage_space_available)
+// if that was recent, and let through otherwise. Transfer options work as for the
+// *_opts variants, except that preallocate, verification, download policies and compression
+// aren't supported yet. Async downloads expand compressed content as blocking ones do, on a
+// thread of their own, before done is called.
+int e_storage_upload_async(STORAGE_NODE node, const char *filepath, transfer_opts *opts, storage_completion done,
+                           void *user);
+int e_storage_download_async(STORAGE_NODE node, const char *cid, const char *filepath, transfer_opts *opts,
+                             storage_completion done, void *user);
+int e_storage_delete_async(STORAGE_NODE node, const char *cid, storage_completion done, void *user);
+int e_storage_spr_async(STORAGE_NODE node, storage_completion done, void *user);
+
+// Deletes a batch of CIDs, with up to `concurrency` deletions in flight at once (0 for the
+// default). status, if not NULL, must have room for n_cids entries and receives each CID's
+// outcome. Returns RET_OK if all were deleted. Not to be called from an async completion.
+int e_storage_delete_many(STORAGE_NODE node, const char *const *cids, size_t n_cids, int concurrency, int *status);
+
+// Creates a pool of `size` nodes from the config template and starts them in parallel. Node i
+// listens on api_port + i and disc_port + i, and keeps its data in <data_dir>/node-<i>.
+// Returns NULL if any of the nodes fails to come up.
+STORAGE_POOL e_storage_pool_new(node_config config, int size);
+// Hands out a started node, blocking until one is checked in if all are in use. Returns NULL
+// if the pool is destroyed while it waits.
+STORAGE_NODE e_storage_pool_checkout(STORAGE_POOL pool);
+// Returns a node obtained with e_storage_pool_checkout to the pool.
+int e_storage_pool_checkin(STORAGE_POOL pool, STORAGE_NODE node);
+int e_storage_pool_size(STORAGE_POOL pool);
+// Stops and destroys all nodes. Fails if any node is still checked out. Checkouts already
+// waiting for a node return NULL, but a checkout must not be started concurrently with this
+// call or after it.
+int e_storage_pool_destroy(STORAGE_POOL pool);
+
+// Synthetic load for e_storage_bench. Each size class is uploaded `iterations` times, then
+// downloaded and compared against the original, with up to `concurrency` transfers in flight.
+typedef struct {
+    const size_t *sizes;  // file sizes to test, in bytes
+    size_t n_sizes;
+    int iterations;
+    int concurrency;
+    bool sparse;          // mostly-hole files instead of random contents
+    bool text;            // log-like lines instead of random contents
+    int compress;         // upload with this zstd level (see transfer_opts), 0 for none
+    const char *work_dir; // where the synthetic files go (default: /tmp)
+} bench_opts;
+
+// Per size class results. Latencies are p50/p90/p99 in milliseconds, over successful round trips.
+typedef struct {
+    size_t size;
+    int ok;     // round trips that completed and verified
+    int failed; // round trips that failed or returned different contents
+    double upload_mibps; // of the original data, before compression, as is download_mibps
+    double download_mibps;
+    double ratio; // stored size over original size, across successful uploads
+    double upload_ms[3];
+    double download_ms[3];
+} bench_result;
+
+// Measures the node in place. results must have room for opts->n_sizes entries.
+int e_storage_bench(STORAGE_NODE node, const bench_opts *opts, bench_result *results);
+
+// Directory sync: mirrors a directory tree into a node, uploading new and changed files
+// and deleting the content of removed ones. The path -> CID mapping is kept in a state
+// file, so restarting only costs what changed in the meantime.
+typedef struct {
+    // Quiet period after a burst of changes before uploading (default 500). Under constant change,
+    // uploads still happen every 10 periods.
+    int debounce_ms;
+    int concurrency; // uploads in flight at once (default 4)
+} sync_opts;
+
+typedef struct {
+    size_t files;   // files currently mirrored
+    size_t watched; // directories watched for changes, while running
+    int uploaded;
+    int deleted;
+    int failed;
+} sync_stats;
+
+// opts may be NULL. Returns NULL if dir or the state file's directory don't exist.
+STORAGE_SYNC e_storage_sync_new(STORAGE_NODE node, const char *dir, const char *state_file, const sync_opts *opts);
+// Reconciles the whole tree with the state file once.
+int e_storage_sync_scan(STORAGE_SYNC sync);
+// Scans, then watches the tree with inotify and syncs changes until e_storage_sync_stop is
+// called. Only the changed paths are looked at. Linux only; returns RET_ERR elsewhere.
+int e_storage_sync_run(STORAGE_SYNC sync);
+// Makes e_storage_sync_run return after flushing pending changes. Async-signal-safe.
+void e_storage_sync_stop(STORAGE_SYNC sync);
+// CID recorded for a path relative to the synced directory (caller must free), or NULL.
+char *e_storage_sync_cid(STORAGE_SYNC sync, const char *path);
+void e_storage_sync_stats(STORAGE_SYNC sync, sync_stats *stats);
+void e_storage_sync_destroy(STORAGE_SYNC sync);
+
+// Expiry-driven garbage collection: CIDs are recorded with a time to live in an index file, and
+// e_storage_gc_collect deletes the content of those that have expired. Recording is an append
+// to the file, so it is cheap enough to do for every upload.
+typedef struct {
+    size_t tracked; // CIDs in the index
+    size_t expired; // of which past their expiry
+    int deleted;
+    int failed;
+} gc_stats;
+
+// Returns NULL if the index file exists but can't be read, or can't be created.
+STORAGE_GC e_storage_gc_new(STORAGE_NODE node, const char *index_file);
+// Records cid to expire ttl_seconds from now, replacing any earlier expiry it had.
+int e_storage_gc_track(STORAGE_GC gc, const char *cid, long long ttl_seconds);
+// Stops tracking cid without deleting its content.
+int e_storage_gc_forget(STORAGE_GC gc, const char *cid);
+// Deletes the content of all expired CIDs, up to `concurrency` at a time (0 for the default),
+// and drops them from the index. Content that turns out to be gone already counts as deleted;
+// CIDs whose deletion otherwise fails stay, to be retried by the next collection. Returns RET_OK
+// if all expired CIDs were deleted.
+int e_storage_gc_collect(STORAGE_GC gc, int concurrency);
+void e_storage_gc_stats(STORAGE_GC gc, gc_stats *stats);
+void e_storage_gc_destroy(STORAGE_GC gc);
 
 // Config handling utilities. Note that for e_storage_read_config and e_storage_read_config, the
-// caller is responsible for freeing the config object and its members.
+// caller is responsible for freeing the config object and its members. In the [easystorage]
+// section, bootstrap-node may be repeated, and keys other than the node_config fields are
+// collected into options.
 int e_storage_read_config(char *filepath, node_config *config);
 int e_storage_read_config_file(FILE *, node_config *config);
 void e_storage_free_config(node_config *config);
+// Overlays what a config file set onto config (e.g. a copy of DEFAULT_STORAGE_NODE_CONFIG): fields
+// left zero in loaded keep their value. config borrows loaded's strings, so free loaded only once
+// config is no longer used.
+void e_storage_merge_config(node_config *config, const node_config *loaded);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // EASYSTORAGE_H
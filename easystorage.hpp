@@ -0,0 +1,210 @@
+#ifndef EASYSTORAGE_HPP
+#define EASYSTORAGE_HPP
+
+// Optional header-only C++20 layer over easystorage.h: an RAII node handle, move-only
+// strings for CIDs and SPRs, and co_await-able operations built on the *_async C API.
+//
+//   easystorage::node node(cfg);
+//   node.start();
+//   auto [status, cid] = co_await node.upload("/path/to/file");
+//   co_await node.download(cid.c_str(), "/path/to/copy");
+//
+// A suspended coroutine is resumed by the executor given to the operation, with the
+// coroutine handle. The default resumes it right away on the node's dispatcher thread, so
+// keep the code between co_awaits short there, or hand it to your own pool.
+
+#include "easystorage.h"
+
+#include <coroutine>
+#include <cstdlib>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+namespace easystorage {
+
+// A string allocated by easystorage (a CID or SPR), released with free().
+class owned_string {
+public:
+    owned_string() = default;
+    explicit owned_string(char *s) noexcept : s_(s) {}
+    owned_string(owned_string &&other) noexcept : s_(std::exchange(other.s_, nullptr)) {}
+    owned_string &operator=(owned_string &&other) noexcept {
+        if (this != &other) {
+            std::free(s_);
+            s_ = std::exchange(other.s_, nullptr);
+        }
+        return *this;
+    }
+    owned_string(const owned_string &) = delete;
+    owned_string &operator=(const owned_string &) = delete;
+    ~owned_string() { std::free(s_); }
+
+    const char *c_str() const noexcept { return s_; }
+    std::string_view view() const noexcept { return s_ ? std::string_view(s_) : std::string_view(); }
+    explicit operator bool() const noexcept { return s_ != nullptr; }
+
+    // Hands the string over to the caller, who must free() it.
+    char *release() noexcept { return std::exchange(s_, nullptr); }
+
+private:
+    char *s_ = nullptr;
+};
+
+using cid = owned_string;
+using spr = owned_string;
+
+// Outcome of an operation that produces a string.
+template <class T>
+struct result {
+    int status = RET_ERR;
+    T value;
+
+    bool ok() const noexcept { return status == RET_OK; }
+};
+
+// Resumes coroutines on the thread that completes the operation.
+struct inline_executor {
+    void operator()(std::coroutine_handle<> h) const { h.resume(); }
+};
+
+namespace detail {
+
+// Awaits one async operation. start(done, user) must call the matching e_storage_*_async function.
+template <class Start, class Executor>
+class operation {
+public:
+    operation(Start start, Executor executor) : start_(std::move(start)), executor_(std::move(executor)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        handle_ = h;
+        // Once started, the operation may complete (and resume the coroutine, destroying this
+        // awaiter) on another thread before start_ returns, so members aren't touched after it.
+        int ret = start_(&operation::complete, this);
+        if (ret != RET_OK) {
+            status_ = ret;
+            return false;
+        }
+        return true;
+    }
+
+    result<owned_string> await_resume() noexcept { return {status_, owned_string(result_)}; }
+
+private:
+    static void complete(void *user, int status, char *result) {
+        auto *self = static_cast<operation *>(user);
+        self->status_ = status;
+        self->result_ = result;
+        self->executor_(self->handle_);
+    }
+
+    Start start_;
+    Executor executor_;
+    std::coroutine_handle<> handle_;
+    int status_ = RET_ERR;
+    char *result_ = nullptr;
+};
+
+// Same, for operations that only report a status.
+template <class Start, class Executor>
+class status_operation : public operation<Start, Executor> {
+public:
+    using operation<Start, Executor>::operation;
+
+    int await_resume() noexcept { return operation<Start, Executor>::await_resume().status; }
+};
+
+} // namespace detail
+
+// Owns a STORAGE_NODE, and stops and destroys it when it goes out of scope. Destroyed from a coroutine
+// resumed on its own dispatcher thread, where the node can't be stopped, it leaks the node instead.
+class node {
+public:
+    explicit node(const node_config &config) : node_(e_storage_new(config)) {
+        if (!node_)
+            throw std::runtime_error("easystorage: failed to create node");
+    }
+    node(node &&other) noexcept
+        : node_(std::exchange(other.node_, nullptr)), started_(std::exchange(other.started_, false)) {}
+    node &operator=(node &&other) noexcept {
+        if (this != &other) {
+            reset();
+            node_ = std::exchange(other.node_, nullptr);
+            started_ = std::exchange(other.started_, false);
+        }
+        return *this;
+    }
+    node(const node &) = delete;
+    node &operator=(const node &) = delete;
+    ~node() { reset(); }
+
+    STORAGE_NODE get() const noexcept { return node_; }
+
+    int start() {
+        int ret = e_storage_start(node_);
+        started_ = started_ || ret == RET_OK;
+        return ret;
+    }
+    int stop() {
+        started_ = false;
+        return e_storage_stop(node_);
+    }
+
+    // co_await yields result<cid>. opts, if given, must outlive the operation.
+    template <class Executor = inline_executor>
+    auto upload(const char *filepath, transfer_opts *opts = nullptr, Executor executor = {}) {
+        auto start = [n = node_, filepath, opts](storage_completion done, void *user) {
+            int ret = e_storage_upload_async(n, filepath, opts, done, user);
+            return ret != RET_OK && opts ? opts->status : ret; // tells RET_NOSPACE apart
+        };
+        return detail::operation<decltype(start), Executor>(start, std::move(executor));
+    }
+
+    // co_await yields the status.
+    template <class Executor = inline_executor>
+    auto download(const char *cid, const char *filepath, transfer_opts *opts = nullptr, Executor executor = {}) {
+        auto start = [n = node_, cid, filepath, opts](storage_completion done, void *user) {
+            return e_storage_download_async(n, cid, filepath, opts, done, user);
+        };
+        return detail::status_operation<decltype(start), Executor>(start, std::move(executor));
+    }
+
+    // co_await yields the status.
+    template <class Executor = inline_executor>
+    auto remove(const char *cid, Executor executor = {}) {
+        auto start = [n = node_, cid](storage_completion done, void *user) {
+            return e_storage_delete_async(n, cid, done, user);
+        };
+        return detail::status_operation<decltype(start), Executor>(start, std::move(executor));
+    }
+
+    // co_await yields result<spr>.
+    template <class Executor = inline_executor>
+    auto spr(Executor executor = {}) {
+        auto start = [n = node_](storage_completion done, void *user) {
+            return e_storage_spr_async(n, done, user);
+        };
+        return detail::operation<decltype(start), Executor>(start, std::move(executor));
+    }
+
+private:
+    void reset() noexcept {
+        // Stopping fails on the dispatcher thread; the node is then left running rather than
+        // closed under its own in-flight operations (and destroying it fails as well).
+        if (node_ && started_ && e_storage_stop(node_) == RET_OK)
+            e_storage_close(node_);
+        if (node_)
+            e_storage_destroy(node_);
+        node_ = nullptr;
+        started_ = false;
+    }
+
+    STORAGE_NODE node_;
+    bool started_ = false;
+};
+
+} // namespace easystorage
+
+#endif // EASYSTORAGE_HPP
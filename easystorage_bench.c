@@ -0,0 +1,278 @@
+#include "easystorage.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_BUF_SIZE (64 * 1024)
+
+static const double percentiles[] = {50, 90, 99};
+
+// State shared by the workers of one phase (uploads or downloads) of a size class.
+typedef struct {
+    STORAGE_NODE node;
+    int iterations;
+    int compress;
+    bool uploading;
+
+    char (*inputs)[PATH_MAX];
+    char (*outputs)[PATH_MAX];
+    char **cids;
+    size_t *stored;
+    double *up_ms;
+    double *down_ms;
+    bool *ok;
+
+    pthread_mutex_t lock;
+    int next;
+} bench_run;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1000.0 + (double) ts.tv_nsec / 1e6;
+}
+
+// Appends log-like lines to buf (of len bytes): a timestamp, a level, a component and a message
+// drawn from a handful of templates, with varying numbers in them.
+static void generate_text(char *buf, size_t len, unsigned long long *x, unsigned long long *line) {
+    static const char *levels[] = {"DEBUG", "INFO", "INFO", "INFO", "WARN", "ERROR"};
+    static const char *components[] = {"net", "store", "sync", "api", "gc"};
+    static const char *messages[] = {"block %llu stored in %llu ms", "peer %llu connected from 10.0.%llu.7",
+                                     "request %llu served, %llu bytes", "retrying fetch of block %llu (attempt %llu)",
+                                     "cache hit ratio %llu.%llu%%"};
+    size_t done = 0;
+    while (done < len) {
+        *x ^= *x << 13;
+        *x ^= *x >> 7;
+        *x ^= *x << 17;
+        char msg[96], l[192];
+        snprintf(msg, sizeof(msg), messages[*x % 5], (*x >> 8) % 100000, (*x >> 24) % 1000);
+        int n = snprintf(l, sizeof(l), "2025-01-01T00:%02llu:%02llu.%03lluZ %-5s [%s] %s\n", *line / 60000 % 60,
+                         *line / 1000 % 60, *line % 1000, levels[(*x >> 32) % 6], components[(*x >> 40) % 5], msg);
+        size_t take = len - done < (size_t) n ? len - done : (size_t) n;
+        memcpy(buf + done, l, take);
+        done += take;
+        ++*line;
+    }
+}
+
+// Writes a synthetic file of the given size. Each seed produces distinct contents so
+// that concurrent iterations don't collapse into the same CID.
+static int generate(const char *path, size_t size, bool sparse, bool text, unsigned long long seed) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return RET_ERR;
+
+    int ret = RET_OK;
+    if (text) {
+        unsigned long long x = seed * 0x9E3779B97F4A7C15ULL + 1, line = seed * 1000;
+        char *buf = malloc(BENCH_BUF_SIZE);
+        ret = buf ? RET_OK : RET_ERR;
+        for (size_t done = 0; done < size && ret == RET_OK;) {
+            size_t n = size - done < BENCH_BUF_SIZE ? size - done : BENCH_BUF_SIZE;
+            generate_text(buf, n, &x, &line);
+            if (write(fd, buf, n) != (ssize_t) n)
+                ret = RET_ERR;
+            done += n;
+        }
+        free(buf);
+    } else if (sparse) {
+        // A tag up front, holes for the rest.
+        size_t tag = size < sizeof(seed) ? size : sizeof(seed);
+        if (write(fd, &seed, tag) != (ssize_t) tag || ftruncate(fd, (off_t) size) != 0)
+            ret = RET_ERR;
+    } else {
+        unsigned long long x = seed * 0x9E3779B97F4A7C15ULL + 1; // xorshift64
+        unsigned long long buf[BENCH_BUF_SIZE / sizeof(unsigned long long)];
+        for (size_t done = 0; done < size && ret == RET_OK;) {
+            for (size_t i = 0; i < sizeof(buf) / sizeof(buf[0]); i++) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                buf[i] = x;
+            }
+            size_t n = size - done < sizeof(buf) ? size - done : sizeof(buf);
+            if (write(fd, buf, n) != (ssize_t) n)
+                ret = RET_ERR;
+            done += n;
+        }
+    }
+
+    close(fd);
+    return ret;
+}
+
+static bool same_contents(const char *a, const char *b) {
+    FILE *fa = fopen(a, "rb");
+    FILE *fb = fopen(b, "rb");
+    char *ba = malloc(BENCH_BUF_SIZE);
+    char *bb = malloc(BENCH_BUF_SIZE);
+    bool same = fa && fb && ba && bb;
+
+    while (same) {
+        size_t na = fread(ba, 1, BENCH_BUF_SIZE, fa);
+        size_t nb = fread(bb, 1, BENCH_BUF_SIZE, fb);
+        if (na != nb || memcmp(ba, bb, na) != 0)
+            same = false;
+        if (na == 0)
+            break;
+    }
+
+    if (fa)
+        fclose(fa);
+    if (fb)
+        fclose(fb);
+    free(ba);
+    free(bb);
+    return same;
+}
+
+static void *bench_worker(void *arg) {
+    bench_run *run = arg;
+    while (1) {
+        pthread_mutex_lock(&run->lock);
+        int i = run->next++;
+        pthread_mutex_unlock(&run->lock);
+        if (i >= run->iterations)
+            return NULL;
+
+        if (run->uploading) {
+            transfer_opts opts = {.compress = run->compress};
+            double start = now_ms();
+            run->cids[i] = e_storage_upload_opts(run->node, run->inputs[i], &opts);
+            run->up_ms[i] = now_ms() - start;
+            run->stored[i] = opts.stored_size;
+        } else if (run->cids[i]) {
+            double start = now_ms();
+            int ret = e_storage_download(run->node, run->cids[i], run->outputs[i], NULL);
+            run->down_ms[i] = now_ms() - start;
+            run->ok[i] = ret == RET_OK && same_contents(run->inputs[i], run->outputs[i]);
+        }
+    }
+}
+
+// Runs one phase over all iterations with the given concurrency. Returns its wall time in ms.
+static double bench_phase(bench_run *run, bool uploading, int concurrency) {
+    pthread_t *threads = calloc(concurrency, sizeof(pthread_t));
+    int started = 0;
+
+    run->uploading = uploading;
+    run->next = 0;
+    double start = now_ms();
+    for (; threads && started < concurrency; started++) {
+        if (pthread_create(&threads[started], NULL, bench_worker, run) != 0)
+            break;
+    }
+    if (started == 0)
+        bench_worker(run);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return now_ms() - start;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Fills out[] with the latency percentiles of the n samples (sorted in place).
+static void latency_percentiles(double *samples, int n, double *out) {
+    qsort(samples, n, sizeof(double), compare_double);
+    for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++) {
+        int idx = (int) ((percentiles[p] / 100.0) * n + 0.999999) - 1;
+        out[p] = n > 0 ? samples[idx < 0 ? 0 : idx] : 0;
+    }
+}
+
+static double mib_per_sec(size_t bytes, double ms) {
+    return ms > 0 ? (double) bytes / (1024.0 * 1024.0) / (ms / 1000.0) : 0;
+}
+
+static int bench_size(STORAGE_NODE node, const bench_opts *opts, size_t size, bench_result *result) {
+    int n = opts->iterations;
+    const char *dir = opts->work_dir ? opts->work_dir : "/tmp";
+    bench_run run = {.node = node, .iterations = n, .compress = opts->compress};
+
+    run.inputs = calloc(n, sizeof(*run.inputs));
+    run.outputs = calloc(n, sizeof(*run.outputs));
+    run.cids = calloc(n, sizeof(char *));
+    run.stored = calloc(n, sizeof(size_t));
+    run.up_ms = calloc(n, sizeof(double));
+    run.down_ms = calloc(n, sizeof(double));
+    run.ok = calloc(n, sizeof(bool));
+    pthread_mutex_init(&run.lock, NULL);
+
+    int ret = RET_OK;
+    if (!run.inputs || !run.outputs || !run.cids || !run.stored || !run.up_ms || !run.down_ms || !run.ok)
+        ret = RET_ERR;
+
+    for (int i = 0; i < n && ret == RET_OK; i++) {
+        snprintf(run.inputs[i], PATH_MAX, "%s/easystorage-bench-%d-%zu-%d.in", dir, (int) getpid(), size, i);
+        snprintf(run.outputs[i], PATH_MAX, "%s/easystorage-bench-%d-%zu-%d.out", dir, (int) getpid(), size, i);
+        ret = generate(run.inputs[i], size, opts->sparse, opts->text, ((unsigned long long) size << 20) + i + 1);
+    }
+
+    if (ret == RET_OK) {
+        double up_wall = bench_phase(&run, true, opts->concurrency);
+        double down_wall = bench_phase(&run, false, opts->concurrency);
+
+        memset(result, 0, sizeof(*result));
+        result->size = size;
+        int uploaded = 0, downloaded = 0;
+        size_t stored = 0;
+        for (int i = 0; i < n; i++) {
+            if (run.cids[i]) {
+                run.up_ms[uploaded++] = run.up_ms[i];
+                stored += run.stored[i];
+            }
+            if (run.ok[i])
+                run.down_ms[downloaded++] = run.down_ms[i];
+        }
+        result->ok = downloaded;
+        result->failed = n - downloaded;
+        result->upload_mibps = mib_per_sec(size * uploaded, up_wall);
+        result->download_mibps = mib_per_sec(size * downloaded, down_wall);
+        result->ratio = uploaded > 0 && size > 0 ? (double) stored / ((double) size * uploaded) : 0;
+        latency_percentiles(run.up_ms, uploaded, result->upload_ms);
+        latency_percentiles(run.down_ms, downloaded, result->download_ms);
+    }
+
+    for (int i = 0; run.inputs && run.outputs && run.cids && i < n; i++) {
+        unlink(run.inputs[i]);
+        unlink(run.outputs[i]);
+        if (run.cids[i]) {
+            e_storage_delete(node, run.cids[i]);
+            free(run.cids[i]);
+        }
+    }
+
+    pthread_mutex_destroy(&run.lock);
+    free(run.inputs);
+    free(run.outputs);
+    free(run.cids);
+    free(run.stored);
+    free(run.up_ms);
+    free(run.down_ms);
+    free(run.ok);
+    return ret;
+}
+
+int e_storage_bench(STORAGE_NODE node, const bench_opts *opts, bench_result *results) {
+    if (!node || !opts || !opts->sizes || !results || opts->iterations <= 0 || opts->concurrency <= 0)
+        return RET_ERR;
+
+    for (size_t i = 0; i < opts->n_sizes; i++) {
+        if (bench_size(node, opts, opts->sizes[i], &results[i]) != RET_OK)
+            return RET_ERR;
+    }
+    return RET_OK;
+}
@@ -0,0 +1,179 @@
+#define ZSTD_STATIC_LINKING_ONLY // ZSTD_customMem
+#include "easystorage_compress.h"
+#include "easystorage.h"
+#include "zstd.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define COMPRESS_BUF_SIZE (1024 * 1024)
+// Each worker holds a few MiB of zstd state and job buffers, so there's a cap on them.
+#define COMPRESS_MAX_WORKERS 4
+
+// As in PNG: the high bit and the line endings catch transfers that mangle binary data.
+static const unsigned char MAGIC[8] = {0x89, 'E', 'S', 'Z', '\r', '\n', 0x1a, '\n'};
+
+static void *zstd_alloc(void *opaque, size_t size) { return mem_alloc(opaque, size); }
+
+static void zstd_free(void *opaque, void *ptr) {
+    (void) opaque;
+    mem_free(ptr);
+}
+
+static bool cancelled_now(const int *cancelled) { return cancelled && __atomic_load_n(cancelled, __ATOMIC_ACQUIRE); }
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return RET_ERR;
+        p += n;
+        len -= (size_t) n;
+    }
+    return RET_OK;
+}
+
+// Threads to compress size bytes with: one for small inputs, where the per-job overhead
+// outweighs the gain, and otherwise one per CPU up to the cap.
+static int compress_workers(size_t size) {
+    if (size < COMPRESS_MT_MIN_SIZE)
+        return 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 1)
+        return 0;
+    return cpus < COMPRESS_MAX_WORKERS ? (int) cpus : COMPRESS_MAX_WORKERS;
+}
+
+int compress_file(const char *path, int fd, int level, mem_account *account, const int *cancelled,
+                  size_t *written) {
+    *written = 0;
+    int in_fd = open(path, O_RDONLY);
+    if (in_fd < 0)
+        return RET_ERR;
+    struct stat st;
+    if (fstat(in_fd, &st) != 0) {
+        close(in_fd);
+        return RET_ERR;
+    }
+
+    ZSTD_customMem cmem = {zstd_alloc, zstd_free, account};
+    ZSTD_CCtx *cctx = ZSTD_createCCtx_advanced(cmem);
+    char *in = mem_alloc(account, COMPRESS_BUF_SIZE);
+    char *out = mem_alloc(account, COMPRESS_BUF_SIZE);
+    int ret = cctx && in && out ? RET_OK : RET_ERR;
+
+    // The checksum lets downloads tell a damaged frame from a good one; the pledged size puts
+    // the original size in the frame header.
+    if (ret == RET_OK &&
+        (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level)) ||
+         ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1)) ||
+         ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(cctx, (unsigned long long) st.st_size))))
+        ret = RET_ERR;
+    int workers = compress_workers((size_t) st.st_size);
+    if (ret == RET_OK && workers > 0)
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, workers); // stays single-threaded if unsupported
+
+    if (ret == RET_OK)
+        ret = write_all(fd, MAGIC, sizeof(MAGIC));
+    size_t total = sizeof(MAGIC);
+
+    while (ret == RET_OK) {
+        ssize_t n = read(in_fd, in, COMPRESS_BUF_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || cancelled_now(cancelled)) {
+            ret = RET_ERR;
+            break;
+        }
+
+        ZSTD_EndDirective mode = n == 0 ? ZSTD_e_end : ZSTD_e_continue;
+        ZSTD_inBuffer ib = {in, (size_t) n, 0};
+        bool finished = false;
+        while (ret == RET_OK && !finished) {
+            ZSTD_outBuffer ob = {out, COMPRESS_BUF_SIZE, 0};
+            size_t left = ZSTD_compressStream2(cctx, &ob, &ib, mode);
+            if (ZSTD_isError(left) || write_all(fd, out, ob.pos) != RET_OK)
+                ret = RET_ERR;
+            total += ob.pos;
+            finished = mode == ZSTD_e_end ? left == 0 : ib.pos == ib.size;
+        }
+        if (n == 0)
+            break;
+    }
+
+    if (ret == RET_OK)
+        *written = total;
+    mem_free(in);
+    mem_free(out);
+    ZSTD_freeCCtx(cctx);
+    close(in_fd);
+    return ret;
+}
+
+bool is_compressed_head(const void *head, size_t len) {
+    // What compress_file writes: the magic prefix, then a frame with a checksum and the size.
+    ZSTD_frameHeader fh;
+    return len > sizeof(MAGIC) && memcmp(head, MAGIC, sizeof(MAGIC)) == 0 &&
+           ZSTD_getFrameHeader(&fh, (const char *) head + sizeof(MAGIC), len - sizeof(MAGIC)) == 0 &&
+           fh.frameType == ZSTD_frame && fh.checksumFlag && fh.frameContentSize != ZSTD_CONTENTSIZE_UNKNOWN;
+}
+
+bool is_compressed(int fd) {
+    unsigned char head[COMPRESSED_HEAD_SIZE];
+    ssize_t n = pread(fd, head, sizeof(head), 0);
+    return n > 0 && is_compressed_head(head, (size_t) n);
+}
+
+int decompress_file(int src, int dst, mem_account *account, const int *cancelled) {
+    if (!is_compressed(src))
+        return RET_ERR;
+
+    ZSTD_customMem cmem = {zstd_alloc, zstd_free, account};
+    ZSTD_DCtx *dctx = ZSTD_createDCtx_advanced(cmem);
+    char *in = mem_alloc(account, COMPRESS_BUF_SIZE);
+    char *out = mem_alloc(account, COMPRESS_BUF_SIZE);
+    int ret = dctx && in && out ? RET_OK : RET_ERR;
+
+    off_t offset = sizeof(MAGIC);
+    bool done = false; // the frame is complete
+    while (ret == RET_OK) {
+        ssize_t n = pread(src, in, COMPRESS_BUF_SIZE, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || cancelled_now(cancelled)) {
+            ret = RET_ERR;
+            break;
+        }
+        if (n == 0)
+            break;
+        offset += n;
+
+        // Output can be left to flush once the input is used up, hence the second condition.
+        ZSTD_inBuffer ib = {in, (size_t) n, 0};
+        ZSTD_outBuffer ob = {out, COMPRESS_BUF_SIZE, 0};
+        do {
+            ob.pos = 0;
+            size_t left = ZSTD_decompressStream(dctx, &ob, &ib);
+            if (ZSTD_isError(left) || write_all(dst, out, ob.pos) != RET_OK)
+                ret = RET_ERR;
+            done = left == 0;
+        } while (ret == RET_OK && !done && (ib.pos < ib.size || ob.pos == ob.size));
+        if (ret == RET_OK && done && (ib.pos < ib.size || pread(src, in, 1, offset) != 0))
+            ret = RET_ERR; // trailing data after the frame
+        if (done)
+            break;
+    }
+    if (!done)
+        ret = RET_ERR; // truncated
+
+    mem_free(in);
+    mem_free(out);
+    ZSTD_freeDCtx(dctx);
+    return ret;
+}
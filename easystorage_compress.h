@@ -0,0 +1,35 @@
+#ifndef EASYSTORAGE_COMPRESS_H
+#define EASYSTORAGE_COMPRESS_H
+
+// Internal: compressed content. Files uploaded with compression are stored as a magic prefix of
+// our own followed by a single zstd frame, so that downloads can tell them apart from content
+// that merely happens to be zstd (or anything else) and expand them.
+
+#include "easystorage_mem.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Inputs at least this large are compressed on several threads.
+#define COMPRESS_MT_MIN_SIZE (8 * 1024 * 1024)
+
+// Enough of the start of some content to tell whether it's compressed: the magic prefix and the
+// largest zstd frame header.
+#define COMPRESSED_HEAD_SIZE (8 + 18)
+
+// Compresses the file at path into fd at the given zstd level, leaving the number of bytes
+// written in *written. Allocations, zstd's included, are charged to account (may be NULL).
+// Gives up with RET_ERR as soon as *cancelled (may be NULL) is set.
+int compress_file(const char *path, int fd, int level, mem_account *account, const int *cancelled,
+                  size_t *written);
+// Whether content starting with head (len bytes, or all of it if shorter than
+// COMPRESSED_HEAD_SIZE) is compressed: the magic prefix followed by a frame header as
+// compress_file writes it.
+bool is_compressed_head(const void *head, size_t len);
+// Whether the file behind fd is compressed. Reads from its start.
+bool is_compressed(int fd);
+// Expands the compressed content in src (from its start) into dst. Fails on anything but
+// exactly one complete frame with a matching checksum.
+int decompress_file(int src, int dst, mem_account *account, const int *cancelled);
+
+#endif // EASYSTORAGE_COMPRESS_H
@@ -0,0 +1,342 @@
+#include "easystorage.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CID_MAX 256
+
+typedef struct {
+    char *cid;
+    long long expires;      // unix time in seconds, or -1 once forgotten
+    unsigned long long seq; // order of the put, so the latest one for a CID wins
+} gc_entry;
+
+typedef struct {
+    STORAGE_NODE node;
+    char index_file[PATH_MAX];
+    FILE *log; // index_file, opened for appending records
+
+    pthread_mutex_t collect_lock; // one collection at a time
+    pthread_mutex_t lock;         // guards everything below
+    gc_entry *entries;            // sorted by cid up to n_sorted, then in the order put
+    size_t n_entries;
+    size_t n_sorted;
+    size_t n_forgotten; // entries in the sorted part with expires -1
+    size_t cap;
+    unsigned long long seq;
+    int deleted;
+    int failed;
+} storage_gc;
+
+// --- Entries ---
+// Puts are appended and merged into the sorted part in batches, so tracking many CIDs stays
+// O(log N) per CID instead of shifting the array on every insert.
+
+static int entry_cmp(const void *a, const void *b) {
+    const gc_entry *x = a, *y = b;
+    int c = strcmp(x->cid, y->cid);
+    if (c != 0)
+        return c;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Sorts the appended entries into the rest, keeping the latest entry per CID and dropping
+// forgotten ones. Must be called with g->lock held.
+static void entries_settle(storage_gc *g) {
+    if (g->n_sorted == g->n_entries && g->n_forgotten == 0)
+        return;
+
+    gc_entry *e = g->entries;
+    size_t n = g->n_entries, tail = n - g->n_sorted;
+    qsort(e + g->n_sorted, tail, sizeof(gc_entry), entry_cmp);
+    gc_entry *merged = tail > 0 && g->n_sorted > 0 ? malloc(g->cap * sizeof(gc_entry)) : NULL;
+    if (merged) {
+        size_t i = 0, j = g->n_sorted, k = 0;
+        while (i < g->n_sorted && j < n) {
+            merged[k++] = entry_cmp(&e[i], &e[j]) <= 0 ? e[i++] : e[j++];
+        }
+        while (i < g->n_sorted) merged[k++] = e[i++];
+        while (j < n) merged[k++] = e[j++];
+        free(e);
+        g->entries = e = merged;
+    } else if (tail > 0 && g->n_sorted > 0) {
+        qsort(e, n, sizeof(gc_entry), entry_cmp);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+        if ((i + 1 < n && strcmp(e[i].cid, e[i + 1].cid) == 0) || e[i].expires < 0) {
+            free(e[i].cid);
+            continue;
+        }
+        e[kept++] = e[i];
+    }
+    g->n_entries = g->n_sorted = kept;
+    g->n_forgotten = 0;
+}
+
+// Returns the index of cid, or where it would be inserted (with *found = false).
+// Must be called with g->lock held, after entries_settle.
+static size_t entry_find(storage_gc *g, const char *cid, bool *found) {
+    size_t lo = 0, hi = g->n_sorted;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = strcmp(cid, g->entries[mid].cid);
+        if (c == 0) {
+            *found = true;
+            return mid;
+        }
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    *found = false;
+    return lo;
+}
+
+// Records an expiry for cid, or with expires -1 that it was forgotten. Must be called with
+// g->lock held.
+static int entry_put(storage_gc *g, const char *cid, long long expires) {
+    if (g->n_entries == g->cap) {
+        size_t cap = g->cap ? g->cap * 2 : 64;
+        gc_entry *entries = realloc(g->entries, cap * sizeof(gc_entry));
+        if (!entries)
+            return RET_ERR;
+        g->entries = entries;
+        g->cap = cap;
+    }
+    char *copy = strdup(cid);
+    if (!copy)
+        return RET_ERR;
+    g->entries[g->n_entries++] = (gc_entry) {.cid = copy, .expires = expires, .seq = g->seq++};
+    // Merge once the unsorted part has grown as large as the sorted one.
+    if (g->n_entries - g->n_sorted >= 64 && g->n_entries - g->n_sorted >= g->n_sorted)
+        entries_settle(g);
+    return RET_OK;
+}
+
+// Forgets the entry at i, found by entry_find; it is dropped at the next settle. Must be called
+// with g->lock held.
+static void entry_forget(storage_gc *g, size_t i) {
+    if (g->entries[i].expires >= 0) {
+        g->entries[i].expires = -1;
+        g->n_forgotten++;
+    }
+}
+
+// --- Index file ---
+// One record per line: <expiry in unix seconds> TAB <cid>. Records are appended as CIDs are
+// tracked, a later one replacing an earlier one for the same CID, and an expiry of -1 meaning
+// the CID was forgotten. The file is compacted when opened and after each collection.
+
+static int index_load(storage_gc *g) {
+    FILE *fp = fopen(g->index_file, "r");
+    if (!fp)
+        return errno == ENOENT ? RET_OK : RET_ERR;
+
+    char line[CID_MAX + 32];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *expires = strtok(line, "\t");
+        char *cid = strtok(NULL, "");
+        if (!expires || !cid)
+            continue;
+        long long at = atoll(expires);
+        entry_put(g, cid, at < 0 ? -1 : at);
+    }
+    fclose(fp);
+    return RET_OK;
+}
+
+// Rewrites the index with one record per tracked CID and reopens it for appending. Must be
+// called with g->lock held.
+static int index_compact(storage_gc *g) {
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g->index_file);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return RET_ERR;
+
+    entries_settle(g);
+    for (size_t i = 0; i < g->n_entries; i++) {
+        fprintf(fp, "%lld\t%s\n", g->entries[i].expires, g->entries[i].cid);
+    }
+
+    bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp, g->index_file) != 0) {
+        unlink(tmp);
+        return RET_ERR;
+    }
+
+    if (g->log)
+        fclose(g->log);
+    g->log = fopen(g->index_file, "a");
+    return g->log ? RET_OK : RET_ERR;
+}
+
+// Must be called with g->lock held.
+static int index_append(storage_gc *g, const char *cid, long long expires) {
+    if (!g->log)
+        return RET_ERR;
+    if (fprintf(g->log, "%lld\t%s\n", expires, cid) < 0 || fflush(g->log) != 0)
+        return RET_ERR;
+    return RET_OK;
+}
+
+// --- API ---
+
+STORAGE_GC e_storage_gc_new(STORAGE_NODE node, const char *index_file) {
+    if (!node || !index_file)
+        return NULL;
+
+    storage_gc *g = calloc(1, sizeof(storage_gc));
+    if (!g)
+        return NULL;
+    g->node = node;
+    pthread_mutex_init(&g->collect_lock, NULL);
+    pthread_mutex_init(&g->lock, NULL);
+
+    if (snprintf(g->index_file, sizeof(g->index_file), "%s", index_file) >= (int) sizeof(g->index_file) ||
+        index_load(g) != RET_OK || index_compact(g) != RET_OK) {
+        e_storage_gc_destroy(g);
+        return NULL;
+    }
+    return g;
+}
+
+int e_storage_gc_track(STORAGE_GC gc, const char *cid, long long ttl_seconds) {
+    if (!gc || !cid || !*cid || strlen(cid) >= CID_MAX || strchr(cid, '\n') || ttl_seconds < 0)
+        return RET_ERR;
+    storage_gc *g = gc;
+    long long expires = (long long) time(NULL) + ttl_seconds;
+
+    pthread_mutex_lock(&g->lock);
+    int ret = index_append(g, cid, expires);
+    if (ret == RET_OK)
+        ret = entry_put(g, cid, expires);
+    pthread_mutex_unlock(&g->lock);
+    return ret;
+}
+
+int e_storage_gc_forget(STORAGE_GC gc, const char *cid) {
+    if (!gc || !cid)
+        return RET_ERR;
+    storage_gc *g = gc;
+
+    pthread_mutex_lock(&g->lock);
+    // Entries already forgotten can stay until the next settle; they don't get in a lookup's way.
+    if (g->n_sorted < g->n_entries)
+        entries_settle(g);
+    bool found;
+    size_t i = entry_find(g, cid, &found);
+    int ret = found && g->entries[i].expires >= 0 ? index_append(g, cid, -1) : RET_ERR;
+    if (ret == RET_OK)
+        entry_forget(g, i);
+    pthread_mutex_unlock(&g->lock);
+    return ret;
+}
+
+int e_storage_gc_collect(STORAGE_GC gc, int concurrency) {
+    if (!gc)
+        return RET_ERR;
+    storage_gc *g = gc;
+    pthread_mutex_lock(&g->collect_lock);
+
+    // Take a snapshot of what has expired, so that tracking can go on during the deletes.
+    long long now = time(NULL);
+    pthread_mutex_lock(&g->lock);
+    entries_settle(g);
+    size_t n = 0;
+    for (size_t i = 0; i < g->n_entries; i++) {
+        n += g->entries[i].expires <= now;
+    }
+    char **cids = calloc(n > 0 ? n : 1, sizeof(char *));
+    int *status = calloc(n > 0 ? n : 1, sizeof(int));
+    bool ok = cids && status;
+    for (size_t i = 0, j = 0; ok && i < g->n_entries; i++) {
+        if (g->entries[i].expires <= now && !(cids[j++] = strdup(g->entries[i].cid)))
+            ok = false;
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    int ret = ok ? e_storage_delete_many(g->node, (const char *const *) cids, n, concurrency, status) : RET_ERR;
+    // Content deleted behind the index's back would otherwise fail every collection from now on.
+    if (ok && ret != RET_OK) {
+        ret = RET_OK;
+        for (size_t i = 0; i < n; i++) {
+            bool exists = true;
+            if (status[i] != RET_OK && e_storage_exists(g->node, cids[i], &exists) == RET_OK && !exists)
+                status[i] = RET_OK;
+            if (status[i] != RET_OK)
+                ret = RET_ERR;
+        }
+    }
+
+    pthread_mutex_lock(&g->lock);
+    if (ok) {
+        entries_settle(g);
+        for (size_t i = 0; i < n; i++) {
+            bool found;
+            size_t idx = entry_find(g, cids[i], &found);
+            if (status[i] != RET_OK) {
+                g->failed++;
+                continue;
+            }
+            g->deleted++;
+            // Unless it was tracked again in the meantime.
+            if (found && g->entries[idx].expires <= now)
+                entry_forget(g, idx);
+        }
+        if (n > 0 && index_compact(g) != RET_OK)
+            ret = RET_ERR;
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    for (size_t i = 0; cids && i < n; i++) {
+        free(cids[i]);
+    }
+    free(cids);
+    free(status);
+    pthread_mutex_unlock(&g->collect_lock);
+    return ret;
+}
+
+void e_storage_gc_stats(STORAGE_GC gc, gc_stats *stats) {
+    if (!gc || !stats)
+        return;
+    storage_gc *g = gc;
+    long long now = time(NULL);
+
+    pthread_mutex_lock(&g->lock);
+    entries_settle(g);
+    *stats = (gc_stats) {.tracked = g->n_entries, .deleted = g->deleted, .failed = g->failed};
+    for (size_t i = 0; i < g->n_entries; i++) {
+        stats->expired += g->entries[i].expires <= now;
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+void e_storage_gc_destroy(STORAGE_GC gc) {
+    if (!gc)
+        return;
+    storage_gc *g = gc;
+
+    for (size_t i = 0; i < g->n_entries; i++) {
+        free(g->entries[i].cid);
+    }
+    if (g->log)
+        fclose(g->log);
+    free(g->entries);
+    pthread_mutex_destroy(&g->lock);
+    pthread_mutex_destroy(&g->collect_lock);
+    free(g);
+}
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE // O_DIRECT
+#include "easystorage_io.h"
+#include "easystorage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef EASYSTORAGE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#endif
+
+// Buffers of SINK_BUF_SIZE each; with io_uring, all but the one being filled can be in flight.
+#define SINK_BUFFERS 8
+#define SINK_BUF_SIZE (1024 * 1024)
+// Full buffers queued before they are submitted together.
+#define SINK_BATCH 4
+// O_DIRECT needs buffers, offsets and lengths aligned to the device's block size; this covers it.
+#define SINK_ALIGN 4096
+
+typedef struct {
+    char *data;
+    size_t offset; // where in the file the buffer starts
+    size_t len;    // bytes of data gathered
+    size_t io_len; // bytes written out, including padding at the end of an O_DIRECT file
+    bool busy;     // being written
+} sink_buf;
+
+#ifdef EASYSTORAGE_IO_URING
+typedef struct {
+    int fd;
+    bool fixed; // buffers are registered
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned to_submit;
+    int inflight;
+} uring;
+#endif
+
+struct file_sink {
+    int fd;
+    bool direct;
+    bool failed;
+    void *mem; // backs the buffers
+    sink_buf bufs[SINK_BUFFERS];
+    int cur;    // buffer being filled, or -1
+    size_t end; // where the next chunk goes
+    size_t written;
+#ifdef EASYSTORAGE_IO_URING
+    bool use_uring;
+    uring ring;
+#endif
+};
+
+// Turns O_DIRECT off again, for filesystems that accept the flag but not the writes.
+static void drop_direct(file_sink *s) {
+    int fl = fcntl(s->fd, F_GETFL);
+    if (fl >= 0)
+        fcntl(s->fd, F_SETFL, fl & ~O_DIRECT);
+    s->direct = false;
+}
+
+static int write_all(file_sink *s, const char *data, size_t len, size_t offset) {
+    for (size_t done = 0; done < len;) {
+        ssize_t n = pwrite(s->fd, data + done, len - done, (off_t) (offset + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL && s->direct) {
+            drop_direct(s);
+            continue;
+        }
+        if (n <= 0)
+            return RET_ERR;
+        done += n;
+    }
+    return RET_OK;
+}
+
+// Accounts for a finished write of b, res being the bytes written or -errno. Short writes,
+// and writes the kernel or filesystem refused (e.g. O_DIRECT on tmpfs), are finished with pwrite.
+static void buf_done(file_sink *s, sink_buf *b, long res) {
+    if (res == -EINVAL || res == -EOPNOTSUPP) {
+        if (s->direct)
+            drop_direct(s);
+        res = 0;
+    }
+    if (res < 0 || ((size_t) res < b->io_len &&
+                    write_all(s, b->data + res, b->io_len - res, b->offset + res) != RET_OK))
+        s->failed = true;
+    else
+        s->written += b->len;
+    b->busy = false;
+}
+
+// --- io_uring ---
+
+#ifdef EASYSTORAGE_IO_URING
+
+static int uring_setup(uring *r, file_sink *s) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int) syscall(__NR_io_uring_setup, SINK_BUFFERS, &p);
+    if (r->fd < 0)
+        return RET_ERR;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && r->cq_ring_size > r->sq_ring_size)
+        r->sq_ring_size = r->cq_ring_size;
+    r->sq_ring =
+        mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        return RET_ERR;
+    }
+    r->cq_ring = single ? r->sq_ring
+                        : mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                               IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+        r->cq_ring = NULL;
+        return RET_ERR;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        return RET_ERR;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // Registered buffers spare the kernel mapping them on every write; without them (e.g. over
+    // RLIMIT_MEMLOCK on older kernels), plain writes from the same buffers still work.
+    struct iovec iov[SINK_BUFFERS];
+    for (int i = 0; i < SINK_BUFFERS; i++) {
+        iov[i] = (struct iovec) {.iov_base = s->bufs[i].data, .iov_len = SINK_BUF_SIZE};
+    }
+    r->fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, SINK_BUFFERS) == 0;
+    return RET_OK;
+}
+
+static void uring_teardown(uring *r) {
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring)
+        munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0)
+        close(r->fd);
+}
+
+static void uring_queue(file_sink *s, int i) {
+    uring *r = &s->ring;
+    sink_buf *b = &s->bufs[i];
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = s->fd;
+    sqe->addr = (uint64_t) (uintptr_t) b->data;
+    sqe->len = (uint32_t) b->io_len;
+    sqe->off = b->offset;
+    sqe->buf_index = (uint16_t) i;
+    sqe->user_data = (uint64_t) i;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    r->inflight++;
+}
+
+static void uring_reap(file_sink *s) {
+    uring *r = &s->ring;
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        buf_done(s, &s->bufs[cqe->user_data], cqe->res);
+        r->inflight--;
+        head++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Called when the kernel won't take more submissions for now (EAGAIN/EBUSY: the completion
+// queue is overflowing, or it's short of memory). Makes room by reaping, or by waiting for a
+// write in flight to complete, rather than letting the caller resubmit straight away.
+static int uring_backoff(file_sink *s) {
+    uring *r = &s->ring;
+    unsigned inflight = r->inflight;
+    uring_reap(s);
+    if (r->inflight < inflight)
+        return RET_OK;
+    if (r->inflight == 0) {
+        nanosleep(&(struct timespec) {.tv_nsec = 1000000}, NULL);
+        return RET_OK;
+    }
+    long n = syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        return RET_ERR;
+    uring_reap(s);
+    return RET_OK;
+}
+
+// Submits what's queued and, with wait set, waits for at least one write to complete.
+static int uring_enter(file_sink *s, bool wait) {
+    uring *r = &s->ring;
+    while (1) {
+        unsigned min = wait && r->inflight > 0 ? 1 : 0;
+        long n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, min, min ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EBUSY)) {
+            if (uring_backoff(s) != RET_OK)
+                return RET_ERR;
+            continue;
+        }
+        if (n < 0)
+            return RET_ERR;
+        r->to_submit -= (unsigned) n;
+        uring_reap(s);
+        return RET_OK;
+    }
+}
+
+#endif // EASYSTORAGE_IO_URING
+
+// --- Sink ---
+
+// Starts writing out buffer i.
+static void buf_submit(file_sink *s, int i) {
+    sink_buf *b = &s->bufs[i];
+    b->busy = true;
+#ifdef EASYSTORAGE_IO_URING
+    if (s->use_uring) {
+        uring_queue(s, i);
+        if (s->ring.to_submit >= SINK_BATCH && uring_enter(s, false) != RET_OK)
+            s->failed = true;
+        return;
+    }
+#endif
+    buf_done(s, b, write_all(s, b->data, b->io_len, b->offset) == RET_OK ? (long) b->io_len : -EIO);
+}
+
+// Returns a free buffer to fill, waiting for one if all are being written.
+static int buf_acquire(file_sink *s) {
+    while (1) {
+        for (int i = 0; i < SINK_BUFFERS; i++) {
+            if (!s->bufs[i].busy)
+                return i;
+        }
+#ifdef EASYSTORAGE_IO_URING
+        if (s->use_uring && uring_enter(s, true) == RET_OK)
+            continue;
+#endif
+        return -1;
+    }
+}
+
+file_sink *sink_open(int fd, int flags, mem_account *account) {
+    file_sink *s = mem_calloc(account, 1, sizeof(file_sink));
+    if (!s)
+        return NULL;
+    s->fd = fd;
+    s->cur = -1;
+    s->mem = mem_alloc(account, SINK_BUFFERS * SINK_BUF_SIZE + SINK_ALIGN);
+    if (!s->mem) {
+        mem_free(s);
+        return NULL;
+    }
+    char *base = (char *) (((uintptr_t) s->mem + SINK_ALIGN - 1) & ~(uintptr_t) (SINK_ALIGN - 1));
+    for (int i = 0; i < SINK_BUFFERS; i++) {
+        s->bufs[i].data = base + (size_t) i * SINK_BUF_SIZE;
+    }
+
+    if (flags & SINK_DIRECT) {
+        int fl = fcntl(fd, F_GETFL);
+        s->direct = fl >= 0 && fcntl(fd, F_SETFL, fl | O_DIRECT) == 0;
+    }
+
+#ifdef EASYSTORAGE_IO_URING
+    s->ring.fd = -1;
+    if (!(flags & SINK_NO_URING)) {
+        s->use_uring = uring_setup(&s->ring, s) == RET_OK;
+        if (!s->use_uring) {
+            uring_teardown(&s->ring);
+            memset(&s->ring, 0, sizeof(s->ring));
+            s->ring.fd = -1;
+        }
+    }
+#endif
+    return s;
+}
+
+int sink_write(file_sink *s, const char *data, size_t len, size_t offset) {
+    if (!s || s->failed || offset != s->end)
+        return RET_ERR;
+
+    while (len > 0) {
+        if (s->cur < 0) {
+            s->cur = buf_acquire(s);
+            if (s->cur < 0) {
+                s->failed = true;
+                return RET_ERR;
+            }
+            s->bufs[s->cur].offset = s->end;
+            s->bufs[s->cur].len = 0;
+        }
+        sink_buf *b = &s->bufs[s->cur];
+        size_t n = len < SINK_BUF_SIZE - b->len ? len : SINK_BUF_SIZE - b->len;
+        memcpy(b->data + b->len, data, n);
+        b->len += n;
+        data += n;
+        len -= n;
+        s->end += n;
+        if (b->len == SINK_BUF_SIZE) {
+            b->io_len = b->len;
+            buf_submit(s, s->cur);
+            s->cur = -1;
+        }
+    }
+    return s->failed ? RET_ERR : RET_OK;
+}
+
+int sink_finish(file_sink *s) {
+    if (!s)
+        return RET_ERR;
+
+    // With O_DIRECT, the tail is written padded to the alignment and the file trimmed after.
+    bool padded = false;
+    if (s->cur >= 0 && s->bufs[s->cur].len > 0) {
+        sink_buf *b = &s->bufs[s->cur];
+        b->io_len = b->len;
+        if (s->direct && b->len % SINK_ALIGN != 0) {
+            b->io_len = (b->len + SINK_ALIGN - 1) / SINK_ALIGN * SINK_ALIGN;
+            memset(b->data + b->len, 0, b->io_len - b->len);
+            padded = true;
+        }
+        buf_submit(s, s->cur);
+    }
+    s->cur = -1;
+
+#ifdef EASYSTORAGE_IO_URING
+    while (s->use_uring && (s->ring.inflight > 0 || s->ring.to_submit > 0)) {
+        if (uring_enter(s, true) != RET_OK) {
+            s->failed = true;
+            break;
+        }
+    }
+#endif
+    if (padded && ftruncate(s->fd, (off_t) s->end) != 0)
+        s->failed = true;
+    return s->failed ? RET_ERR : RET_OK;
+}
+
+size_t sink_written(file_sink *s) { return s ? s->written : 0; }
+
+const char *sink_engine(file_sink *s) {
+#ifdef EASYSTORAGE_IO_URING
+    if (s && s->use_uring)
+        return "io_uring";
+#endif
+    return "pwrite";
+}
+
+void sink_free(file_sink *s) {
+    if (!s)
+        return;
+#ifdef EASYSTORAGE_IO_URING
+    // The kernel may still be reading from the buffers.
+    while (s->use_uring && s->ring.inflight > 0 && uring_enter(s, true) == RET_OK) {
+    }
+    uring_teardown(&s->ring);
+#endif
+    mem_free(s->mem);
+    mem_free(s);
+}
@@ -0,0 +1,163 @@
+#include "easystorage_mem.h"
+#include "easystorage.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Every block starts with a header recording its size and account, so that it can be
+// credited back on release. Keeps the payload aligned like malloc's.
+typedef union {
+    struct {
+        size_t size;
+        mem_account *account;
+    } h;
+    max_align_t align;
+} mem_header;
+
+static void *libc_alloc(void *ctx, size_t size) { return malloc(size); }
+static void libc_release(void *ctx, void *ptr) { free(ptr); }
+
+static storage_allocator allocator = {libc_alloc, libc_release, NULL};
+static size_t total;
+// Blocks allocated and not released yet, those being allocated included, or -1 while the
+// allocator is being swapped. allocator is only read with a block counted here.
+static long blocks;
+
+// Counts a block about to be allocated, waiting out a swap of the allocator.
+static void blocks_take(void) {
+    long n = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+    do {
+        for (; n < 0; n = __atomic_load_n(&blocks, __ATOMIC_RELAXED)) sched_yield();
+    } while (!__atomic_compare_exchange_n(&blocks, &n, n + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+}
+
+static void blocks_drop(void) { __atomic_sub_fetch(&blocks, 1, __ATOMIC_RELEASE); }
+
+int e_storage_set_allocator(const storage_allocator *a) {
+    if (a && (!a->alloc || !a->release))
+        return RET_ERR;
+    // Blocks must go back to the allocator they came from, so it can only change while none
+    // are held or being allocated; those allocations wait until it has.
+    long idle = 0;
+    if (!__atomic_compare_exchange_n(&blocks, &idle, -1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return RET_ERR;
+    allocator = a ? *a : (storage_allocator) {libc_alloc, libc_release, NULL};
+    __atomic_store_n(&blocks, 0, __ATOMIC_RELEASE);
+    return RET_OK;
+}
+
+size_t mem_total(void) { return __atomic_load_n(&total, __ATOMIC_RELAXED); }
+
+void mem_account_init(mem_account *a) {
+    memset(a, 0, sizeof(*a));
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cond, NULL);
+}
+
+void mem_account_destroy(mem_account *a) {
+    pthread_cond_destroy(&a->cond);
+    pthread_mutex_destroy(&a->lock);
+}
+
+static bool over_limit(mem_account *a) {
+    size_t limit = __atomic_load_n(&a->limit, __ATOMIC_RELAXED);
+    return limit > 0 && __atomic_load_n(&a->used, __ATOMIC_SEQ_CST) >= limit;
+}
+
+int mem_admit(mem_account *a, int timeout_ms) {
+    if (!a || !over_limit(a))
+        return RET_OK;
+    if (!__atomic_load_n(&a->wait, __ATOMIC_RELAXED))
+        return RET_ERR;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&a->lock);
+    // Registered before re-checking, so that mem_free either sees the waiter or we see its release.
+    __atomic_add_fetch(&a->waiters, 1, __ATOMIC_SEQ_CST);
+    int ret = RET_OK;
+    while (over_limit(a) && ret == RET_OK) {
+        if (pthread_cond_timedwait(&a->cond, &a->lock, &deadline) != 0 && over_limit(a))
+            ret = RET_ERR;
+    }
+    __atomic_sub_fetch(&a->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&a->lock);
+    return ret;
+}
+
+void *mem_alloc(mem_account *a, size_t size) {
+    if (size > SIZE_MAX - sizeof(mem_header))
+        return NULL;
+    blocks_take();
+    mem_header *h = allocator.alloc(allocator.ctx, sizeof(mem_header) + size);
+    if (!h) {
+        blocks_drop();
+        return NULL;
+    }
+    h->h.size = size;
+    h->h.account = a;
+    __atomic_add_fetch(&total, size, __ATOMIC_RELAXED);
+    if (a)
+        __atomic_add_fetch(&a->used, size, __ATOMIC_RELAXED);
+    return h + 1;
+}
+
+void *mem_calloc(mem_account *a, size_t n, size_t size) {
+    if (size != 0 && n > SIZE_MAX / size)
+        return NULL;
+    void *p = mem_alloc(a, n * size);
+    if (p)
+        memset(p, 0, n * size);
+    return p;
+}
+
+void *mem_realloc(mem_account *a, void *p, size_t size) {
+    if (!p)
+        return mem_alloc(a, size);
+    mem_header *old = (mem_header *) p - 1;
+    void *q = mem_alloc(a, size);
+    if (!q)
+        return NULL;
+    memcpy(q, p, old->h.size < size ? old->h.size : size);
+    mem_free(p);
+    return q;
+}
+
+char *mem_strndup(mem_account *a, const char *s, size_t len) {
+    char *copy = mem_alloc(a, len + 1);
+    if (copy) {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+char *mem_strdup(mem_account *a, const char *s) { return mem_strndup(a, s, strlen(s)); }
+
+void mem_free(void *p) {
+    if (!p)
+        return;
+    mem_header *h = (mem_header *) p - 1;
+    mem_account *a = h->h.account;
+    size_t size = h->h.size;
+    allocator.release(allocator.ctx, h);
+    blocks_drop();
+
+    __atomic_sub_fetch(&total, size, __ATOMIC_RELAXED);
+    if (a) {
+        __atomic_sub_fetch(&a->used, size, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&a->waiters, __ATOMIC_SEQ_CST) > 0) {
+            pthread_mutex_lock(&a->lock);
+            pthread_cond_broadcast(&a->cond);
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef EASYSTORAGE_MEM_H
+#define EASYSTORAGE_MEM_H
+
+// Internal: allocations made through the allocator set with e_storage_set_allocator, with
+// accounting of the bytes held, in total and per account (one per node).
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    size_t used;  // bytes currently allocated against this account
+    size_t limit; // 0 for none
+    bool wait;    // at the limit, mem_admit waits rather than failing
+    int waiters;
+    pthread_mutex_t lock; // only guards waiting; never held while taking other locks
+    pthread_cond_t cond;
+} mem_account;
+
+void mem_account_init(mem_account *a);
+void mem_account_destroy(mem_account *a);
+
+// Returns RET_OK if the account is below its limit, waiting for (at most timeout_ms for)
+// memory to be released if it's set to wait. Used before starting new operations only, so
+// that the ones already running can always finish.
+int mem_admit(mem_account *a, int timeout_ms);
+
+// Allocates memory charged to a (which may be NULL to only count it in the total).
+void *mem_alloc(mem_account *a, size_t size);
+void *mem_calloc(mem_account *a, size_t n, size_t size);
+// Grows or shrinks p (which may be NULL) into a block charged to a.
+void *mem_realloc(mem_account *a, void *p, size_t size);
+char *mem_strdup(mem_account *a, const char *s);
+char *mem_strndup(mem_account *a, const char *s, size_t len);
+// Releases p, crediting the account it was allocated against.
+void mem_free(void *p);
+
+// Bytes allocated through mem_* and not released yet, across all accounts.
+size_t mem_total(void);
+
+#endif // EASYSTORAGE_MEM_H
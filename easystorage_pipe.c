@@ -0,0 +1,319 @@
+#include "easystorage_pipe.h"
+#include "easystorage.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+// How often a blocked push looks for stages that have timed out.
+#define PIPE_TICK_MS 50
+
+// Chunks form one list shared by all stages; each stage walks it with a cursor of its own,
+// and a chunk is freed once every stage that was running when it arrived is done with it.
+typedef struct pipe_chunk {
+    struct pipe_chunk *next;
+    size_t offset;
+    size_t len;
+    int pending; // stages that have yet to process it
+    char data[];
+} pipe_chunk;
+
+typedef struct {
+    pipe_stage_fn fn;
+    void *user;
+    int workers;
+    size_t max_queued;
+
+    pipe_chunk *cursor; // next chunk to hand out; NULL when caught up
+    size_t queued;      // bytes pushed but not processed yet
+    int status;
+    int timeout_ms;     // fail the stage when it holds pushes back this long without progress
+    long long moved_at; // when it last finished a chunk or had an empty queue
+    bool auxiliary;     // doesn't keep the pipeline going by itself
+
+    pthread_t *threads;
+    int started;
+} pipe_stage;
+
+struct chunk_pipe {
+    mem_account *account;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pipe_chunk *head;
+    pipe_chunk *tail;
+    pipe_stage stages[PIPE_MAX_STAGES];
+    int n_stages;
+    bool started;
+    bool closed;
+    bool finished;
+    bool aborted;
+};
+
+typedef struct {
+    chunk_pipe *pipe;
+    pipe_stage *stage;
+} worker_arg;
+
+chunk_pipe *pipe_new(mem_account *account) {
+    chunk_pipe *p = mem_calloc(account, 1, sizeof(chunk_pipe));
+    if (!p)
+        return NULL;
+    p->account = account;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    return p;
+}
+
+int pipe_add_stage(chunk_pipe *p, pipe_stage_fn fn, void *user, int workers, size_t max_queued) {
+    if (!p || !fn || workers <= 0 || p->started || p->n_stages == PIPE_MAX_STAGES)
+        return RET_ERR;
+    p->stages[p->n_stages++] = (pipe_stage) {.fn = fn, .user = user, .workers = workers, .max_queued = max_queued};
+    return RET_OK;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int pipe_set_timeout(chunk_pipe *p, int stage, int timeout_ms) {
+    if (!p || p->started || stage < 0 || stage >= p->n_stages)
+        return RET_ERR;
+    p->stages[stage].timeout_ms = timeout_ms;
+    return RET_OK;
+}
+
+int pipe_set_auxiliary(chunk_pipe *p, int stage) {
+    if (!p || p->started || stage < 0 || stage >= p->n_stages)
+        return RET_ERR;
+    p->stages[stage].auxiliary = true;
+    return RET_OK;
+}
+
+// Frees the chunks at the head of the list that no stage needs anymore. Must be called
+// with p->lock held.
+static void reap(chunk_pipe *p) {
+    while (p->head && p->head->pending == 0) {
+        pipe_chunk *c = p->head;
+        p->head = c->next;
+        if (!p->head)
+            p->tail = NULL;
+        mem_free(c);
+    }
+}
+
+// Takes a failed stage out of the pipeline, releasing the chunks it won't process.
+// Must be called with p->lock held.
+static void stage_fail(chunk_pipe *p, pipe_stage *s) {
+    s->status = RET_ERR;
+    for (pipe_chunk *c = s->cursor; c; c = c->next) {
+        c->pending--;
+        s->queued -= c->len;
+    }
+    s->cursor = NULL;
+    reap(p);
+}
+
+static void *pipe_worker(void *arg) {
+    chunk_pipe *p = ((worker_arg *) arg)->pipe;
+    pipe_stage *s = ((worker_arg *) arg)->stage;
+    mem_free(arg);
+
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (!s->cursor && !p->closed && s->status == RET_OK) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        pipe_chunk *c = s->cursor;
+        if (!c)
+            break;
+        s->cursor = c->next;
+        pthread_mutex_unlock(&p->lock);
+
+        int ret = s->fn(s->user, c->data, c->len, c->offset);
+
+        pthread_mutex_lock(&p->lock);
+        c->pending--;
+        s->queued -= c->len;
+        s->moved_at = now_ms();
+        if (ret != RET_OK && s->status == RET_OK)
+            stage_fail(p, s);
+        reap(p);
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+int pipe_start(chunk_pipe *p) {
+    if (!p || p->started)
+        return RET_ERR;
+    p->started = true;
+
+    int ret = RET_OK;
+    for (int i = 0; i < p->n_stages; i++) {
+        pipe_stage *s = &p->stages[i];
+        s->moved_at = now_ms();
+        s->threads = mem_calloc(p->account, s->workers, sizeof(pthread_t));
+        for (; s->threads && s->started < s->workers; s->started++) {
+            worker_arg *arg = mem_alloc(p->account, sizeof(worker_arg));
+            if (!arg)
+                break;
+            *arg = (worker_arg) {p, s};
+            if (pthread_create(&s->threads[s->started], NULL, pipe_worker, arg) != 0) {
+                mem_free(arg);
+                break;
+            }
+        }
+        if (s->started == 0) {
+            s->status = RET_ERR;
+            ret = RET_ERR;
+        }
+    }
+    return ret;
+}
+
+// True if some running stage has no room for more data. Stages that have been full for longer
+// than their timeout are failed instead. Sets *timed if one of those holding pushes back has a
+// timeout, so that the caller wakes up to check it. Must be called with p->lock held.
+static bool pipe_full(chunk_pipe *p, bool *timed) {
+    bool full = false;
+    long long now = now_ms();
+    *timed = false;
+    for (int i = 0; i < p->n_stages; i++) {
+        pipe_stage *s = &p->stages[i];
+        if (s->status != RET_OK || s->queued == 0 || s->queued < s->max_queued)
+            continue;
+        if (s->timeout_ms > 0 && now - s->moved_at >= s->timeout_ms) {
+            stage_fail(p, s);
+            pthread_cond_broadcast(&p->cond);
+            continue;
+        }
+        full = true;
+        *timed = *timed || s->timeout_ms > 0;
+    }
+    return full;
+}
+
+// Waits on p->cond, for at most PIPE_TICK_MS if timed. Must be called with p->lock held.
+static void pipe_wait(chunk_pipe *p, bool timed) {
+    if (!timed) {
+        pthread_cond_wait(&p->cond, &p->lock);
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += PIPE_TICK_MS * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+}
+
+int pipe_push(chunk_pipe *p, const char *data, size_t len, size_t offset) {
+    if (!p || !p->started)
+        return RET_ERR;
+    pipe_chunk *c = mem_alloc(p->account, sizeof(pipe_chunk) + len);
+    if (!c)
+        return RET_ERR;
+    memcpy(c->data, data, len);
+    c->next = NULL;
+    c->offset = offset;
+    c->len = len;
+    c->pending = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (bool timed; !p->aborted && pipe_full(p, &timed);) {
+        pipe_wait(p, timed);
+    }
+    bool essential = false;
+    for (int i = 0; i < p->n_stages && !p->aborted; i++) {
+        essential = essential || (p->stages[i].status == RET_OK && !p->stages[i].auxiliary);
+    }
+    for (int i = 0; i < p->n_stages && essential; i++) {
+        pipe_stage *s = &p->stages[i];
+        if (s->status != RET_OK)
+            continue;
+        if (s->queued == 0)
+            s->moved_at = now_ms();
+        c->pending++;
+        s->queued += len;
+        if (!s->cursor)
+            s->cursor = c;
+    }
+    if (c->pending == 0) {
+        pthread_mutex_unlock(&p->lock);
+        mem_free(c);
+        return RET_ERR;
+    }
+    if (p->tail)
+        p->tail->next = c;
+    else
+        p->head = c;
+    p->tail = c;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return RET_OK;
+}
+
+void pipe_abort(chunk_pipe *p) {
+    if (!p)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->aborted = true;
+    for (int i = 0; i < p->n_stages; i++) {
+        if (p->stages[i].status == RET_OK)
+            stage_fail(p, &p->stages[i]);
+    }
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+int pipe_finish(chunk_pipe *p) {
+    if (!p)
+        return RET_ERR;
+    if (!p->finished) {
+        pthread_mutex_lock(&p->lock);
+        p->closed = true;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+
+        for (int i = 0; i < p->n_stages; i++) {
+            pipe_stage *s = &p->stages[i];
+            for (int j = 0; j < s->started; j++) {
+                pthread_join(s->threads[j], NULL);
+            }
+            mem_free(s->threads);
+            s->threads = NULL;
+        }
+        p->finished = true;
+    }
+
+    int ret = p->started ? RET_OK : RET_ERR;
+    for (int i = 0; i < p->n_stages; i++) {
+        if (p->stages[i].status != RET_OK)
+            ret = RET_ERR;
+    }
+    return ret;
+}
+
+int pipe_stage_status(chunk_pipe *p, int stage) {
+    if (!p || stage < 0 || stage >= p->n_stages)
+        return RET_ERR;
+    return p->stages[stage].status;
+}
+
+void pipe_free(chunk_pipe *p) {
+    if (!p)
+        return;
+    pipe_finish(p);
+    while (p->head) {
+        pipe_chunk *c = p->head;
+        p->head = c->next;
+        mem_free(c);
+    }
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    mem_free(p);
+}
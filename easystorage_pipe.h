@@ -0,0 +1,46 @@
+#ifndef EASYSTORAGE_PIPE_H
+#define EASYSTORAGE_PIPE_H
+
+// Internal: a chunk pipeline that hands the chunks of a transfer to consumer stages
+// running on worker threads of their own, so that disk writes, hashing etc. overlap
+// with the network instead of running on libstorage's thread.
+
+#include "easystorage_mem.h"
+
+#include <stddef.h>
+
+#define PIPE_MAX_STAGES 16
+
+// Processes one chunk found at offset in the transfer. Returns RET_OK, or RET_ERR to
+// drop out of the pipeline; later chunks are then discarded for this stage.
+typedef int (*pipe_stage_fn)(void *user, const char *data, size_t len, size_t offset);
+
+typedef struct chunk_pipe chunk_pipe;
+
+// Chunks and bookkeeping are charged to account (may be NULL).
+chunk_pipe *pipe_new(mem_account *account);
+// Adds a stage; only before pipe_start. With workers > 1, chunks are processed concurrently
+// and out of order, so that is only fit for stages that don't care (e.g. writes at offsets).
+// Pushes block while more than max_queued bytes are waiting for the stage.
+int pipe_add_stage(chunk_pipe *p, pipe_stage_fn fn, void *user, int workers, size_t max_queued);
+// Fails the stage (by its index) once it has held pushes back for timeout_ms without finishing
+// a chunk, so that one stuck consumer doesn't hold up the others. Only before pipe_start.
+int pipe_set_timeout(chunk_pipe *p, int stage, int timeout_ms);
+// Marks the stage as one that doesn't keep the pipeline going by itself (e.g. hashing for other
+// stages): pushes fail once only such stages are left. Only before pipe_start.
+int pipe_set_auxiliary(chunk_pipe *p, int stage);
+int pipe_start(chunk_pipe *p);
+// Copies the chunk and queues it for every stage still running. Returns RET_ERR once no
+// stage is left to take it, or the pipe was aborted.
+int pipe_push(chunk_pipe *p, const char *data, size_t len, size_t offset);
+// Fails all stages and wakes up a blocked push, which then returns RET_ERR. Workers stop after
+// the chunk they are processing. Safe to call from any thread.
+void pipe_abort(chunk_pipe *p);
+// Lets the stages drain their queues and joins their workers. Returns RET_OK if all succeeded.
+int pipe_finish(chunk_pipe *p);
+// RET_OK or RET_ERR for the given stage (in the order they were added).
+int pipe_stage_status(chunk_pipe *p, int stage);
+// Finishes the pipeline if needed and releases it.
+void pipe_free(chunk_pipe *p);
+
+#endif // EASYSTORAGE_PIPE_H
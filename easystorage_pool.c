@@ -0,0 +1,168 @@
+#include "easystorage.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    node_config config;
+    char data_dir[PATH_MAX];
+    STORAGE_NODE node;
+    bool checked_out;
+} pool_slot;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    int size;
+    pool_slot *slots;
+    bool closing;     // being destroyed: checkouts fail
+    int checking_out; // callers inside e_storage_pool_checkout, which destroy waits out
+} storage_pool;
+
+// Creates and starts the node for one slot. Runs on its own thread so that all
+// nodes in the pool come up in parallel.
+static void *slot_start(void *arg) {
+    pool_slot *slot = arg;
+    slot->node = e_storage_new(slot->config);
+    if (slot->node && e_storage_start(slot->node) != RET_OK) {
+        e_storage_destroy(slot->node);
+        slot->node = NULL;
+    }
+    return NULL;
+}
+
+static void pool_free(storage_pool *p) {
+    for (int i = 0; i < p->size; i++) {
+        if (p->slots[i].node) {
+            e_storage_stop(p->slots[i].node);
+            e_storage_destroy(p->slots[i].node);
+        }
+    }
+    pthread_cond_destroy(&p->available);
+    pthread_mutex_destroy(&p->lock);
+    free(p->slots);
+    free(p);
+}
+
+STORAGE_POOL e_storage_pool_new(node_config config, int size) {
+    if (size <= 0)
+        return NULL;
+
+    storage_pool *p = calloc(1, sizeof(storage_pool));
+    if (!p)
+        return NULL;
+    p->slots = calloc(size, sizeof(pool_slot));
+    pthread_t *threads = calloc(size, sizeof(pthread_t));
+    if (!p->slots || !threads) {
+        free(threads);
+        free(p->slots);
+        free(p);
+        return NULL;
+    }
+    p->size = size;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->available, NULL);
+
+    const char *base_dir = config.data_dir ? config.data_dir : DEFAULT_STORAGE_NODE_CONFIG.data_dir;
+    bool ok = true;
+    int started = 0;
+    for (int i = 0; i < size; i++) {
+        pool_slot *slot = &p->slots[i];
+        slot->config = config;
+        slot->config.api_port = config.api_port + i;
+        slot->config.disc_port = config.disc_port + i;
+        snprintf(slot->data_dir, sizeof(slot->data_dir), "%s/node-%d", base_dir, i);
+        slot->config.data_dir = slot->data_dir;
+
+        if (pthread_create(&threads[i], NULL, slot_start, slot) != 0) {
+            ok = false;
+            break;
+        }
+        started++;
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (!p->slots[i].node)
+            ok = false;
+    }
+    free(threads);
+
+    if (!ok) {
+        pool_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+STORAGE_NODE e_storage_pool_checkout(STORAGE_POOL pool) {
+    if (!pool)
+        return NULL;
+    storage_pool *p = pool;
+
+    STORAGE_NODE node = NULL;
+    pthread_mutex_lock(&p->lock);
+    p->checking_out++;
+    while (!node && !p->closing) {
+        for (int i = 0; i < p->size && !node; i++) {
+            if (!p->slots[i].checked_out) {
+                p->slots[i].checked_out = true;
+                node = p->slots[i].node;
+            }
+        }
+        if (!node)
+            pthread_cond_wait(&p->available, &p->lock);
+    }
+    if (--p->checking_out == 0 && p->closing)
+        pthread_cond_broadcast(&p->available);
+    pthread_mutex_unlock(&p->lock);
+    return node;
+}
+
+int e_storage_pool_checkin(STORAGE_POOL pool, STORAGE_NODE node) {
+    if (!pool || !node)
+        return RET_ERR;
+    storage_pool *p = pool;
+
+    int ret = RET_ERR;
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < p->size; i++) {
+        if (p->slots[i].node == node && p->slots[i].checked_out) {
+            p->slots[i].checked_out = false;
+            pthread_cond_signal(&p->available);
+            ret = RET_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+int e_storage_pool_size(STORAGE_POOL pool) { return pool ? ((storage_pool *) pool)->size : 0; }
+
+int e_storage_pool_destroy(STORAGE_POOL pool) {
+    if (!pool)
+        return RET_ERR;
+    storage_pool *p = pool;
+
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < p->size; i++) {
+        if (p->slots[i].checked_out) {
+            pthread_mutex_unlock(&p->lock);
+            return RET_ERR;
+        }
+    }
+    // Checkouts waiting for a node, e.g. woken by the last checkin but beaten to the lock by us,
+    // would otherwise touch the pool once freed. One that hasn't registered in checking_out yet
+    // isn't covered: checkouts must not be started concurrently with destroy.
+    p->closing = true;
+    pthread_cond_broadcast(&p->available);
+    while (p->checking_out > 0) pthread_cond_wait(&p->available, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+
+    pool_free(p);
+    return RET_OK;
+}
@@ -0,0 +1,36 @@
+#ifndef EASYSTORAGE_SHA256_H
+#define EASYSTORAGE_SHA256_H
+
+// Internal: SHA-256 (FIPS 180-4) for verifying downloads. Uses the x86 SHA extensions when the
+// CPU has them (checked at runtime), and a portable implementation otherwise.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE (2 * SHA256_DIGEST_SIZE + 1)
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+    size_t block_len;
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *ctx);
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// One-shot digest of a buffer.
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// Lowercase hex encoding of a digest, NUL-terminated.
+void sha256_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[SHA256_HEX_SIZE]);
+
+// Name of the block function in use: "sha-ni" or "generic".
+const char *sha256_impl(void);
+// Switches to the named block function, for testing each of them. Returns RET_ERR if it isn't
+// available on this CPU (or build).
+int sha256_use(const char *impl);
+
+#endif // EASYSTORAGE_SHA256_H
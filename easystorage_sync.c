@@ -0,0 +1,790 @@
+#include "easystorage.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+#define DEFAULT_DEBOUNCE_MS 500
+// Changes that keep coming don't hold back a flush for more than this many debounce periods.
+#define MAX_DEBOUNCE_PERIODS 10
+#define DEFAULT_SYNC_CONCURRENCY 4
+
+// What the node holds for one file, as recorded in the state file.
+typedef struct {
+    char *path; // relative to the synced directory
+    char *cid;
+    long long size;
+    long long mtime_ns;
+    bool seen; // scratch flag for full scans
+} sync_entry;
+
+// A file that needs uploading, and the outcome.
+typedef struct {
+    char *path;
+    long long size;
+    long long mtime_ns;
+    char *cid;
+} sync_upload;
+
+typedef struct {
+    STORAGE_NODE node;
+    char dir[PATH_MAX];
+    char state_file[PATH_MAX];
+    const char *state_rel; // state file path relative to dir, if it lives inside it
+    int debounce_ms;
+    int concurrency;
+    int wake[2];
+
+    pthread_mutex_t lock; // guards entries and stats, and changes to the watches
+    sync_entry *entries;  // sorted by path
+    size_t n_entries;
+    sync_stats stats;
+
+    // Watch mode: inotify watch descriptors and the directory each one covers. Only the watching
+    // thread reads them without the lock.
+    int inotify_fd;
+    int *wds;
+    char **wd_paths;
+    size_t n_wds;
+} storage_sync;
+
+// --- Entries ---
+
+static int entry_cmp(const void *key, const void *elem) {
+    return strcmp((const char *) key, ((const sync_entry *) elem)->path);
+}
+
+// Returns the index of path, or where it would be inserted (with *found = false).
+// Must be called with s->lock held.
+static size_t entry_find(storage_sync *s, const char *path, bool *found) {
+    size_t lo = 0, hi = s->n_entries;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = entry_cmp(path, &s->entries[mid]);
+        if (c == 0) {
+            *found = true;
+            return mid;
+        }
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    *found = false;
+    return lo;
+}
+
+// Takes ownership of path and cid. Must be called with s->lock held.
+static int entry_put(storage_sync *s, char *path, char *cid, long long size, long long mtime_ns) {
+    bool found;
+    size_t i = entry_find(s, path, &found);
+    if (found) {
+        free(path);
+        free(s->entries[i].cid);
+    } else {
+        sync_entry *entries = realloc(s->entries, (s->n_entries + 1) * sizeof(sync_entry));
+        if (!entries) {
+            free(path);
+            free(cid);
+            return RET_ERR;
+        }
+        s->entries = entries;
+        memmove(&entries[i + 1], &entries[i], (s->n_entries - i) * sizeof(sync_entry));
+        s->n_entries++;
+        entries[i].path = path;
+    }
+    s->entries[i].cid = cid;
+    s->entries[i].size = size;
+    s->entries[i].mtime_ns = mtime_ns;
+    s->entries[i].seen = true;
+    return RET_OK;
+}
+
+// Whether another entry still refers to the same content. Must be called with s->lock held.
+static bool cid_shared(storage_sync *s, const char *cid, size_t except) {
+    for (size_t i = 0; i < s->n_entries; i++) {
+        if (i != except && strcmp(s->entries[i].cid, cid) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Drops the entry and deletes its content from the node unless another file still has it.
+// Must be called with s->lock held; the lock is released around the delete.
+static void entry_remove(storage_sync *s, size_t i) {
+    sync_entry e = s->entries[i];
+    bool shared = cid_shared(s, e.cid, i);
+    memmove(&s->entries[i], &s->entries[i + 1], (s->n_entries - i - 1) * sizeof(sync_entry));
+    s->n_entries--;
+
+    if (!shared) {
+        pthread_mutex_unlock(&s->lock);
+        int ret = e_storage_delete(s->node, e.cid);
+        pthread_mutex_lock(&s->lock);
+        if (ret == RET_OK)
+            s->stats.deleted++;
+        else
+            s->stats.failed++;
+    }
+    free(e.path);
+    free(e.cid);
+}
+
+// --- State file ---
+// One line per file: <cid> TAB <size> TAB <mtime in ns> TAB <path>, with newlines and
+// backslashes in the path escaped as \n and \\ so that every record stays on its line.
+
+static void path_escape(FILE *fp, const char *path) {
+    for (const char *c = path; *c; c++) {
+        if (*c == '\n')
+            fputs("\\n", fp);
+        else if (*c == '\\')
+            fputs("\\\\", fp);
+        else
+            fputc(*c, fp);
+    }
+}
+
+// Undoes path_escape in place.
+static void path_unescape(char *path) {
+    char *out = path;
+    for (const char *c = path; *c; c++) {
+        if (*c == '\\' && (c[1] == 'n' || c[1] == '\\'))
+            *out++ = *++c == 'n' ? '\n' : '\\';
+        else
+            *out++ = *c;
+    }
+    *out = '\0';
+}
+
+static int state_load(storage_sync *s) {
+    FILE *fp = fopen(s->state_file, "r");
+    if (!fp)
+        return errno == ENOENT ? RET_OK : RET_ERR;
+
+    char line[PATH_MAX * 2 + 512];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *cid = strtok(line, "\t");
+        char *size = strtok(NULL, "\t");
+        char *mtime = strtok(NULL, "\t");
+        char *path = strtok(NULL, "");
+        if (!cid || !size || !mtime || !path)
+            continue;
+        path_unescape(path);
+        char *p = strdup(path), *c = strdup(cid);
+        if (!p || !c) {
+            free(p);
+            free(c);
+            continue;
+        }
+        entry_put(s, p, c, atoll(size), atoll(mtime));
+    }
+    fclose(fp);
+    return RET_OK;
+}
+
+// Rewrites the state file atomically. Must be called with s->lock held.
+static int state_save(storage_sync *s) {
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", s->state_file);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return RET_ERR;
+
+    for (size_t i = 0; i < s->n_entries; i++) {
+        sync_entry *e = &s->entries[i];
+        fprintf(fp, "%s\t%lld\t%lld\t", e->cid, e->size, e->mtime_ns);
+        path_escape(fp, e->path);
+        fputc('\n', fp);
+    }
+
+    bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp, s->state_file) != 0) {
+        unlink(tmp);
+        return RET_ERR;
+    }
+    return RET_OK;
+}
+
+// --- Uploads ---
+
+typedef struct {
+    storage_sync *s;
+    sync_upload *uploads;
+    size_t n;
+    size_t next;
+    pthread_mutex_t lock;
+} upload_batch;
+
+static void *upload_worker(void *arg) {
+    upload_batch *b = arg;
+    char abs[PATH_MAX * 2];
+    while (1) {
+        pthread_mutex_lock(&b->lock);
+        size_t i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->n)
+            return NULL;
+
+        snprintf(abs, sizeof(abs), "%s/%s", b->s->dir, b->uploads[i].path);
+        b->uploads[i].cid = e_storage_upload(b->s->node, abs, NULL);
+    }
+}
+
+// Uploads the files concurrently and records the new CIDs, deleting content that is no
+// longer referenced. Takes ownership of the upload paths.
+static void upload_all(storage_sync *s, sync_upload *uploads, size_t n) {
+    if (n == 0)
+        return;
+
+    upload_batch b = {.s = s, .uploads = uploads, .n = n};
+    pthread_mutex_init(&b.lock, NULL);
+    int workers = s->concurrency < (int) n ? s->concurrency : (int) n;
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    int started = 0;
+    for (; threads && started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, upload_worker, &b) != 0)
+            break;
+    }
+    if (started == 0)
+        upload_worker(&b);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&b.lock);
+
+    pthread_mutex_lock(&s->lock);
+    for (size_t i = 0; i < n; i++) {
+        sync_upload *u = &uploads[i];
+        if (!u->cid) {
+            s->stats.failed++;
+            free(u->path);
+            continue;
+        }
+
+        bool found;
+        size_t idx = entry_find(s, u->path, &found);
+        char *old = found && strcmp(s->entries[idx].cid, u->cid) != 0 ? strdup(s->entries[idx].cid) : NULL;
+        entry_put(s, u->path, u->cid, u->size, u->mtime_ns);
+        s->stats.uploaded++;
+
+        if (old && !cid_shared(s, old, SIZE_MAX)) {
+            pthread_mutex_unlock(&s->lock);
+            int ret = e_storage_delete(s->node, old);
+            pthread_mutex_lock(&s->lock);
+            if (ret == RET_OK)
+                s->stats.deleted++;
+        }
+        free(old);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// --- Scanning ---
+
+typedef struct {
+    sync_upload *items;
+    size_t n;
+    size_t cap;
+} upload_list;
+
+static int upload_list_add(upload_list *l, const char *path, const struct stat *st) {
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 16;
+        sync_upload *items = realloc(l->items, cap * sizeof(sync_upload));
+        if (!items)
+            return RET_ERR;
+        l->items = items;
+        l->cap = cap;
+    }
+    sync_upload *u = &l->items[l->n];
+    u->path = strdup(path);
+    if (!u->path)
+        return RET_ERR;
+    u->size = st->st_size;
+    u->mtime_ns = (long long) st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    u->cid = NULL;
+    l->n++;
+    return RET_OK;
+}
+
+static bool skipped(storage_sync *s, const char *rel) {
+    if (!s->state_rel)
+        return false;
+    size_t n = strlen(s->state_rel);
+    return strncmp(rel, s->state_rel, n) == 0 && (rel[n] == '\0' || strcmp(rel + n, ".tmp") == 0);
+}
+
+// Queues rel for upload if it is a regular file that changed since it was recorded,
+// and marks its entry as seen. Must be called with s->lock held.
+static void check_file(storage_sync *s, const char *rel, const struct stat *st, upload_list *out) {
+    if (skipped(s, rel))
+        return;
+
+    long long mtime_ns = (long long) st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    bool found;
+    size_t i = entry_find(s, rel, &found);
+    if (found) {
+        s->entries[i].seen = true;
+        if (s->entries[i].size == st->st_size && s->entries[i].mtime_ns == mtime_ns)
+            return;
+    }
+    upload_list_add(out, rel, st);
+}
+
+// Walks dir/rel recursively, collecting changed files. Must be called with s->lock held.
+static void walk(storage_sync *s, const char *rel, upload_list *out, void (*on_dir)(storage_sync *, const char *)) {
+    char abs[PATH_MAX * 2];
+    snprintf(abs, sizeof(abs), "%s%s%s", s->dir, rel[0] ? "/" : "", rel);
+    DIR *d = opendir(abs);
+    if (!d)
+        return;
+    if (on_dir)
+        on_dir(s, rel);
+
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        char child[PATH_MAX];
+        snprintf(child, sizeof(child), "%s%s%s", rel, rel[0] ? "/" : "", de->d_name);
+        snprintf(abs, sizeof(abs), "%s/%s", s->dir, child);
+
+        struct stat st;
+        if (lstat(abs, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            walk(s, child, out, on_dir);
+        } else if (S_ISREG(st.st_mode)) {
+            check_file(s, child, &st, out);
+        }
+    }
+    closedir(d);
+}
+
+// Saves the state, counting a failure to do so. Must be called with s->lock held.
+static void save(storage_sync *s) {
+    if (state_save(s) != RET_OK)
+        s->stats.failed++;
+}
+
+// Uploads before removing, so that content which merely moved within the tree is still
+// referenced by its new path and doesn't get deleted from the node.
+static int full_scan(storage_sync *s, void (*on_dir)(storage_sync *, const char *)) {
+    upload_list l = {0};
+
+    pthread_mutex_lock(&s->lock);
+    for (size_t i = 0; i < s->n_entries; i++) {
+        s->entries[i].seen = false;
+    }
+    walk(s, "", &l, on_dir);
+    pthread_mutex_unlock(&s->lock);
+
+    upload_all(s, l.items, l.n);
+    free(l.items);
+
+    pthread_mutex_lock(&s->lock);
+    for (size_t i = 0; i < s->n_entries;) {
+        if (!s->entries[i].seen)
+            entry_remove(s, i);
+        else
+            i++;
+    }
+    save(s);
+    pthread_mutex_unlock(&s->lock);
+    return RET_OK;
+}
+
+// --- Watching ---
+
+#ifdef __linux__
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF)
+
+static void watch_dir(storage_sync *s, const char *rel) {
+    char abs[PATH_MAX * 2];
+    snprintf(abs, sizeof(abs), "%s%s%s", s->dir, rel[0] ? "/" : "", rel);
+    int wd = inotify_add_watch(s->inotify_fd, abs, WATCH_MASK);
+    if (wd < 0)
+        return;
+
+    for (size_t i = 0; i < s->n_wds; i++) {
+        if (s->wds[i] == wd) {
+            char *p = strdup(rel);
+            if (p) {
+                free(s->wd_paths[i]);
+                s->wd_paths[i] = p;
+            }
+            return;
+        }
+    }
+
+    int *wds = realloc(s->wds, (s->n_wds + 1) * sizeof(int));
+    if (wds)
+        s->wds = wds;
+    char **paths = realloc(s->wd_paths, (s->n_wds + 1) * sizeof(char *));
+    if (paths)
+        s->wd_paths = paths;
+    if (!wds || !paths)
+        return;
+    s->wds[s->n_wds] = wd;
+    s->wd_paths[s->n_wds] = strdup(rel);
+    if (s->wd_paths[s->n_wds])
+        s->n_wds++;
+}
+
+// Forgets a watch the kernel has dropped (IN_IGNORED), e.g. because its directory was deleted.
+static void watch_forget(storage_sync *s, int wd) {
+    for (size_t i = 0; i < s->n_wds; i++) {
+        if (s->wds[i] == wd) {
+            free(s->wd_paths[i]);
+            s->n_wds--;
+            s->wds[i] = s->wds[s->n_wds];
+            s->wd_paths[i] = s->wd_paths[s->n_wds];
+            return;
+        }
+    }
+}
+
+// Drops the watches on rel and the directories under it, which were moved out of the tree; the
+// kernel confirms each with IN_IGNORED, which is when they are forgotten.
+static void unwatch_under(storage_sync *s, const char *rel) {
+    size_t len = strlen(rel);
+    for (size_t i = 0; i < s->n_wds; i++) {
+        const char *p = s->wd_paths[i];
+        if (strncmp(p, rel, len) == 0 && (p[len] == '\0' || p[len] == '/'))
+            inotify_rm_watch(s->inotify_fd, s->wds[i]);
+    }
+}
+
+static const char *watch_path(storage_sync *s, int wd) {
+    for (size_t i = 0; i < s->n_wds; i++) {
+        if (s->wds[i] == wd)
+            return s->wd_paths[i];
+    }
+    return NULL;
+}
+
+// Paths touched since the last flush, with repeats until flush() sorts them out.
+typedef struct {
+    char **paths;
+    size_t n;
+    size_t cap;
+} pending_set;
+
+static void pending_add(pending_set *p, const char *path) {
+    if (p->n == p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 16;
+        char **paths = realloc(p->paths, cap * sizeof(char *));
+        if (!paths)
+            return;
+        p->paths = paths;
+        p->cap = cap;
+    }
+    if ((p->paths[p->n] = strdup(path)))
+        p->n++;
+}
+
+static int path_cmp(const void *a, const void *b) { return strcmp(*(char *const *) a, *(char *const *) b); }
+
+// Sorts the pending paths and drops the repeats, all at once rather than with a scan per event,
+// which would make a burst of events (e.g. unpacking a tree) quadratic.
+static void pending_dedup(pending_set *p) {
+    if (p->n == 0)
+        return;
+    qsort(p->paths, p->n, sizeof(char *), path_cmp);
+    size_t n = 1;
+    for (size_t i = 1; i < p->n; i++) {
+        if (strcmp(p->paths[i], p->paths[n - 1]) == 0)
+            free(p->paths[i]);
+        else
+            p->paths[n++] = p->paths[i];
+    }
+    p->n = n;
+}
+
+// Reconciles just the touched paths: changed files are uploaded, vanished ones (and
+// everything recorded under a vanished directory) are deleted afterwards.
+static void flush(storage_sync *s, pending_set *p) {
+    upload_list l = {0};
+    char abs[PATH_MAX * 2];
+    struct stat st;
+
+    pending_dedup(p);
+    pthread_mutex_lock(&s->lock);
+    for (size_t k = 0; k < p->n; k++) {
+        snprintf(abs, sizeof(abs), "%s/%s", s->dir, p->paths[k]);
+        if (lstat(abs, &st) == 0 && S_ISREG(st.st_mode)) {
+            check_file(s, p->paths[k], &st, &l);
+        } else if (lstat(abs, &st) == 0 && S_ISDIR(st.st_mode)) {
+            walk(s, p->paths[k], &l, watch_dir);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    upload_all(s, l.items, l.n);
+    free(l.items);
+
+    pthread_mutex_lock(&s->lock);
+    for (size_t k = 0; k < p->n; k++) {
+        const char *rel = p->paths[k];
+        snprintf(abs, sizeof(abs), "%s/%s", s->dir, rel);
+        if (lstat(abs, &st) != 0) {
+            unwatch_under(s, rel);
+            bool found;
+            size_t i = entry_find(s, rel, &found);
+            if (found)
+                entry_remove(s, i);
+            // What was under it sorts together, though not necessarily right after it
+            // ("a-b" and "a.c" come between "a" and "a/b").
+            char prefix[PATH_MAX + 1];
+            int len = snprintf(prefix, sizeof(prefix), "%s/", rel);
+            for (i = entry_find(s, prefix, &found);
+                 i < s->n_entries && strncmp(s->entries[i].path, prefix, (size_t) len) == 0;) {
+                entry_remove(s, i);
+            }
+        }
+        free(p->paths[k]);
+    }
+    p->n = 0;
+    save(s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Reads queued inotify events into the pending set. Returns false if events were lost.
+static bool read_events(storage_sync *s, pending_set *p) {
+    char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool complete = true;
+
+    while (1) {
+        ssize_t len = read(s->inotify_fd, buf, sizeof(buf));
+        if (len <= 0)
+            return complete;
+
+        for (char *ptr = buf; ptr < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event *) ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                complete = false;
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                pthread_mutex_lock(&s->lock);
+                watch_forget(s, ev->wd);
+                pthread_mutex_unlock(&s->lock);
+                continue;
+            }
+            const char *dir = watch_path(s, ev->wd);
+            if (!dir || ev->len == 0)
+                continue;
+
+            char rel[PATH_MAX];
+            snprintf(rel, sizeof(rel), "%s%s%s", dir, dir[0] ? "/" : "", ev->name);
+            pending_add(p, rel);
+        }
+    }
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int watch(storage_sync *s) {
+    s->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (s->inotify_fd < 0)
+        return RET_ERR;
+
+    // Watches go in before the scan, so nothing changed in between is missed.
+    full_scan(s, watch_dir);
+
+    // A flush happens once changes went quiet for debounce_ms, or the oldest pending one has
+    // waited for MAX_DEBOUNCE_PERIODS of it, whichever comes first.
+    pending_set p = {0};
+    long long first_event = 0, last_event = 0;
+    struct pollfd fds[2] = {{.fd = s->inotify_fd, .events = POLLIN}, {.fd = s->wake[0], .events = POLLIN}};
+
+    while (1) {
+        int timeout = -1;
+        if (p.n > 0) {
+            long long due = last_event + s->debounce_ms;
+            long long max_due = first_event + (long long) s->debounce_ms * MAX_DEBOUNCE_PERIODS;
+            long long left = (due < max_due ? due : max_due) - now_ms();
+            timeout = left > 0 ? (int) left : 0;
+        }
+
+        int ready = poll(fds, 2, timeout);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (fds[1].revents)
+            break;
+
+        if (ready > 0 && (fds[0].revents & POLLIN)) {
+            bool was_empty = p.n == 0;
+            if (!read_events(s, &p)) {
+                // The kernel dropped events; only a full rescan is reliable now.
+                for (size_t i = 0; i < p.n; i++) free(p.paths[i]);
+                p.n = 0;
+                full_scan(s, watch_dir);
+            }
+            last_event = now_ms();
+            if (was_empty)
+                first_event = last_event;
+            if (p.n > 0 && last_event - first_event >= (long long) s->debounce_ms * MAX_DEBOUNCE_PERIODS)
+                flush(s, &p);
+        } else if (ready == 0 && p.n > 0) {
+            flush(s, &p);
+        }
+    }
+
+    // Don't lose changes that were still being debounced.
+    if (p.n > 0)
+        flush(s, &p);
+    free(p.paths);
+    return RET_OK;
+}
+
+#endif
+
+// --- API ---
+
+STORAGE_SYNC e_storage_sync_new(STORAGE_NODE node, const char *dir, const char *state_file, const sync_opts *opts) {
+    if (!node || !dir || !state_file)
+        return NULL;
+
+    storage_sync *s = calloc(1, sizeof(storage_sync));
+    if (!s)
+        return NULL;
+    s->node = node;
+    s->inotify_fd = -1;
+    s->wake[0] = s->wake[1] = -1;
+    s->debounce_ms = opts && opts->debounce_ms > 0 ? opts->debounce_ms : DEFAULT_DEBOUNCE_MS;
+    s->concurrency = opts && opts->concurrency > 0 ? opts->concurrency : DEFAULT_SYNC_CONCURRENCY;
+    pthread_mutex_init(&s->lock, NULL);
+
+    // Resolve the state file through its directory, since it may not exist yet.
+    char state_copy[PATH_MAX], state_dir[PATH_MAX];
+    snprintf(state_copy, sizeof(state_copy), "%s", state_file);
+    char *base = basename(state_copy);
+    snprintf(state_dir, sizeof(state_dir), "%s", state_file);
+    char *parent = dirname(state_dir);
+    char parent_abs[PATH_MAX];
+
+    if (!realpath(dir, s->dir) || !realpath(parent, parent_abs) || pipe(s->wake) != 0) {
+        e_storage_sync_destroy(s);
+        return NULL;
+    }
+    fcntl(s->wake[1], F_SETFL, O_NONBLOCK);
+    if (snprintf(s->state_file, sizeof(s->state_file), "%s/%s", parent_abs, base) >= (int) sizeof(s->state_file)) {
+        e_storage_sync_destroy(s);
+        return NULL;
+    }
+
+    size_t dir_len = strlen(s->dir);
+    if (strncmp(s->state_file, s->dir, dir_len) == 0 && s->state_file[dir_len] == '/')
+        s->state_rel = s->state_file + dir_len + 1;
+
+    if (state_load(s) != RET_OK) {
+        e_storage_sync_destroy(s);
+        return NULL;
+    }
+    return s;
+}
+
+int e_storage_sync_scan(STORAGE_SYNC sync) {
+    if (!sync)
+        return RET_ERR;
+    return full_scan(sync, NULL);
+}
+
+int e_storage_sync_run(STORAGE_SYNC sync) {
+    if (!sync)
+        return RET_ERR;
+#ifdef __linux__
+    return watch(sync);
+#else
+    return RET_ERR;
+#endif
+}
+
+void e_storage_sync_stop(STORAGE_SYNC sync) {
+    storage_sync *s = sync;
+    if (s && s->wake[1] >= 0) {
+        char b = 0;
+        (void) !write(s->wake[1], &b, 1);
+    }
+}
+
+char *e_storage_sync_cid(STORAGE_SYNC sync, const char *path) {
+    if (!sync || !path)
+        return NULL;
+    storage_sync *s = sync;
+
+    pthread_mutex_lock(&s->lock);
+    bool found;
+    size_t i = entry_find(s, path, &found);
+    char *cid = found ? strdup(s->entries[i].cid) : NULL;
+    pthread_mutex_unlock(&s->lock);
+    return cid;
+}
+
+void e_storage_sync_stats(STORAGE_SYNC sync, sync_stats *stats) {
+    if (!sync || !stats)
+        return;
+    storage_sync *s = sync;
+    pthread_mutex_lock(&s->lock);
+    *stats = s->stats;
+    stats->files = s->n_entries;
+    stats->watched = s->n_wds;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void e_storage_sync_destroy(STORAGE_SYNC sync) {
+    if (!sync)
+        return;
+    storage_sync *s = sync;
+
+    for (size_t i = 0; i < s->n_entries; i++) {
+        free(s->entries[i].path);
+        free(s->entries[i].cid);
+    }
+    for (size_t i = 0; i < s->n_wds; i++) {
+        free(s->wd_paths[i]);
+    }
+    if (s->inotify_fd >= 0)
+        close(s->inotify_fd);
+    if (s->wake[0] >= 0)
+        close(s->wake[0]);
+    if (s->wake[1] >= 0)
+        close(s->wake[1]);
+    free(s->entries);
+    free(s->wds);
+    free(s->wd_paths);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "easystorage.h"
+#include "storaged.h"
 
 void panic(const char *msg) {
     fprintf(stderr, "Panic: %s\n", msg);
@@ -24,6 +25,14 @@ int main(int argc, char *argv[]) {
     char *cid = argv[2];
     char *filepath = argv[3];
 
+    // A running storaged is already part of the network, so the bootstrap SPR isn't needed.
+    int conn = storaged_connect(storaged_socket_path());
+    if (conn >= 0) {
+        if (storaged_download(conn, cid, filepath) != RET_OK) panic("Failed to download file via daemon");
+        storaged_disconnect(conn);
+        return 0;
+    }
+
     node_config cfg = {
             .api_port = 8081,
             .disc_port = 9091,
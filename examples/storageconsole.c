@@ -1,13 +1,54 @@
 #include "easystorage.h"
 
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
+// Background transfers running at once in batch mode; further ones wait for a slot.
+#define MAX_BATCH_JOBS 16
+
+enum job_state { JOB_RUNNING, JOB_DONE, JOB_FAILED, JOB_CANCELLED };
+
+static const char *job_states[] = {"running", "done", "failed", "cancelled"};
+
+typedef struct console console;
+
+// A background upload or download. Only the worker thread writes to a job
+// while it runs; `done` is updated from the progress callback.
 typedef struct {
+    int id;
+    bool upload;
+    char cid[256];
+    char path[PATH_MAX];
+    size_t total;
+    size_t done;
+    struct timespec started;
+    struct timespec finished;
+    enum job_state state;
+    bool joined;
+    transfer_opts opts;
+    pthread_t thread;
+    void *ctx;
+    console *c;
+} job;
+
+struct console {
     void *ctx;
-} console;
+    bool background; // run the current command as a background job
+    bool batch;      // non-interactive: transfers always run in the background
+    int failures;    // jobs that did not complete successfully, or could not be started
+    pthread_mutex_t lock;
+    pthread_cond_t slot_free;
+    int running; // jobs whose thread hasn't finished yet
+    job **jobs;  // every job started, in order; a job's id is its index + 1
+    int n_jobs;
+    int cap;
+};
 
 typedef void (*fn)(char *, console *);
 
@@ -36,6 +77,168 @@ void progress_print(int total, int complete, int status) {
     fflush(stdout);
 }
 
+static double elapsed(struct timespec from, struct timespec to) {
+    return (double) (to.tv_sec - from.tv_sec) + (double) (to.tv_nsec - from.tv_nsec) / 1e9;
+}
+
+static void job_progress(void *user, size_t complete) {
+    job *j = user;
+    __atomic_store_n(&j->done, complete, __ATOMIC_RELAXED);
+}
+
+static void *job_run(void *arg) {
+    job *j = arg;
+    if (j->upload) {
+        char *cid = e_storage_upload_opts(j->ctx, j->path, &j->opts);
+        if (cid) {
+            snprintf(j->cid, sizeof(j->cid), "%s", cid);
+            free(cid);
+        }
+    } else {
+        e_storage_download_opts(j->ctx, j->cid, j->path, &j->opts);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &j->finished);
+    enum job_state state = j->opts.status == RET_OK          ? JOB_DONE
+                           : j->opts.status == RET_CANCELLED ? JOB_CANCELLED
+                                                             : JOB_FAILED;
+    __atomic_store_n(&j->state, state, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&j->c->lock);
+    j->c->running--;
+    pthread_cond_signal(&j->c->slot_free);
+    pthread_mutex_unlock(&j->c->lock);
+
+    if (state == JOB_DONE && j->upload) {
+        printf("[%d] uploaded %s, CID: %s\n", j->id, j->path, j->cid);
+    } else if (state == JOB_DONE) {
+        printf("[%d] downloaded %s to %s\n", j->id, j->cid, j->path);
+    } else {
+        printf("[%d] %s %s: %s\n", j->id, j->upload ? "upload" : "download", j->upload ? j->path : j->cid,
+               job_states[state]);
+    }
+    fflush(stdout);
+    return NULL;
+}
+
+// Starts an upload (cid == NULL) or download in the background. In batch mode, waits for
+// one of the MAX_BATCH_JOBS slots first. A job that can't be started counts as a failure.
+static void job_spawn(console *c, const char *cid, const char *path) {
+    pthread_mutex_lock(&c->lock);
+    while (c->batch && c->running >= MAX_BATCH_JOBS) {
+        pthread_cond_wait(&c->slot_free, &c->lock);
+    }
+    if (c->n_jobs == c->cap) {
+        int cap = c->cap ? c->cap * 2 : 64;
+        job **jobs = realloc(c->jobs, cap * sizeof(job *));
+        if (!jobs) {
+            c->failures++;
+            pthread_mutex_unlock(&c->lock);
+            printf("Failed to start job.\n");
+            return;
+        }
+        c->jobs = jobs;
+        c->cap = cap;
+    }
+
+    job *j = calloc(1, sizeof(job));
+    if (!j) {
+        c->failures++;
+        pthread_mutex_unlock(&c->lock);
+        printf("Failed to start job.\n");
+        return;
+    }
+    j->id = c->n_jobs + 1;
+    j->upload = cid == NULL;
+    j->ctx = c->ctx;
+    j->c = c;
+    snprintf(j->path, sizeof(j->path), "%s", path);
+    if (cid) {
+        snprintf(j->cid, sizeof(j->cid), "%s", cid);
+    } else {
+        struct stat st;
+        if (stat(path, &st) == 0)
+            j->total = st.st_size;
+    }
+    j->opts.progress = job_progress;
+    j->opts.user = j;
+    clock_gettime(CLOCK_MONOTONIC, &j->started);
+
+    if (pthread_create(&j->thread, NULL, job_run, j) != 0) {
+        c->failures++;
+        pthread_mutex_unlock(&c->lock);
+        free(j);
+        printf("Failed to start job.\n");
+        return;
+    }
+    c->jobs[c->n_jobs++] = j;
+    c->running++;
+    pthread_mutex_unlock(&c->lock);
+
+    if (!c->batch)
+        printf("[%d] started\n", j->id);
+}
+
+static void job_join(console *c, job *j) {
+    if (j->joined)
+        return;
+    pthread_join(j->thread, NULL);
+    j->joined = true;
+    if (j->state != JOB_DONE)
+        c->failures++;
+}
+
+// Waits for all background jobs. Runs before anything that would pull the node
+// out from under them.
+static void jobs_wait_all(console *c) {
+    for (int i = 0; i < c->n_jobs; i++) {
+        job_join(c, c->jobs[i]);
+    }
+}
+
+static job *job_find(console *c, char *args) {
+    int id = args ? atoi(args) : 0;
+    if (id < 1 || id > c->n_jobs) {
+        printf("No such job: %s\n", args ? args : "");
+        return NULL;
+    }
+    return c->jobs[id - 1];
+}
+
+void cmd_jobs(char *args, console *c) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int i = 0; i < c->n_jobs; i++) {
+        job *j = c->jobs[i];
+        enum job_state state = __atomic_load_n(&j->state, __ATOMIC_ACQUIRE);
+        size_t done = __atomic_load_n(&j->done, __ATOMIC_RELAXED);
+        double secs = elapsed(j->started, state == JOB_RUNNING ? now : j->finished);
+        double rate = secs > 0 ? (double) done / secs / 1024.0 : 0;
+
+        printf("[%d] %-9s %-8s %zu", j->id, job_states[state], j->upload ? "upload" : "download", done);
+        if (j->total > 0)
+            printf("/%zu", j->total);
+        printf(" bytes, %.1f KiB/s, %s\n", rate, j->upload ? j->path : j->cid);
+    }
+}
+
+void cmd_wait(char *args, console *c) {
+    if (!args) {
+        jobs_wait_all(c);
+        return;
+    }
+    job *j = job_find(c, args);
+    if (j)
+        job_join(c, j);
+}
+
+void cmd_cancel(char *args, console *c) {
+    job *j = job_find(c, args);
+    if (j)
+        e_storage_cancel(&j->opts);
+}
+
 void cmd_start(char *args, console *c) {
     if (c->ctx) {
         printf("Node already running. Stop it first.\n");
@@ -82,6 +285,8 @@ void cmd_stop(char *args, console *c) {
         return;
     }
 
+    jobs_wait_all(c);
+
     printf("Stopping node...\n");
     e_storage_stop(c->ctx);
     e_storage_destroy(c->ctx);
@@ -92,17 +297,25 @@ void cmd_stop(char *args, console *c) {
 void cmd_upload(char *args, console *c) {
     if (!c->ctx) {
         printf("No node running. Start one first.\n");
+        if (c->batch) c->failures++;
         return;
     }
 
     if (!args || args[0] == '\0') {
         printf("Usage: upload [PATH]\n");
+        if (c->batch) c->failures++;
         return;
     }
 
     char resolved[PATH_MAX];
     if (!realpath(args, resolved)) {
         printf("File not found: %s\n", args);
+        if (c->batch) c->failures++;
+        return;
+    }
+
+    if (c->background || c->batch) {
+        job_spawn(c, NULL, resolved);
         return;
     }
 
@@ -119,6 +332,7 @@ void cmd_upload(char *args, console *c) {
 void cmd_download(char *args, console *c) {
     if (!c->ctx) {
         printf("No node running. Start one first.\n");
+        if (c->batch) c->failures++;
         return;
     }
 
@@ -127,6 +341,12 @@ void cmd_download(char *args, console *c) {
 
     if (!args || sscanf(args, "%255s %2047s", cid, path) < 2) {
         printf("Usage: download [CID] [PATH]\n");
+        if (c->batch) c->failures++;
+        return;
+    }
+
+    if (c->background || c->batch) {
+        job_spawn(c, cid, path);
         return;
     }
 
@@ -138,7 +358,76 @@ void cmd_download(char *args, console *c) {
     }
 }
 
+// Parses sizes like 4096, 64K, 1M or 2G.
+static size_t parse_size(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    switch (*end) {
+        case 'k': case 'K': v *= 1024; break;
+        case 'm': case 'M': v *= 1024 * 1024; break;
+        case 'g': case 'G': v *= 1024.0 * 1024 * 1024; break;
+        default: break;
+    }
+    return v > 0 ? (size_t) v : 0;
+}
+
+void cmd_bench(char *args, console *c) {
+    if (!c->ctx) {
+        printf("No node running. Start one first.\n");
+        return;
+    }
+
+    char sizes_arg[512] = "64K,1M,16M";
+    char mode[16] = "random";
+    int iterations = 5, concurrency = 4, level = 0;
+    if (args && sscanf(args, "%511s %d %d %15s %d", sizes_arg, &iterations, &concurrency, mode, &level) < 1) {
+        printf("Usage: bench [SIZES] [ITERATIONS] [CONCURRENCY] [random|sparse|text] [LEVEL]\n");
+        return;
+    }
+
+    size_t sizes[32];
+    size_t n_sizes = 0;
+    for (char *tok = strtok(sizes_arg, ","); tok && n_sizes < 32; tok = strtok(NULL, ",")) {
+        if ((sizes[n_sizes] = parse_size(tok)) > 0)
+            n_sizes++;
+    }
+    if (n_sizes == 0 || iterations <= 0 || concurrency <= 0 || level < 0 ||
+        (strcmp(mode, "random") != 0 && strcmp(mode, "sparse") != 0 && strcmp(mode, "text") != 0)) {
+        printf("Usage: bench [SIZES] [ITERATIONS] [CONCURRENCY] [random|sparse|text] [LEVEL]\n");
+        return;
+    }
+
+    bench_opts opts = {.sizes = sizes,
+                       .n_sizes = n_sizes,
+                       .iterations = iterations,
+                       .concurrency = concurrency,
+                       .sparse = strcmp(mode, "sparse") == 0,
+                       .text = strcmp(mode, "text") == 0,
+                       .compress = level};
+    bench_result results[32];
+
+    printf("Running %d %s round trips per size, %d at a time", iterations, mode, concurrency);
+    if (level > 0)
+        printf(", compressed at level %d", level);
+    printf("...\n");
+    if (e_storage_bench(c->ctx, &opts, results) != RET_OK) {
+        printf("Benchmark failed.\n");
+        return;
+    }
+
+    printf("%12s %5s %5s %6s | %10s %9s %9s %9s | %10s %9s %9s %9s\n", "size", "ok", "fail", "ratio", "up MiB/s",
+           "p50 ms", "p90 ms", "p99 ms", "down MiB/s", "p50 ms", "p90 ms", "p99 ms");
+    for (size_t i = 0; i < n_sizes; i++) {
+        bench_result *r = &results[i];
+        printf("%12zu %5d %5d %6.3f | %10.2f %9.1f %9.1f %9.1f | %10.2f %9.1f %9.1f %9.1f\n", r->size, r->ok,
+               r->failed, r->ratio, r->upload_mibps, r->upload_ms[0], r->upload_ms[1], r->upload_ms[2],
+               r->download_mibps, r->download_ms[0], r->download_ms[1], r->download_ms[2]);
+        if (c->batch && r->failed > 0) c->failures++;
+    }
+}
+
 void cmd_quit(char *args, console *c) {
+    jobs_wait_all(c);
     if (c->ctx) {
         printf("Stopping node...\n");
         e_storage_stop(c->ctx);
@@ -146,7 +435,7 @@ void cmd_quit(char *args, console *c) {
         c->ctx = NULL;
     }
     printf("Quitting...\n");
-    exit(0);
+    exit(c->batch && c->failures > 0 ? 1 : 0);
 }
 
 static const struct command commands[] = {
@@ -154,31 +443,78 @@ static const struct command commands[] = {
     {"quit", "quits this program", cmd_quit},
     {"start", "[API_PORT] [DISC_PORT] [DATA_DIR] [BOOTSTRAP_NODE] creates and starts a node", cmd_start},
     {"stop", "stops and destroys the node", cmd_stop},
-    {"upload", "[PATH] uploads a file to the node", cmd_upload},
-    {"download", "[CID] [PATH] downloads content to a file", cmd_download},
+    {"upload", "[PATH] uploads a file to the node; append & to run it in the background", cmd_upload},
+    {"download", "[CID] [PATH] downloads content to a file; append & to run it in the background", cmd_download},
+    {"jobs", "lists background jobs with their progress and rate", cmd_jobs},
+    {"wait", "[ID] waits for a background job, or for all of them", cmd_wait},
+    {"cancel", "[ID] cancels a background job", cmd_cancel},
+    {"bench",
+     "[SIZES] [ITERATIONS] [CONCURRENCY] [random|sparse|text] [LEVEL] measures upload/download round trips",
+     cmd_bench},
 };
 
 int n_commands(void) { return sizeof(commands) / sizeof(commands[0]); }
 
-int main(void) {
+// Commands that can run alongside background jobs; anything else waits for them
+// first in batch mode.
+static bool runs_concurrently(const char *cmd) {
+    return strcmp(cmd, "upload") == 0 || strcmp(cmd, "download") == 0 || strcmp(cmd, "jobs") == 0 ||
+           strcmp(cmd, "help") == 0 || strcmp(cmd, "cancel") == 0;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-b [FILE]]\n", prog);
+    printf("  -b [FILE]  batch mode: run commands from FILE (or stdin), transfers concurrently\n");
+}
+
+int main(int argc, char *argv[]) {
     char buf[4096];
-    console c;
+    console c = {0};
+    FILE *in = stdin;
     int i;
 
-    c.ctx = NULL;
+    pthread_mutex_init(&c.lock, NULL);
+    pthread_cond_init(&c.slot_free, NULL);
 
-    printf("Welcome to storageconsole. Type 'help' for a list of commands.\n");
+    if (argc > 1) {
+        if (strcmp(argv[1], "-b") != 0 || argc > 3) {
+            usage(argv[0]);
+            return 1;
+        }
+        c.batch = true;
+        if (argc == 3 && strcmp(argv[2], "-") != 0) {
+            in = fopen(argv[2], "r");
+            if (!in) {
+                printf("Cannot open %s\n", argv[2]);
+                return 1;
+            }
+        }
+    }
+
+    if (!c.batch)
+        printf("Welcome to storageconsole. Type 'help' for a list of commands.\n");
 
     while (1) {
-        printf("> ");
-        fflush(stdout);
+        if (!c.batch) {
+            printf("> ");
+            fflush(stdout);
+        }
 
-        if (!fgets(buf, sizeof(buf), stdin)) {
+        if (!fgets(buf, sizeof(buf), in)) {
             break;
         }
         buf[strcspn(buf, "\n")] = 0;
 
-        if (buf[0] == '\0') {
+        // A trailing '&' sends the command to the background.
+        size_t len = strlen(buf);
+        while (len > 0 && buf[len - 1] == ' ') buf[--len] = '\0';
+        c.background = len > 0 && buf[len - 1] == '&';
+        if (c.background) {
+            buf[--len] = '\0';
+            while (len > 0 && buf[len - 1] == ' ') buf[--len] = '\0';
+        }
+
+        if (buf[0] == '\0' || buf[0] == '#') {
             continue;
         }
 
@@ -192,6 +528,10 @@ int main(void) {
             if (*rest == '\0') rest = NULL;
         }
 
+        if (c.batch && !runs_concurrently(buf)) {
+            jobs_wait_all(&c);
+        }
+
         for (i = 0; i < n_commands(); i++) {
             if (strcmp(buf, commands[i].name) == 0) {
                 commands[i].command(rest, &c);
@@ -201,6 +541,9 @@ int main(void) {
 
         if (i == n_commands()) {
             printf("Invalid command: %s\n", buf);
+            if (c.batch) c.failures++;
         }
     }
+
+    cmd_quit(NULL, &c);
 }
@@ -0,0 +1,57 @@
+/* storagedaemon.c: keeps a Logos Storage node running and serves it to local
+ * processes (e.g. uploader/downloader) over a Unix domain socket.
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "easystorage.h"
+#include "storaged.h"
+
+static STORAGED_SERVER server;
+
+void panic(const char *msg) {
+    fprintf(stderr, "Panic: %s\n", msg);
+    exit(1);
+}
+
+void on_signal(int sig) { storaged_server_stop(server); }
+
+int main(int argc, char *argv[]) {
+    if (argc > 3) {
+        printf("Usage: %s [CONFIG_FILE] [SOCKET_PATH]\n", argv[0]);
+        exit(1);
+    }
+
+    node_config cfg = DEFAULT_STORAGE_NODE_CONFIG;
+    node_config loaded = {0};
+    if (argc > 1) {
+        if (e_storage_read_config(argv[1], &loaded) != 0) panic("Failed to read config file");
+        e_storage_merge_config(&cfg, &loaded);
+    }
+    const char *socket_path = argc > 2 ? argv[2] : storaged_socket_path();
+
+    STORAGE_NODE node = e_storage_new(cfg);
+    if (node == NULL) panic("Failed to create node");
+    if (e_storage_start(node) != RET_OK) panic("Failed to start storage node");
+
+    server = storaged_server_new(node, socket_path);
+    if (server == NULL) panic("Failed to listen on socket");
+
+    char *spr = e_storage_spr(node);
+    printf("Node SPR: %s\n", spr ? spr : "(unavailable)");
+    printf("Serving on %s. Press Ctrl+C to exit.\n", socket_path);
+    free(spr);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    storaged_server_run(server);
+
+    printf("Shutting down...\n");
+    storaged_server_destroy(server);
+    e_storage_stop(node);
+    e_storage_close(node);
+    e_storage_destroy(node);
+    e_storage_free_config(&loaded);
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+/* storagesync.c: keeps a local directory mirrored into a Logos Storage node.
+ * New and changed files are uploaded within seconds, removed ones are deleted.
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "easystorage.h"
+
+static STORAGE_SYNC sync_ctx;
+
+void panic(const char *msg) {
+    fprintf(stderr, "Panic: %s\n", msg);
+    exit(1);
+}
+
+void on_signal(int sig) { e_storage_sync_stop(sync_ctx); }
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc > 4) {
+        printf("Usage: %s <directory> <state_file> [CONFIG_FILE]\n", argv[0]);
+        exit(1);
+    }
+
+    node_config cfg = DEFAULT_STORAGE_NODE_CONFIG;
+    node_config loaded = {0};
+    if (argc > 3) {
+        if (e_storage_read_config(argv[3], &loaded) != 0) panic("Failed to read config file");
+        e_storage_merge_config(&cfg, &loaded);
+    }
+
+    STORAGE_NODE node = e_storage_new(cfg);
+    if (node == NULL) panic("Failed to create node");
+    if (e_storage_start(node) != RET_OK) panic("Failed to start storage node");
+
+    sync_ctx = e_storage_sync_new(node, argv[1], argv[2], NULL);
+    if (sync_ctx == NULL) panic("Failed to open directory or state file");
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    printf("Syncing %s. Press Ctrl+C to exit.\n", argv[1]);
+    if (e_storage_sync_run(sync_ctx) != RET_OK) panic("Failed to watch directory");
+
+    sync_stats stats;
+    e_storage_sync_stats(sync_ctx, &stats);
+    printf("%zu files mirrored; %d uploads, %d deletions, %d failures.\n", stats.files, stats.uploaded, stats.deleted,
+           stats.failed);
+
+    e_storage_sync_destroy(sync_ctx);
+    e_storage_stop(node);
+    e_storage_close(node);
+    e_storage_destroy(node);
+    e_storage_free_config(&loaded);
+
+    return 0;
+}
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "easystorage.h"
+#include "storaged.h"
 
 void panic(const char *msg) {
     fprintf(stderr, "Panic: %s\n", msg);
@@ -14,12 +15,37 @@ void progress(int total, int complete, int status) {
     fflush(stdout);
 }
 
+// Shares the file through a running storaged instead of starting a node of our own.
+int upload_via_daemon(int conn, char *filepath) {
+    char *cid = storaged_upload(conn, filepath);
+    if (cid == NULL) panic("Failed to upload file to daemon");
+    char *spr = storaged_spr(conn);
+    if (spr == NULL) panic("Failed to obtain daemon's Signed Peer Record (SPR)");
+
+    printf("Run: downloader %s %s ./output-file\n", spr, cid);
+    printf("\nPress Enter to exit\n");
+    getchar();
+
+    printf("Deleting file (this could take a while)...");
+    fflush(stdout);
+    if (storaged_delete(conn, cid) != RET_OK) panic("Failed to delete file");
+    printf("Done\n");
+
+    free(cid);
+    free(spr);
+    storaged_disconnect(conn);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         printf("Usage: %s <filepath>\n", argv[0]);
         exit(1);
     }
 
+    int conn = storaged_connect(storaged_socket_path());
+    if (conn >= 0) return upload_via_daemon(conn, argv[1]);
+
     node_config cfg = {
             .api_port = 8080,
             .disc_port = 9090,
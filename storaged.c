@@ -0,0 +1,497 @@
+#define _GNU_SOURCE // struct ucred
+#include "storaged.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS 256
+
+typedef struct {
+    STORAGE_NODE node;
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    int listen_fd;
+    bool bound; // the socket file at path is ours to remove
+    int wake[2]; // self-pipe used by storaged_server_stop
+
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int clients[MAX_CLIENTS];
+    int n_clients;
+} storaged_server;
+
+typedef struct {
+    storaged_server *srv;
+    int fd;
+} client_conn;
+
+// --- Wire helpers ---
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return RET_ERR;
+        p += n;
+        len -= n;
+    }
+    return RET_OK;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return RET_ERR;
+        p += n;
+        len -= n;
+    }
+    return RET_OK;
+}
+
+// Sends a header plus payload, attaching pass_fd to the header if it is >= 0.
+static int send_msg(int sock, uint8_t op, uint8_t status, int pass_fd, const void *payload, uint32_t len) {
+    storaged_hdr hdr = {.magic = STORAGED_MAGIC, .op = op, .status = status, .len = len};
+    struct iovec iov = {.iov_base = &hdr, .iov_len = sizeof(hdr)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    char cbuf[CMSG_SPACE(sizeof(int))];
+
+    if (pass_fd >= 0) {
+        hdr.flags |= STORAGED_F_FD;
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &pass_fd, sizeof(int));
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t) sizeof(hdr))
+        return RET_ERR;
+
+    return len > 0 ? write_all(sock, payload, len) : RET_OK;
+}
+
+// Receives a header and its NUL-terminated payload (caller must free). If the
+// header carries a descriptor it is returned in *passed_fd, otherwise -1.
+static int recv_msg(int sock, storaged_hdr *hdr, char **payload, int *passed_fd) {
+    struct iovec iov = {.iov_base = hdr, .iov_len = sizeof(*hdr)};
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf)};
+
+    *payload = NULL;
+    *passed_fd = -1;
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t) sizeof(*hdr))
+        return RET_ERR;
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            memcpy(passed_fd, CMSG_DATA(cm), sizeof(int));
+        }
+    }
+
+    if (hdr->magic != STORAGED_MAGIC || hdr->len > STORAGED_MAX_PAYLOAD)
+        goto fail;
+
+    *payload = calloc(1, hdr->len + 1);
+    if (!*payload || (hdr->len > 0 && read_all(sock, *payload, hdr->len) != RET_OK))
+        goto fail;
+
+    return RET_OK;
+
+fail:
+    free(*payload);
+    *payload = NULL;
+    if (*passed_fd >= 0)
+        close(*passed_fd);
+    *passed_fd = -1;
+    return RET_ERR;
+}
+
+// Path under which the daemon (and libstorage running inside it) can open a passed descriptor.
+static void fd_path(int fd, char *buf, size_t len) {
+#ifdef __linux__
+    snprintf(buf, len, "/proc/self/fd/%d", fd);
+#else
+    snprintf(buf, len, "/dev/fd/%d", fd);
+#endif
+}
+
+// --- Server ---
+
+static int reply(int sock, int status, const char *result) {
+    return send_msg(sock, STORAGED_OP_RESULT, status, -1, result, result ? strlen(result) : 0);
+}
+
+static int serve_request(storaged_server *srv, int sock, const storaged_hdr *hdr, const char *payload, int fd) {
+    // Files only ever come as descriptors, so that clients can't make the daemon open paths
+    // with its own permissions.
+    char path[64];
+    if (fd >= 0)
+        fd_path(fd, path, sizeof(path));
+
+    switch (hdr->op) {
+        case STORAGED_OP_UPLOAD: {
+            if (fd < 0)
+                return reply(sock, RET_ERR, NULL);
+            char *cid = e_storage_upload(srv->node, path, NULL);
+            int ret = reply(sock, cid ? RET_OK : RET_ERR, cid);
+            free(cid);
+            return ret;
+        }
+        case STORAGED_OP_DOWNLOAD:
+            if (fd < 0)
+                return reply(sock, RET_ERR, NULL);
+            return reply(sock, e_storage_download(srv->node, payload, path, NULL), NULL);
+        case STORAGED_OP_DELETE:
+            return reply(sock, e_storage_delete(srv->node, payload), NULL);
+        case STORAGED_OP_SPR: {
+            char *spr = e_storage_spr(srv->node);
+            int ret = reply(sock, spr ? RET_OK : RET_ERR, spr);
+            free(spr);
+            return ret;
+        }
+        default:
+            return reply(sock, RET_ERR, NULL);
+    }
+}
+
+static void client_remove(storaged_server *srv, int fd) {
+    pthread_mutex_lock(&srv->lock);
+    for (int i = 0; i < srv->n_clients; i++) {
+        if (srv->clients[i] == fd) {
+            srv->clients[i] = srv->clients[--srv->n_clients];
+            break;
+        }
+    }
+    close(fd);
+    pthread_cond_broadcast(&srv->idle);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+static void *client_thread(void *arg) {
+    client_conn *c = arg;
+    storaged_hdr hdr;
+    char *payload;
+    int fd;
+
+    while (recv_msg(c->fd, &hdr, &payload, &fd) == RET_OK) {
+        int ret = serve_request(c->srv, c->fd, &hdr, payload, fd);
+        free(payload);
+        if (fd >= 0)
+            close(fd);
+        if (ret != RET_OK)
+            break;
+    }
+
+    client_remove(c->srv, c->fd);
+    free(c);
+    return NULL;
+}
+
+// Only processes of the user running the daemon are served.
+static bool peer_allowed(int fd) {
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == geteuid();
+#endif
+}
+
+static void client_spawn(storaged_server *srv, int fd) {
+    if (!peer_allowed(fd)) {
+        close(fd);
+        return;
+    }
+    pthread_mutex_lock(&srv->lock);
+    if (srv->n_clients == MAX_CLIENTS) {
+        pthread_mutex_unlock(&srv->lock);
+        close(fd);
+        return;
+    }
+    srv->clients[srv->n_clients++] = fd;
+    pthread_mutex_unlock(&srv->lock);
+
+    client_conn *c = malloc(sizeof(client_conn));
+    pthread_t t;
+    if (c) {
+        c->srv = srv;
+        c->fd = fd;
+        if (pthread_create(&t, NULL, client_thread, c) == 0) {
+            pthread_detach(t);
+            return;
+        }
+        free(c);
+    }
+    client_remove(srv, fd);
+}
+
+// Makes way for the socket at path: creates its directory, private to the user, if missing, and
+// removes a stale socket left by a daemon that's gone. Anything else found there is left alone.
+static int socket_prepare(const char *path) {
+    char dir[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+            return RET_ERR;
+    }
+
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return errno == ENOENT ? RET_OK : RET_ERR;
+    if (!S_ISSOCK(st.st_mode) || st.st_uid != geteuid())
+        return RET_ERR;
+    int live = storaged_connect(path);
+    if (live >= 0) {
+        close(live); // another daemon is serving it
+        return RET_ERR;
+    }
+    return unlink(path) == 0 ? RET_OK : RET_ERR;
+}
+
+STORAGED_SERVER storaged_server_new(STORAGE_NODE node, const char *socket_path) {
+    if (!node || !socket_path)
+        return NULL;
+
+    storaged_server *srv = calloc(1, sizeof(storaged_server));
+    if (!srv)
+        return NULL;
+    srv->node = node;
+    srv->listen_fd = -1;
+    srv->wake[0] = srv->wake[1] = -1;
+    snprintf(srv->path, sizeof(srv->path), "%s", socket_path);
+    pthread_mutex_init(&srv->lock, NULL);
+    pthread_cond_init(&srv->idle, NULL);
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        goto fail;
+    memcpy(addr.sun_path, socket_path, strlen(socket_path) + 1);
+
+    if (pipe(srv->wake) != 0)
+        goto fail;
+    fcntl(srv->wake[1], F_SETFL, O_NONBLOCK);
+
+    srv->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (srv->listen_fd < 0)
+        goto fail;
+
+    if (socket_prepare(socket_path) != RET_OK || bind(srv->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+        goto fail;
+    srv->bound = true;
+    if (chmod(socket_path, 0600) != 0 || listen(srv->listen_fd, 64) != 0)
+        goto fail;
+
+    return srv;
+
+fail:
+    storaged_server_destroy(srv);
+    return NULL;
+}
+
+int storaged_server_run(STORAGED_SERVER server) {
+    if (!server)
+        return RET_ERR;
+    storaged_server *srv = server;
+
+    struct pollfd fds[2] = {{.fd = srv->listen_fd, .events = POLLIN}, {.fd = srv->wake[0], .events = POLLIN}};
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return RET_ERR;
+        }
+        if (fds[1].revents)
+            return RET_OK;
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(srv->listen_fd, NULL, NULL);
+            if (fd >= 0)
+                client_spawn(srv, fd);
+        }
+    }
+}
+
+void storaged_server_stop(STORAGED_SERVER server) {
+    storaged_server *srv = server;
+    if (srv && srv->wake[1] >= 0) {
+        char b = 0;
+        (void) !write(srv->wake[1], &b, 1);
+    }
+}
+
+void storaged_server_destroy(STORAGED_SERVER server) {
+    if (!server)
+        return;
+    storaged_server *srv = server;
+
+    if (srv->listen_fd >= 0)
+        close(srv->listen_fd);
+    if (srv->bound)
+        unlink(srv->path);
+
+    // Wake up idle clients; busy ones finish their current request first.
+    pthread_mutex_lock(&srv->lock);
+    for (int i = 0; i < srv->n_clients; i++) {
+        shutdown(srv->clients[i], SHUT_RDWR);
+    }
+    while (srv->n_clients > 0) {
+        pthread_cond_wait(&srv->idle, &srv->lock);
+    }
+    pthread_mutex_unlock(&srv->lock);
+
+    if (srv->wake[0] >= 0)
+        close(srv->wake[0]);
+    if (srv->wake[1] >= 0)
+        close(srv->wake[1]);
+    pthread_cond_destroy(&srv->idle);
+    pthread_mutex_destroy(&srv->lock);
+    free(srv);
+}
+
+// --- Client ---
+
+static char default_socket[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static pthread_once_t default_socket_once = PTHREAD_ONCE_INIT;
+
+static void default_socket_init(void) {
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && runtime[0] == '/')
+        snprintf(default_socket, sizeof(default_socket), "%s/%s", runtime, STORAGED_SOCKET_NAME);
+    else
+        snprintf(default_socket, sizeof(default_socket), "/tmp/storaged-%u/%s", (unsigned) geteuid(),
+                 STORAGED_SOCKET_NAME);
+}
+
+const char *storaged_socket_path(void) {
+    const char *path = getenv(STORAGED_SOCKET_ENV);
+    if (path && path[0])
+        return path;
+    pthread_once(&default_socket_once, default_socket_init);
+    return default_socket;
+}
+
+int storaged_connect(const char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (!socket_path || strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    memcpy(addr.sun_path, socket_path, strlen(socket_path) + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void storaged_disconnect(int conn) {
+    if (conn >= 0)
+        close(conn);
+}
+
+// Sends a request and waits for its result. If out is non-NULL, the result
+// string is returned in it (caller must free).
+static int call(int conn, uint8_t op, int pass_fd, const char *payload, uint32_t len, char **out) {
+    if (out)
+        *out = NULL;
+    if (conn < 0 || send_msg(conn, op, 0, pass_fd, payload, len) != RET_OK)
+        return RET_ERR;
+
+    storaged_hdr hdr;
+    char *result;
+    int fd;
+    if (recv_msg(conn, &hdr, &result, &fd) != RET_OK)
+        return RET_ERR;
+    if (fd >= 0)
+        close(fd);
+
+    int ret = (hdr.op == STORAGED_OP_RESULT && hdr.status == RET_OK) ? RET_OK : RET_ERR;
+    if (out && ret == RET_OK && hdr.len > 0) {
+        *out = result;
+    } else {
+        free(result);
+    }
+    return ret;
+}
+
+char *storaged_upload_fd(int conn, int fd) {
+    if (fd < 0)
+        return NULL;
+    char *cid = NULL;
+    call(conn, STORAGED_OP_UPLOAD, fd, NULL, 0, &cid);
+    return cid;
+}
+
+char *storaged_upload(int conn, const char *filepath) {
+    if (!filepath)
+        return NULL;
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    char *cid = storaged_upload_fd(conn, fd);
+    close(fd);
+    return cid;
+}
+
+int storaged_download_fd(int conn, const char *cid, int fd) {
+    if (!cid || fd < 0 || strlen(cid) > STORAGED_MAX_PAYLOAD)
+        return RET_ERR;
+    return call(conn, STORAGED_OP_DOWNLOAD, fd, cid, strlen(cid), NULL);
+}
+
+int storaged_download(int conn, const char *cid, const char *filepath) {
+    if (!filepath)
+        return RET_ERR;
+    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return RET_ERR;
+    int ret = storaged_download_fd(conn, cid, fd);
+    close(fd);
+    return ret;
+}
+
+int storaged_delete(int conn, const char *cid) {
+    if (!cid || strlen(cid) > STORAGED_MAX_PAYLOAD)
+        return RET_ERR;
+    return call(conn, STORAGED_OP_DELETE, -1, cid, strlen(cid), NULL);
+}
+
+char *storaged_spr(int conn) {
+    char *spr = NULL;
+    call(conn, STORAGED_OP_SPR, -1, NULL, 0, &spr);
+    return spr;
+}
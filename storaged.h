@@ -0,0 +1,74 @@
+#ifndef STORAGED_H
+#define STORAGED_H
+
+#include "easystorage.h"
+
+#include <stdint.h>
+
+// storaged keeps one storage node running and serves it to local processes over a
+// Unix domain socket, so that short-lived clients don't have to bring up a node of
+// their own. Files are handed over as file descriptors (SCM_RIGHTS): the daemon
+// reads and writes them directly, and no file data goes through the socket. The
+// socket is only accessible to, and only serves, the user running the daemon.
+
+// The default socket lives in $XDG_RUNTIME_DIR, or in /tmp/storaged-<uid> without one.
+#define STORAGED_SOCKET_NAME "storaged.sock"
+#define STORAGED_SOCKET_ENV "STORAGED_SOCKET"
+
+#define STORAGED_MAGIC 0x31445345 // "ESD1"
+#define STORAGED_MAX_PAYLOAD 4096
+
+// Wire format: every message is a storaged_hdr followed by `len` payload bytes. Requests
+// carrying a file descriptor set STORAGED_F_FD and attach it to the header.
+enum storaged_op {
+    STORAGED_OP_UPLOAD = 1,   // fd -> CID
+    STORAGED_OP_DOWNLOAD = 2, // CID payload, fd -> status
+    STORAGED_OP_DELETE = 3,   // CID payload -> status
+    STORAGED_OP_SPR = 4,      // -> SPR
+    STORAGED_OP_RESULT = 5,   // response; status in `status`, result string as payload
+};
+
+#define STORAGED_F_FD 0x1
+
+typedef struct {
+    uint32_t magic;
+    uint8_t op;
+    uint8_t flags;
+    uint8_t status;
+    uint8_t reserved;
+    uint32_t len;
+} storaged_hdr;
+
+#define STORAGED_SERVER void *
+
+// Binds the socket and prepares to serve node. The socket's directory is created private to
+// the user if missing, and a stale socket is replaced; the call fails if another daemon is
+// listening there, or something other than a socket is in the way. Returns NULL on failure.
+STORAGED_SERVER storaged_server_new(STORAGE_NODE node, const char *socket_path);
+// Accepts and serves clients, each on its own thread, until storaged_server_stop is called.
+int storaged_server_run(STORAGED_SERVER server);
+// Makes storaged_server_run return. Async-signal-safe.
+void storaged_server_stop(STORAGED_SERVER server);
+// Disconnects remaining clients, waits for their requests to finish and removes the socket.
+void storaged_server_destroy(STORAGED_SERVER server);
+
+// Returns $STORAGED_SOCKET if set, the default socket otherwise.
+const char *storaged_socket_path(void);
+
+// Client side. Connections are plain socket descriptors; requests on one connection are
+// served in order, and separate connections are served concurrently.
+// Returns a connection descriptor, or -1 if no daemon is listening at socket_path.
+int storaged_connect(const char *socket_path);
+void storaged_disconnect(int conn);
+
+// Uploads the file. Returns CID string on success (caller must free), or NULL on failure.
+char *storaged_upload(int conn, const char *filepath);
+char *storaged_upload_fd(int conn, int fd);
+// Downloads content identified by cid into filepath (created/truncated). Returns 0 on success.
+int storaged_download(int conn, const char *cid, const char *filepath);
+int storaged_download_fd(int conn, const char *cid, int fd);
+int storaged_delete(int conn, const char *cid);
+// Retrieves the daemon node's SPR (caller must free), or NULL on failure.
+char *storaged_spr(int conn);
+
+#endif // STORAGED_H
@@ -0,0 +1,63 @@
+// Compression ratio and throughput of compressed uploads against the mock backend, so that what
+// is measured is the wrapper (compression, temporary files, expansion) rather than the network.
+// Usage: bench_compression [SIZE_MIB...] (default: 1 16 64)
+
+#include "easystorage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_SIZES 16
+
+static const int levels[] = {0, 1, 3, 9};
+static const char *contents[] = {"random", "text"};
+
+int main(int argc, char **argv) {
+    size_t sizes[MAX_SIZES] = {1 << 20, 16 << 20, 64 << 20};
+    size_t n_sizes = 3;
+    if (argc > 1) {
+        n_sizes = 0;
+        for (int i = 1; i < argc && n_sizes < MAX_SIZES; i++) {
+            long mib = atol(argv[i]);
+            if (mib > 0)
+                sizes[n_sizes++] = (size_t) mib << 20;
+        }
+    }
+
+    node_config cfg = {.api_port = 8080, .disc_port = 8090, .data_dir = "./bench-data", .log_level = "WARN"};
+    STORAGE_NODE node = e_storage_new(cfg);
+    if (!node || e_storage_start(node) != RET_OK) {
+        fprintf(stderr, "failed to start node\n");
+        return 1;
+    }
+
+    // One transfer at a time, so that the threads compression uses show in the figures.
+    printf("%-7s %5s %9s %7s %10s %12s\n", "data", "level", "size MiB", "ratio", "up MiB/s", "down MiB/s");
+    int failed = 0;
+    for (size_t c = 0; c < sizeof(contents) / sizeof(contents[0]); c++) {
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+            bench_result results[MAX_SIZES];
+            bench_opts opts = {.sizes = sizes,
+                               .n_sizes = n_sizes,
+                               .iterations = 3,
+                               .concurrency = 1,
+                               .text = c == 1,
+                               .compress = levels[l]};
+            if (e_storage_bench(node, &opts, results) != RET_OK) {
+                fprintf(stderr, "benchmark failed\n");
+                failed++;
+                continue;
+            }
+            for (size_t i = 0; i < n_sizes; i++) {
+                bench_result *r = &results[i];
+                printf("%-7s %5d %9zu %7.3f %10.1f %12.1f\n", contents[c], levels[l], r->size >> 20, r->ratio,
+                       r->upload_mibps, r->download_mibps);
+                failed += r->failed;
+            }
+        }
+    }
+
+    e_storage_stop(node);
+    e_storage_destroy(node);
+    return failed > 0 ? 1 : 0;
+}
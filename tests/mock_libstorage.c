@@ -1,19 +1,304 @@
 #include "libstorage.h"
 
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define FAKE_CID "zDvZRwzmAbCdEfGhIjKlMnOpQrStUvWxYz0123456789ABCD"
 
 // A fake context to return from storage_new.
 static int fake_ctx_data = 42;
-bool exists = false;
+// Guards mock state, since tests drive several nodes from different threads.
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Uploaded content, keyed by a CID derived from it, so that downloads return what was
+// uploaded. Uploading a file that can't be read stores empty content under FAKE_CID.
+typedef struct stored {
+    char cid[64];
+    char *data;
+    size_t len;
+    struct stored *next;
+} stored;
+
+static stored *store = NULL;
+
+// Upload sessions map session IDs to the file being uploaded.
+typedef struct session {
+    char id[32];
+    char *path;
+    struct session *next;
+} session;
+
+static session *sessions = NULL;
+static int next_session = 0;
+
+// The node's quota, as reported by storage_space and enforced by uploads. 0 for plenty.
+static size_t quota_max = 0;
+static int space_queries = 0;
+
+// Must be called with mock_lock held.
+static stored **store_find(const char *cid) {
+    stored **s = &store;
+    while (*s && strcmp((*s)->cid, cid) != 0) s = &(*s)->next;
+    return s;
+}
+
+static char *read_file(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *data = malloc(size > 0 ? size : 1);
+    if (data && fread(data, 1, size, fp) != (size_t) size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *len = size;
+    return data;
+}
+
+// Bytes of stored content. Must be called with mock_lock held.
+static size_t store_used(void) {
+    size_t used = 0;
+    for (stored *s = store; s; s = s->next) used += s->len;
+    return used;
+}
+
+// Stores the file's content and writes its CID into cid. Returns false if it exceeds the quota.
+static bool store_file(const char *path, char *cid, size_t cid_len) {
+    size_t len = 0;
+    char *data = path ? read_file(path, &len) : NULL;
+    if (data) {
+        unsigned long long h = 14695981039346656037ULL; // FNV-1a
+        for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char) data[i]) * 1099511628211ULL;
+        snprintf(cid, cid_len, "zDvZRwzm%016llx%08zx", h, len);
+    } else {
+        snprintf(cid, cid_len, "%s", FAKE_CID);
+        len = 0;
+    }
+
+    pthread_mutex_lock(&mock_lock);
+    stored **s = store_find(cid);
+    if (!*s && quota_max > 0 && store_used() + len > quota_max) {
+        pthread_mutex_unlock(&mock_lock);
+        free(data);
+        return false;
+    }
+    if (*s) {
+        free(data);
+    } else {
+        *s = calloc(1, sizeof(stored));
+        snprintf((*s)->cid, sizeof((*s)->cid), "%s", cid);
+        (*s)->data = data;
+        (*s)->len = len;
+    }
+    pthread_mutex_unlock(&mock_lock);
+    return true;
+}
+
+// Returns a copy of the content stored under cid (caller must free), or NULL.
+static char *store_get(const char *cid, size_t *len) {
+    char *data = NULL;
+    pthread_mutex_lock(&mock_lock);
+    stored *s = *store_find(cid);
+    if (s) {
+        *len = s->len;
+        data = malloc(s->len > 0 ? s->len : 1);
+        memcpy(data, s->data, s->len);
+    }
+    pthread_mutex_unlock(&mock_lock);
+    return data;
+}
+
+// Removes the session and returns its file path (caller must free), or NULL.
+static char *session_take(const char *id) {
+    char *path = NULL;
+    pthread_mutex_lock(&mock_lock);
+    for (session **s = &sessions; *s; s = &(*s)->next) {
+        if (strcmp((*s)->id, id) == 0) {
+            session *found = *s;
+            *s = found->next;
+            path = found->path;
+            free(found);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+    return path;
+}
+
+// When non-zero, uploads and downloads complete asynchronously on a thread of their own,
+// sending SLOW_CHUNKS progress updates this many milliseconds apart, so that tests can
+// interact with them (e.g. cancel them) while they are in flight.
+#define SLOW_CHUNKS 20
+static int transfer_delay_ms = 0;
+static bool cancel_requested = false;
+
+void mock_set_transfer_delay(int ms) {
+    pthread_mutex_lock(&mock_lock);
+    transfer_delay_ms = ms;
+    cancel_requested = false;
+    pthread_mutex_unlock(&mock_lock);
+}
+
+typedef struct {
+    StorageCallback callback;
+    void *userData;
+    char result[72];
+    int delay_ms;
+} slow_transfer;
+
+static void *slow_transfer_run(void *arg) {
+    slow_transfer *t = arg;
+    for (int i = 0; i < SLOW_CHUNKS; i++) {
+        usleep(t->delay_ms * 1000);
+        pthread_mutex_lock(&mock_lock);
+        bool cancelled = cancel_requested;
+        pthread_mutex_unlock(&mock_lock);
+        if (cancelled) {
+            t->callback(RET_ERR, "cancelled", 9, t->userData);
+            free(t);
+            return NULL;
+        }
+        t->callback(RET_PROGRESS, "chunk", 5, t->userData);
+    }
+    t->callback(RET_OK, t->result, strlen(t->result), t->userData);
+    free(t);
+    return NULL;
+}
+
+// Runs the transfer on its own thread if a delay is configured. Returns false if the
+// caller should complete it synchronously instead.
+static bool slow_transfer_start(StorageCallback callback, void *userData, const char *result) {
+    pthread_mutex_lock(&mock_lock);
+    int delay_ms = transfer_delay_ms;
+    pthread_mutex_unlock(&mock_lock);
+    if (delay_ms <= 0 || !callback)
+        return false;
+
+    slow_transfer *t = malloc(sizeof(slow_transfer));
+    pthread_t thread;
+    *t = (slow_transfer) {.callback = callback, .userData = userData, .delay_ms = delay_ms};
+    snprintf(t->result, sizeof(t->result), "%s", result);
+    pthread_create(&thread, NULL, slow_transfer_run, t);
+    pthread_detach(thread);
+    return true;
+}
+
+static int cancel_transfer(void *ctx, StorageCallback callback, void *userData) {
+    if (!ctx)
+        return RET_ERR;
+    pthread_mutex_lock(&mock_lock);
+    cancel_requested = true;
+    pthread_mutex_unlock(&mock_lock);
+    if (callback) {
+        callback(RET_OK, "", 0, userData);
+    }
+    return RET_OK;
+}
+
+// Download streams can be made to stall like a stuck peer would: they deliver one chunk and
+// then go quiet until cancelled (or, as a safeguard, for 10 seconds), and then fail.
+typedef struct stall {
+    char cid[64];
+    bool cancelled;
+    StorageCallback callback;
+    void *userData;
+    struct stall *next;
+} stall;
+
+static int stalls_pending = 0;
+static stall *stalls = NULL;
+
+// Makes the next `count` download streams stall.
+void mock_stall_downloads(int count) {
+    pthread_mutex_lock(&mock_lock);
+    stalls_pending = count;
+    pthread_mutex_unlock(&mock_lock);
+}
+
+static void *stall_run(void *arg) {
+    stall *s = arg;
+    s->callback(RET_PROGRESS, "chunk", 5, s->userData);
+    for (int i = 0; i < 2000; i++) {
+        pthread_mutex_lock(&mock_lock);
+        bool cancelled = s->cancelled;
+        pthread_mutex_unlock(&mock_lock);
+        if (cancelled)
+            break;
+        usleep(5 * 1000);
+    }
+
+    pthread_mutex_lock(&mock_lock);
+    for (stall **p = &stalls; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+    s->callback(RET_ERR, "stalled", 7, s->userData);
+    free(s);
+    return NULL;
+}
+
+// Stalls the stream if a stall is pending. Returns false if it should go ahead instead.
+static bool stall_start(const char *cid, StorageCallback callback, void *userData) {
+    pthread_mutex_lock(&mock_lock);
+    if (stalls_pending <= 0 || !callback) {
+        pthread_mutex_unlock(&mock_lock);
+        return false;
+    }
+    stalls_pending--;
+    stall *s = calloc(1, sizeof(stall));
+    snprintf(s->cid, sizeof(s->cid), "%s", cid);
+    s->callback = callback;
+    s->userData = userData;
+    s->next = stalls;
+    stalls = s;
+    pthread_mutex_unlock(&mock_lock);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, stall_run, s);
+    pthread_detach(thread);
+    return true;
+}
+
+static void stall_cancel(const char *cid) {
+    pthread_mutex_lock(&mock_lock);
+    for (stall *s = stalls; s; s = s->next) {
+        if (strcmp(s->cid, cid) == 0)
+            s->cancelled = true;
+    }
+    pthread_mutex_unlock(&mock_lock);
+}
 
 void libstorageNimMain(void) {
     // no-op
 }
 
+// The config JSON passed to the most recent storage_new call.
+static char *last_config = NULL;
+
+// Returns a copy of the last config JSON (caller must free).
+char *mock_last_config(void) {
+    pthread_mutex_lock(&mock_lock);
+    char *config = last_config ? strdup(last_config) : NULL;
+    pthread_mutex_unlock(&mock_lock);
+    return config;
+}
+
 void *storage_new(const char *configJson, StorageCallback callback, void *userData) {
+    pthread_mutex_lock(&mock_lock);
+    free(last_config);
+    last_config = strdup(configJson);
+    pthread_mutex_unlock(&mock_lock);
+
     if (callback) {
         callback(RET_OK, "ok", 2, userData);
     }
@@ -56,10 +341,17 @@ int storage_destroy(void *ctx) {
 int storage_upload_init(void *ctx, const char *filepath, size_t chunkSize, StorageCallback callback, void *userData) {
     if (!ctx)
         return RET_ERR;
-    // Return a fake session ID
-    const char *session_id = "mock-session-123";
+
+    session *sess = calloc(1, sizeof(session));
+    sess->path = strdup(filepath);
+    pthread_mutex_lock(&mock_lock);
+    snprintf(sess->id, sizeof(sess->id), "mock-session-%d", next_session++);
+    sess->next = sessions;
+    sessions = sess;
+    pthread_mutex_unlock(&mock_lock);
+
     if (callback) {
-        callback(RET_OK, session_id, strlen(session_id), userData);
+        callback(RET_OK, sess->id, strlen(sess->id), userData);
     }
     return RET_OK;
 }
@@ -67,24 +359,51 @@ int storage_upload_init(void *ctx, const char *filepath, size_t chunkSize, Stora
 int storage_upload_file(void *ctx, const char *sessionId, StorageCallback callback, void *userData) {
     if (!ctx)
         return RET_ERR;
+
+    char cid[64];
+    char *path = session_take(sessionId);
+    bool fits = store_file(path, cid, sizeof(cid));
+    free(path);
+    if (!fits) {
+        // As a full node would, only once the data has been sent.
+        if (callback)
+            callback(RET_ERR, "quota exceeded", 14, userData);
+        return RET_OK;
+    }
+
+    if (slow_transfer_start(callback, userData, cid))
+        return RET_OK;
     // Fire a progress callback first, then final OK with CID
     if (callback) {
         callback(RET_PROGRESS, "chunk", 5, userData);
-        const char *cid = FAKE_CID;
         callback(RET_OK, cid, strlen(cid), userData);
-        exists = true;
     }
     return RET_OK;
 }
 
+int storage_upload_cancel(void *ctx, const char *sessionId, StorageCallback callback, void *userData) {
+    return cancel_transfer(ctx, callback, userData);
+}
+
 int storage_delete(void *ctx, const char *cid, StorageCallback callback, void *userData) {
     if (!ctx)
         return RET_ERR;
 
+    pthread_mutex_lock(&mock_lock);
+    stored **s = store_find(cid);
+    stored *found = *s;
+    if (found)
+        *s = found->next;
+    pthread_mutex_unlock(&mock_lock);
+
+    if (found) {
+        free(found->data);
+        free(found);
+    }
+
     if (callback) {
-        if (strcmp(cid, FAKE_CID) == 0 && exists) {
+        if (found) {
             callback(RET_OK, "", 0, userData);
-            exists = false;
         } else {
             callback(RET_ERR, "Failed", 6, userData);
         }
@@ -93,6 +412,20 @@ int storage_delete(void *ctx, const char *cid, StorageCallback callback, void *u
     return RET_OK;
 }
 
+int storage_exists(void *ctx, const char *cid, StorageCallback callback, void *userData) {
+    if (!ctx)
+        return RET_ERR;
+
+    pthread_mutex_lock(&mock_lock);
+    bool found = *store_find(cid) != NULL;
+    pthread_mutex_unlock(&mock_lock);
+
+    if (callback) {
+        callback(RET_OK, found ? "true" : "false", found ? 4 : 5, userData);
+    }
+    return RET_OK;
+}
+
 int storage_download_init(void *ctx, const char *cid, size_t chunkSize, bool local, StorageCallback callback,
                           void *userData) {
     if (!ctx)
@@ -103,17 +436,113 @@ int storage_download_init(void *ctx, const char *cid, size_t chunkSize, bool loc
     return RET_OK;
 }
 
+// Streams stored content as chunks through the callback, and to filepath unless it's empty.
+// Unknown CIDs produce a single fake chunk and nothing on disk.
 int storage_download_stream(void *ctx, const char *cid, size_t chunkSize, bool local, const char *filepath,
                             StorageCallback callback, void *userData) {
     if (!ctx)
         return RET_ERR;
+    if (stall_start(cid, callback, userData) || slow_transfer_start(callback, userData, "done"))
+        return RET_OK;
+
+    size_t len = 0;
+    char *data = store_get(cid, &len);
+    if (!data) {
+        if (callback) {
+            callback(RET_PROGRESS, "data", 4, userData);
+            callback(RET_OK, "done", 4, userData);
+        }
+        return RET_OK;
+    }
+
+    FILE *fp = filepath && filepath[0] ? fopen(filepath, "wb") : NULL;
+    if (filepath && filepath[0] && !fp) {
+        free(data);
+        if (callback)
+            callback(RET_ERR, "open failed", 11, userData);
+        return RET_OK;
+    }
+
+    for (size_t off = 0; off < len; off += chunkSize) {
+        size_t n = len - off < chunkSize ? len - off : chunkSize;
+        if (fp)
+            fwrite(data + off, 1, n, fp);
+        if (callback)
+            callback(RET_PROGRESS, data + off, n, userData);
+    }
+    if (fp)
+        fclose(fp);
+    free(data);
+
     if (callback) {
-        callback(RET_PROGRESS, "data", 4, userData);
         callback(RET_OK, "done", 4, userData);
     }
     return RET_OK;
 }
 
+int storage_download_cancel(void *ctx, const char *cid, StorageCallback callback, void *userData) {
+    if (ctx)
+        stall_cancel(cid);
+    return cancel_transfer(ctx, callback, userData);
+}
+
+// Describes stored content; unknown CIDs fail like a missing manifest would.
+int storage_download_manifest(void *ctx, const char *cid, StorageCallback callback, void *userData) {
+    if (!ctx)
+        return RET_ERR;
+
+    size_t len = 0;
+    char *data = store_get(cid, &len);
+    if (callback) {
+        if (data) {
+            char manifest[256];
+            int n = snprintf(manifest, sizeof(manifest),
+                             "{\"treeCid\":\"%s\",\"datasetSize\":%zu,\"blockSize\":65536,\"protected\":false}", cid,
+                             len);
+            callback(RET_OK, manifest, n, userData);
+        } else {
+            callback(RET_ERR, "manifest not found", 18, userData);
+        }
+    }
+    free(data);
+    return RET_OK;
+}
+
+// Leaves `bytes` of quota free from now on (0 lifts the quota).
+void mock_set_free_space(size_t bytes) {
+    pthread_mutex_lock(&mock_lock);
+    quota_max = bytes > 0 ? store_used() + bytes : 0;
+    pthread_mutex_unlock(&mock_lock);
+}
+
+// Number of storage_space calls so far.
+int mock_space_queries(void) {
+    pthread_mutex_lock(&mock_lock);
+    int n = space_queries;
+    pthread_mutex_unlock(&mock_lock);
+    return n;
+}
+
+int storage_space(void *ctx, StorageCallback callback, void *userData) {
+    if (!ctx)
+        return RET_ERR;
+
+    pthread_mutex_lock(&mock_lock);
+    space_queries++;
+    size_t used = store_used();
+    size_t max = quota_max > 0 ? quota_max : used + (1ULL << 40);
+    pthread_mutex_unlock(&mock_lock);
+
+    if (callback) {
+        char space[256];
+        int n = snprintf(space, sizeof(space),
+                         "{\"totalBlocks\":%zu,\"quotaMaxBytes\":%zu,\"quotaUsedBytes\":%zu,\"quotaReservedBytes\":0}",
+                         used / 65536, max, used);
+        callback(RET_OK, space, n, userData);
+    }
+    return RET_OK;
+}
+
 int storage_spr(void *ctx, StorageCallback callback, void *userData) {
     const char *resp = "spr:"
                        "CiUIAhIhAjWYLRhJho1LoZbaxILgJVTrHptSiejsvLKAqlumo4c4EgIDARpJCicAJQgCEiECNZgtGEmGjUuhltrEguAlVOs"
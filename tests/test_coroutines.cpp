@@ -0,0 +1,216 @@
+#include "easystorage.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int tests_run = 0;
+static int tests_passed = 0;
+
+#define RUN_TEST(fn)                                                                                                   \
+    do {                                                                                                               \
+        tests_run++;                                                                                                   \
+        printf("  %-30s", #fn);                                                                                        \
+        fn();                                                                                                          \
+        assert(e_storage_memory_used(nullptr) == 0);                                                                   \
+        tests_passed++;                                                                                                \
+        printf(" OK\n");                                                                                               \
+    } while (0)
+
+static node_config default_config() {
+    node_config cfg = {};
+    cfg.api_port = 8080;
+    cfg.disc_port = 8090;
+    cfg.data_dir = const_cast<char *>("./test-data");
+    cfg.log_level = const_cast<char *>("WARN");
+    return cfg;
+}
+
+static void write_file(const std::string &path, const std::string &contents) {
+    FILE *fp = fopen(path.c_str(), "w");
+    assert(fp != nullptr);
+    fputs(contents.c_str(), fp);
+    fclose(fp);
+}
+
+static std::string read_file(const std::string &path) {
+    FILE *fp = fopen(path.c_str(), "r");
+    assert(fp != nullptr);
+    char buf[256] = {};
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    return std::string(buf, n);
+}
+
+// A fire-and-forget coroutine that counts down a latch when it finishes.
+struct latch {
+    std::mutex lock;
+    std::condition_variable cond;
+    int remaining;
+
+    void count_down() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (--remaining == 0)
+            cond.notify_all();
+    }
+    void wait() {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this] { return remaining == 0; });
+    }
+};
+
+struct task {
+    struct promise_type {
+        task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Resumes coroutines on a worker thread of its own.
+class thread_executor {
+public:
+    thread_executor() : worker_([this] { run(); }) {}
+    ~thread_executor() {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stop_ = true;
+        }
+        cond_.notify_all();
+        worker_.join();
+    }
+
+    void post(std::coroutine_handle<> h) {
+        std::lock_guard<std::mutex> guard(lock_);
+        queue_.push_back(h);
+        cond_.notify_all();
+    }
+
+    std::thread::id id() const { return worker_.get_id(); }
+    int resumed() const { return resumed_; }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> guard(lock_);
+        while (true) {
+            cond_.wait(guard, [this] { return stop_ || !queue_.empty(); });
+            if (queue_.empty())
+                return;
+            auto h = queue_.front();
+            queue_.pop_front();
+            guard.unlock();
+            resumed_++;
+            h.resume();
+            guard.lock();
+        }
+    }
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::deque<std::coroutine_handle<>> queue_;
+    bool stop_ = false;
+    std::atomic<int> resumed_{0};
+    std::thread worker_;
+};
+
+struct post_to {
+    thread_executor *executor;
+    void operator()(std::coroutine_handle<> h) const { executor->post(h); }
+};
+
+static task round_trip(easystorage::node &node, int i, latch &done, std::atomic<int> &ok) {
+    std::string in = "/tmp/coro-" + std::to_string(i) + ".txt";
+    std::string out = "/tmp/coro-" + std::to_string(i) + ".out";
+    std::string contents = "coroutine contents " + std::to_string(i);
+    write_file(in, contents);
+
+    auto [status, cid] = co_await node.upload(in.c_str());
+    if (status == RET_OK) {
+        int downloaded = co_await node.download(cid.c_str(), out.c_str());
+        bool same = downloaded == RET_OK && read_file(out) == contents;
+        int removed = co_await node.remove(cid.c_str());
+        if (same && removed == RET_OK)
+            ok++;
+    }
+    done.count_down();
+}
+
+static void test_coroutines_should_run_concurrently(void) {
+    easystorage::node node(default_config());
+    assert(node.start() == RET_OK);
+
+    // All of these are in flight at once without a thread each.
+    const int n = 200;
+    latch done{{}, {}, n};
+    std::atomic<int> ok{0};
+    for (int i = 0; i < n; i++) round_trip(node, i, done, ok);
+    done.wait();
+    assert(ok == n);
+}
+
+static task on_executor(easystorage::node &node, thread_executor &executor, latch &done, bool &same_thread) {
+    auto spr = co_await node.spr(post_to{&executor});
+    same_thread = spr.ok() && std::strncmp(spr.value.c_str(), "spr:", 4) == 0 &&
+                  std::this_thread::get_id() == executor.id();
+    done.count_down();
+}
+
+static void test_coroutines_should_resume_on_executor(void) {
+    thread_executor executor;
+    easystorage::node node(default_config());
+    latch done{{}, {}, 1};
+    bool same_thread = false;
+    on_executor(node, executor, done, same_thread);
+    done.wait();
+    assert(same_thread);
+    assert(executor.resumed() == 1);
+}
+
+static task fails(easystorage::node &node, latch &done, int &status) {
+    transfer_opts opts = {};
+    opts.preallocate = true; // not supported asynchronously, so it fails without suspending
+    status = co_await node.download("zDvZRwzmSomeCid", "/tmp/coro.out", &opts);
+    done.count_down();
+}
+
+static void test_coroutines_should_report_failures(void) {
+    easystorage::node node(default_config());
+    latch done{{}, {}, 1};
+    int status = RET_OK;
+    fails(node, done, status);
+    done.wait();
+    assert(status == RET_ERR);
+}
+
+static void test_owned_strings_should_move(void) {
+    easystorage::cid a(strdup("zDvZRwzmAbc"));
+    easystorage::cid b(std::move(a));
+    assert(!a && b && b.view() == "zDvZRwzmAbc");
+    a = std::move(b);
+    assert(a && !b);
+    char *raw = a.release();
+    assert(!a);
+    free(raw);
+}
+
+int main() {
+    printf("Running easylibstorage C++ tests...\n");
+
+    RUN_TEST(test_coroutines_should_run_concurrently);
+    RUN_TEST(test_coroutines_should_resume_on_executor);
+    RUN_TEST(test_coroutines_should_report_failures);
+    RUN_TEST(test_owned_strings_should_move);
+
+    printf("\n%d/%d tests passed.\n", tests_passed, tests_run);
+    return tests_passed == tests_run ? 0 : 1;
+}
@@ -1,13 +1,29 @@
 #include "easystorage.h"
+#include "easystorage_io.h"
+#include "easystorage_sha256.h"
+#include "storaged.h"
 
 #include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define RET_OK 0
 #define RET_ERR 1
 
+// Mock controls, see mock_libstorage.c.
+void mock_set_transfer_delay(int ms);
+void mock_stall_downloads(int count);
+void mock_set_free_space(size_t bytes);
+int mock_space_queries(void);
+char *mock_last_config(void);
+
 static int tests_run = 0;
 static int tests_passed = 0;
 
@@ -16,6 +32,7 @@ static int tests_passed = 0;
         tests_run++;                                                                                                   \
         printf("  %-30s", #fn);                                                                                        \
         fn();                                                                                                          \
+        assert(e_storage_memory_used(NULL) == 0);                                                                      \
         tests_passed++;                                                                                                \
         printf(" OK\n");                                                                                               \
     } while (0)
@@ -38,6 +55,13 @@ FILE *write_to_temp(const char *contents) {
     return fp;
 }
 
+static void write_file(const char *path, const char *contents) {
+    FILE *fp = fopen(path, "w");
+    assert(fp != NULL);
+    fputs(contents, fp);
+    fclose(fp);
+}
+
 // --- Tests ---
 
 static void test_new(void) {
@@ -45,6 +69,7 @@ static void test_new(void) {
     cfg.bootstrap_node = "spr:abc123";
     STORAGE_NODE node = e_storage_new(cfg);
     assert(node != NULL);
+    assert(e_storage_destroy(node) == RET_OK);
 }
 
 static void test_new_defaults(void) {
@@ -53,6 +78,7 @@ static void test_new_defaults(void) {
     cfg.disc_port = 9010;
     STORAGE_NODE node = e_storage_new(cfg);
     assert(node != NULL);
+    assert(e_storage_destroy(node) == RET_OK);
 }
 
 static void test_start(void) {
@@ -61,6 +87,7 @@ static void test_start(void) {
     assert(node != NULL);
     int ret = e_storage_start(node);
     assert(ret == RET_OK);
+    assert(e_storage_destroy(node) == RET_OK);
 }
 
 static void test_start_null(void) {
@@ -75,6 +102,7 @@ static void test_stop(void) {
     e_storage_start(node);
     int ret = e_storage_stop(node);
     assert(ret == RET_OK);
+    assert(e_storage_destroy(node) == RET_OK);
 }
 
 static void test_destroy(void) {
@@ -100,6 +128,7 @@ static void test_upload(void) {
     assert(cid != NULL);
     assert(strlen(cid) > 0);
     free(cid);
+    assert(e_storage_destroy(node) == RET_OK);
 }
 
 static void test_upload_null(void) {
@@ -115,6 +144,7 @@ static void test_download(void) {
 
     int ret = e_storage_download(node, "zDvZRwzmSomeCid", "/tmp/out.dat", NULL);
     assert(ret == RET_OK);
+    assert(e_storage_destroy(node) == RET_OK);
 }
 
 static void test_download_null(void) {
@@ -136,6 +166,7 @@ static void test_should_delete_file(void) {
     // Non-existing files can't be deleted.
     assert(e_storage_delete(node, cid) == RET_ERR);
     free(cid);
+    assert(e_storage_destroy(node) == RET_OK);
 }
 
 static void test_get_should_get_node_spr(void) {
@@ -145,10 +176,12 @@ static void test_get_should_get_node_spr(void) {
     assert(e_storage_start(node) == RET_OK);
 
     const char *sprprefix = "spr:CiUIAhIhA";
-    const char *spr = e_storage_spr(node);
+    char *spr = e_storage_spr(node);
     assert(spr != NULL);
     assert(strlen(spr) > 0);
     assert(strncmp(sprprefix, spr, strlen(sprprefix)) == 0);
+    free(spr);
+    assert(e_storage_destroy(node) == RET_OK);
 }
 
 static void test_full_lifecycle(void) {
@@ -195,6 +228,1610 @@ static void test_should_read_configuration_file(void) {
     e_storage_free_config(&cfg);
 }
 
+static void *node_worker(void *arg) {
+    int idx = *(int *) arg;
+    node_config cfg = default_config();
+    cfg.api_port += idx;
+    cfg.disc_port += idx;
+
+    STORAGE_NODE node = e_storage_new(cfg);
+    assert(node != NULL);
+    assert(e_storage_start(node) == RET_OK);
+
+    char *cid = e_storage_upload(node, "/tmp/concurrent.txt", NULL);
+    assert(cid != NULL);
+    assert(e_storage_download(node, cid, "/tmp/concurrent_out.dat", NULL) == RET_OK);
+    free(cid);
+
+    assert(e_storage_stop(node) == RET_OK);
+    assert(e_storage_destroy(node) == RET_OK);
+    return NULL;
+}
+
+static void test_should_run_nodes_from_multiple_threads(void) {
+    enum { N_THREADS = 8 };
+    pthread_t threads[N_THREADS];
+    int idx[N_THREADS];
+
+    for (int i = 0; i < N_THREADS; i++) {
+        idx[i] = i;
+        assert(pthread_create(&threads[i], NULL, node_worker, &idx[i]) == 0);
+    }
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+}
+
+static void test_nodes_should_be_isolated(void) {
+    node_config cfg = default_config();
+    STORAGE_NODE a = e_storage_new(cfg);
+    STORAGE_NODE b = e_storage_new(cfg);
+    assert(a != NULL && b != NULL);
+    assert(a != b);
+
+    // Destroying one node must leave the other usable.
+    assert(e_storage_destroy(a) == RET_OK);
+    assert(e_storage_start(b) == RET_OK);
+    assert(e_storage_stop(b) == RET_OK);
+    assert(e_storage_destroy(b) == RET_OK);
+}
+
+static void test_pool_should_hand_out_distinct_nodes(void) {
+    STORAGE_POOL pool = e_storage_pool_new(default_config(), 3);
+    assert(pool != NULL);
+    assert(e_storage_pool_size(pool) == 3);
+
+    STORAGE_NODE a = e_storage_pool_checkout(pool);
+    STORAGE_NODE b = e_storage_pool_checkout(pool);
+    STORAGE_NODE c = e_storage_pool_checkout(pool);
+    assert(a && b && c);
+    assert(a != b && b != c && a != c);
+
+    // Can't tear down the pool while nodes are checked out.
+    assert(e_storage_pool_destroy(pool) == RET_ERR);
+
+    char *cid = e_storage_upload(b, "/tmp/pool.txt", NULL);
+    assert(cid != NULL);
+    free(cid);
+
+    assert(e_storage_pool_checkin(pool, a) == RET_OK);
+    assert(e_storage_pool_checkin(pool, a) == RET_ERR);
+    assert(e_storage_pool_checkin(pool, b) == RET_OK);
+    assert(e_storage_pool_checkin(pool, c) == RET_OK);
+    assert(e_storage_pool_destroy(pool) == RET_OK);
+}
+
+static void *pool_checkin_later(void *arg) {
+    void **args = arg;
+    usleep(50 * 1000);
+    assert(e_storage_pool_checkin(args[0], args[1]) == RET_OK);
+    return NULL;
+}
+
+static void test_pool_checkout_should_wait_for_checkin(void) {
+    STORAGE_POOL pool = e_storage_pool_new(default_config(), 1);
+    assert(pool != NULL);
+
+    STORAGE_NODE node = e_storage_pool_checkout(pool);
+    assert(node != NULL);
+
+    pthread_t t;
+    void *args[] = {pool, node};
+    assert(pthread_create(&t, NULL, pool_checkin_later, args) == 0);
+    assert(e_storage_pool_checkout(pool) == node);
+    pthread_join(t, NULL);
+
+    assert(e_storage_pool_checkin(pool, node) == RET_OK);
+    assert(e_storage_pool_destroy(pool) == RET_OK);
+}
+
+static void *pool_checkout_once(void *pool) {
+    STORAGE_NODE node = e_storage_pool_checkout(pool);
+    if (node)
+        assert(e_storage_pool_checkin(pool, node) == RET_OK);
+    return NULL;
+}
+
+static void test_pool_destroy_should_not_pull_the_pool_from_under_a_checkout(void) {
+    STORAGE_POOL pool = e_storage_pool_new(default_config(), 1);
+    assert(pool != NULL);
+    STORAGE_NODE node = e_storage_pool_checkout(pool);
+    assert(node != NULL);
+
+    // The waiter is woken by the checkin but may only get the lock after destroy has taken it.
+    pthread_t t;
+    assert(pthread_create(&t, NULL, pool_checkout_once, pool) == 0);
+    usleep(50 * 1000);
+    assert(e_storage_pool_checkin(pool, node) == RET_OK);
+    while (e_storage_pool_destroy(pool) != RET_OK) usleep(1000);
+    pthread_join(t, NULL);
+}
+
+static void *server_thread(void *srv) {
+    assert(storaged_server_run(srv) == RET_OK);
+    return NULL;
+}
+
+static void test_daemon_should_serve_clients(void) {
+    const char *sock = "/tmp/easystorage-test.sock";
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+    assert(e_storage_start(node) == RET_OK);
+
+    // Whatever isn't a socket is left alone.
+    write_file(sock, "not a socket");
+    assert(storaged_server_new(node, sock) == NULL);
+    struct stat st;
+    assert(stat(sock, &st) == 0 && S_ISREG(st.st_mode));
+    unlink(sock);
+
+    STORAGED_SERVER srv = storaged_server_new(node, sock);
+    assert(srv != NULL);
+    assert(stat(sock, &st) == 0 && (st.st_mode & 077) == 0);
+    assert(storaged_server_new(node, sock) == NULL); // in use
+    pthread_t t;
+    assert(pthread_create(&t, NULL, server_thread, srv) == 0);
+
+    int conn = storaged_connect(sock);
+    assert(conn >= 0);
+
+    write_file("/tmp/daemon-upload.txt", "hello");
+
+    char *cid = storaged_upload(conn, "/tmp/daemon-upload.txt");
+    assert(cid != NULL);
+    assert(strlen(cid) > 0);
+
+    char *spr = storaged_spr(conn);
+    assert(spr != NULL);
+    assert(strncmp(spr, "spr:", 4) == 0);
+    free(spr);
+
+    // A second client is served independently.
+    int other = storaged_connect(sock);
+    assert(other >= 0);
+    assert(storaged_download(other, cid, "/tmp/daemon-download.dat") == RET_OK);
+
+    // Compressed content reaches the client expanded, although the daemon only has its descriptor.
+    const char *text = "compressed through the daemon, compressed through the daemon";
+    write_file("/tmp/daemon-compressed.txt", text);
+    transfer_opts packed = {.compress = 3};
+    char *packed_cid = e_storage_upload_opts(node, "/tmp/daemon-compressed.txt", &packed);
+    assert(packed_cid != NULL);
+    assert(storaged_download(other, packed_cid, "/tmp/daemon-download.dat") == RET_OK);
+    char buf[128] = {0};
+    FILE *fp = fopen("/tmp/daemon-download.dat", "r");
+    assert(fp != NULL && fread(buf, 1, sizeof(buf) - 1, fp) == strlen(text));
+    fclose(fp);
+    assert(strcmp(buf, text) == 0);
+    assert(storaged_delete(conn, packed_cid) == RET_OK);
+    free(packed_cid);
+    unlink("/tmp/daemon-compressed.txt");
+    storaged_disconnect(other);
+
+    assert(storaged_delete(conn, cid) == RET_OK);
+    assert(storaged_delete(conn, cid) == RET_ERR);
+    assert(storaged_upload(conn, "/nonexistent/file") == NULL);
+    free(cid);
+
+    storaged_server_stop(srv);
+    pthread_join(t, NULL);
+    storaged_server_destroy(srv);
+    storaged_disconnect(conn);
+
+    assert(storaged_connect(sock) < 0);
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+static void count_progress(void *user, size_t complete) { *(size_t *) user = complete; }
+
+static void test_transfer_opts_should_report_progress_with_user_data(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+
+    write_file("/tmp/opts.txt", "some file contents");
+    size_t uploaded = 0, downloaded = 0;
+    transfer_opts up = {.progress = count_progress, .user = &uploaded};
+    char *cid = e_storage_upload_opts(node, "/tmp/opts.txt", &up);
+    assert(cid != NULL);
+    assert(up.status == RET_OK);
+    assert(uploaded > 0);
+
+    transfer_opts down = {.progress = count_progress, .user = &downloaded};
+    assert(e_storage_download_opts(node, cid, "/tmp/opts_out.dat", &down) == RET_OK);
+    assert(down.status == RET_OK);
+    assert(downloaded == strlen("some file contents"));
+    free(cid);
+
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+static void *cancel_soon(void *opts) {
+    usleep(50 * 1000);
+    e_storage_cancel(opts);
+    return NULL;
+}
+
+static void test_should_cancel_transfers(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+    mock_set_transfer_delay(20);
+
+    pthread_t t;
+    transfer_opts down = {0};
+    assert(pthread_create(&t, NULL, cancel_soon, &down) == 0);
+    assert(e_storage_download_opts(node, "zDvZRwzmSomeCid", "/tmp/cancel_out.dat", &down) == RET_CANCELLED);
+    assert(down.status == RET_CANCELLED);
+    pthread_join(t, NULL);
+
+    mock_set_transfer_delay(20);
+    transfer_opts up = {0};
+    assert(pthread_create(&t, NULL, cancel_soon, &up) == 0);
+    assert(e_storage_upload_opts(node, "/tmp/cancel.txt", &up) == NULL);
+    assert(up.status == RET_CANCELLED);
+    pthread_join(t, NULL);
+
+    // Cancelled before starting.
+    transfer_opts early = {0};
+    e_storage_cancel(&early);
+    assert(e_storage_download_opts(node, "zDvZRwzmSomeCid", "/tmp/cancel_out.dat", &early) == RET_CANCELLED);
+
+    mock_set_transfer_delay(0);
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+// Counts the entries in dir whose name starts with prefix.
+static int count_files(const char *dir, const char *prefix) {
+    DIR *d = opendir(dir);
+    assert(d != NULL);
+    int count = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (strncmp(e->d_name, prefix, strlen(prefix)) == 0)
+            count++;
+    }
+    closedir(d);
+    return count;
+}
+
+static void test_should_download_in_place(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+
+    // Enough chunks to fill several of the writer's buffers, and a tail that isn't block-aligned.
+    size_t size = 3 * 1024 * 1024 + 123;
+    unsigned char *data = malloc(size);
+    assert(data != NULL);
+    for (size_t i = 0; i < size; i++) data[i] = (unsigned char) (i * 31 + i / 65536);
+    FILE *fp = fopen("/tmp/inplace.dat", "wb");
+    assert(fp != NULL && fwrite(data, 1, size, fp) == size);
+    fclose(fp);
+
+    char *cid = e_storage_upload(node, "/tmp/inplace.dat", NULL);
+    assert(cid != NULL);
+
+    unlink("/tmp/inplace_out.dat");
+    size_t downloaded = 0;
+    transfer_opts opts = {.progress = count_progress, .user = &downloaded, .preallocate = true};
+    assert(e_storage_download_opts(node, cid, "/tmp/inplace_out.dat", &opts) == RET_OK);
+    assert(opts.status == RET_OK);
+    assert(downloaded == size);
+
+    struct stat st;
+    assert(stat("/tmp/inplace_out.dat", &st) == 0 && (size_t) st.st_size == size);
+    unsigned char *out = malloc(size);
+    fp = fopen("/tmp/inplace_out.dat", "rb");
+    assert(out != NULL && fp != NULL && fread(out, 1, size, fp) == size);
+    fclose(fp);
+    assert(memcmp(data, out, size) == 0);
+    assert(count_files("/tmp", "inplace_out.dat.") == 0);
+
+    // Same, bypassing the page cache.
+    unlink("/tmp/inplace_out.dat");
+    transfer_opts direct = {.preallocate = true, .direct_io = true};
+    assert(e_storage_download_opts(node, cid, "/tmp/inplace_out.dat", &direct) == RET_OK);
+    memset(out, 0, size);
+    fp = fopen("/tmp/inplace_out.dat", "rb");
+    assert(fp != NULL && fread(out, 1, size + 1, fp) == size);
+    fclose(fp);
+    assert(memcmp(data, out, size) == 0);
+
+    // A cancelled download leaves nothing behind.
+    unlink("/tmp/inplace_out.dat");
+    mock_set_transfer_delay(20);
+    pthread_t t;
+    transfer_opts cancelled = {.preallocate = true};
+    assert(pthread_create(&t, NULL, cancel_soon, &cancelled) == 0);
+    assert(e_storage_download_opts(node, cid, "/tmp/inplace_out.dat", &cancelled) == RET_CANCELLED);
+    pthread_join(t, NULL);
+    mock_set_transfer_delay(0);
+    assert(access("/tmp/inplace_out.dat", F_OK) != 0);
+    assert(count_files("/tmp", "inplace_out.dat.") == 0);
+
+    transfer_opts missing_dir = {.preallocate = true};
+    assert(e_storage_download_opts(node, cid, "/nonexistent/out.dat", &missing_dir) == RET_ERR);
+
+    free(cid);
+    free(data);
+    free(out);
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+static void test_file_sink_should_write_through_each_engine(void) {
+    size_t size = 3 * 1024 * 1024 + 12345;
+    char *data = malloc(size), *out = malloc(size + 1);
+    assert(data != NULL && out != NULL);
+    for (size_t i = 0; i < size; i++) data[i] = (char) (i * 7 + i / 4096);
+
+    int flags[] = {0, SINK_NO_URING, SINK_DIRECT, SINK_DIRECT | SINK_NO_URING};
+    for (int f = 0; f < 4; f++) {
+        int fd = open("/tmp/sink.dat", O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        file_sink *sink = sink_open(fd, flags[f], NULL);
+        assert(sink != NULL);
+        if (flags[f] & SINK_NO_URING)
+            assert(strcmp(sink_engine(sink), "pwrite") == 0);
+
+        // Uneven chunks, as a stream may deliver them.
+        for (size_t off = 0, n; off < size; off += n) {
+            n = size - off < 65536 + 17 ? size - off : 65536 + 17;
+            assert(sink_write(sink, data + off, n, off) == RET_OK);
+        }
+        assert(sink_write(sink, data, 10, 0) == RET_ERR); // out of order
+        assert(sink_finish(sink) == RET_OK);
+        assert(sink_written(sink) == size);
+        sink_free(sink);
+        close(fd);
+
+        FILE *fp = fopen("/tmp/sink.dat", "rb");
+        assert(fp != NULL && fread(out, 1, size + 1, fp) == size);
+        fclose(fp);
+        assert(memcmp(data, out, size) == 0);
+    }
+
+    unlink("/tmp/sink.dat");
+    free(data);
+    free(out);
+}
+
+// Collects what a sink receives, checking that chunks arrive in order.
+typedef struct {
+    char *data;
+    size_t len;
+    int fail_after; // chunks to accept before failing, or -1
+} collector;
+
+static int collect_chunk(void *user, const char *data, size_t len, size_t offset) {
+    collector *c = user;
+    if (c->fail_after == 0 || offset != c->len)
+        return RET_ERR;
+    c->fail_after--;
+    c->data = realloc(c->data, c->len + len);
+    assert(c->data != NULL);
+    memcpy(c->data + c->len, data, len);
+    c->len += len;
+    return RET_OK;
+}
+
+typedef struct {
+    int fd;
+    collector out;
+} fd_reader;
+
+static void *read_fd(void *arg) {
+    fd_reader *r = arg;
+    char buf[4096];
+    for (ssize_t n; (n = read(r->fd, buf, sizeof(buf))) > 0;) collect_chunk(&r->out, buf, n, r->out.len);
+    return NULL;
+}
+
+static int slow_chunk(void *user, const char *data, size_t len, size_t offset) {
+    usleep(300 * 1000);
+    return collect_chunk(user, data, len, offset);
+}
+
+typedef struct {
+    STORAGE_NODE node;
+    transfer_opts *opts;
+    long long spr_ms; // how long the node took to answer meanwhile
+} cancel_and_call;
+
+static void *cancel_then_call(void *arg) {
+    cancel_and_call *c = arg;
+    usleep(50 * 1000);
+    e_storage_cancel(c->opts);
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    free(e_storage_spr(c->node));
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    c->spr_ms = (b.tv_sec - a.tv_sec) * 1000LL + (b.tv_nsec - a.tv_nsec) / 1000000;
+    return NULL;
+}
+
+static void test_download_should_fan_out_to_sinks(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+
+    size_t size = 300 * 1024 + 7;
+    char *data = malloc(size);
+    assert(data != NULL);
+    for (size_t i = 0; i < size; i++) data[i] = (char) (i * 13 + i / 1000);
+    FILE *fp = fopen("/tmp/fanout.dat", "wb");
+    assert(fp != NULL && fwrite(data, 1, size, fp) == size);
+    fclose(fp);
+    char *cid = e_storage_upload(node, "/tmp/fanout.dat", NULL);
+    assert(cid != NULL);
+
+    // A consumer process at the other end of a pipe, and one that already went away.
+    int live[2], gone[2];
+    assert(pipe(live) == 0 && pipe(gone) == 0);
+    close(gone[0]);
+    fd_reader reader = {.fd = live[0], .out = {.fail_after = -1}};
+    pthread_t t;
+    assert(pthread_create(&t, NULL, read_fd, &reader) == 0);
+
+    collector cb = {.fail_after = -1}, failing = {.fail_after = 2};
+    unlink("/tmp/fanout_out.dat");
+    download_sink sinks[] = {
+            {.type = DOWNLOAD_SINK_FILE, .path = "/tmp/fanout_out.dat"},
+            {.type = DOWNLOAD_SINK_FD, .fd = live[1], .max_queued = 64 * 1024},
+            {.type = DOWNLOAD_SINK_CALLBACK, .fn = collect_chunk, .user = &cb},
+            {.type = DOWNLOAD_SINK_CALLBACK, .fn = collect_chunk, .user = &failing},
+            {.type = DOWNLOAD_SINK_FD, .fd = gone[1]},
+            {.type = DOWNLOAD_SINK_FILE, .path = "/nonexistent/fanout_out.dat"},
+    };
+    size_t progress = 0;
+    transfer_opts opts = {.verify = true, .progress = count_progress, .user = &progress};
+    assert(e_storage_download_sinks(node, cid, sinks, 6, &opts) == RET_ERR);
+    close(live[1]);
+    pthread_join(t, NULL);
+    close(live[0]);
+    close(gone[1]);
+
+    // Each sink succeeds or fails on its own.
+    int expected[] = {RET_OK, RET_OK, RET_OK, RET_ERR, RET_ERR, RET_ERR};
+    for (int i = 0; i < 6; i++) assert(sinks[i].status == expected[i]);
+    assert(progress == size);
+
+    char *out = malloc(size + 1);
+    fp = fopen("/tmp/fanout_out.dat", "rb");
+    assert(out != NULL && fp != NULL && fread(out, 1, size + 1, fp) == size);
+    fclose(fp);
+    assert(memcmp(out, data, size) == 0);
+    assert(reader.out.len == size && memcmp(reader.out.data, data, size) == 0);
+    assert(cb.len == size && memcmp(cb.data, data, size) == 0);
+    assert(failing.len < size);
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_HEX_SIZE];
+    sha256(data, size, digest);
+    sha256_hex(digest, hex);
+    assert(strcmp(opts.sha256, hex) == 0);
+
+    // With no sink left to take the data, the transfer is abandoned.
+    collector only = {.fail_after = 0};
+    download_sink lone = {.type = DOWNLOAD_SINK_CALLBACK, .fn = collect_chunk, .user = &only};
+    assert(e_storage_download_sinks(node, cid, &lone, 1, NULL) == RET_ERR);
+    assert(lone.status == RET_ERR);
+    download_sink invalid = {.type = DOWNLOAD_SINK_FD, .fd = -1};
+    assert(e_storage_download_sinks(node, cid, &invalid, 1, NULL) == RET_ERR);
+
+    // A consumer that stops reading is dropped after its timeout, and the others carry on.
+    int stuck[2];
+    assert(pipe(stuck) == 0);
+    collector rest = {.fail_after = -1};
+    download_sink pair[] = {
+            {.type = DOWNLOAD_SINK_FD, .fd = stuck[1], .max_queued = 16 * 1024, .timeout_ms = 200},
+            {.type = DOWNLOAD_SINK_CALLBACK, .fn = collect_chunk, .user = &rest},
+    };
+    assert(e_storage_download_sinks(node, cid, pair, 2, NULL) == RET_ERR);
+    assert(pair[0].status == RET_ERR && pair[1].status == RET_OK);
+    assert(rest.len == size && memcmp(rest.data, data, size) == 0);
+    assert(!(fcntl(stuck[1], F_GETFL) & O_NONBLOCK));
+    close(stuck[0]);
+    close(stuck[1]);
+    free(rest.data);
+
+    // Hashing doesn't keep the transfer going once the sinks are gone.
+    mock_set_transfer_delay(1);
+    only.fail_after = 0;
+    progress = 0;
+    transfer_opts verified = {.verify = true, .progress = count_progress, .user = &progress};
+    assert(e_storage_download_sinks(node, "zDvZRwzmSomeCid", &lone, 1, &verified) == RET_ERR);
+    assert(progress < 20 * 5);
+
+    // A slow sink holds the transfer back, but not the node, nor cancelling.
+    mock_set_transfer_delay(1);
+    collector slow = {.fail_after = -1};
+    download_sink lagging = {.type = DOWNLOAD_SINK_CALLBACK, .fn = slow_chunk, .user = &slow, .max_queued = 1};
+    transfer_opts cancelled = {0};
+    cancel_and_call c = {.node = node, .opts = &cancelled};
+    assert(pthread_create(&t, NULL, cancel_then_call, &c) == 0);
+    assert(e_storage_download_sinks(node, "zDvZRwzmSomeCid", &lagging, 1, &cancelled) == RET_CANCELLED);
+    pthread_join(t, NULL);
+    assert(c.spr_ms < 250);
+    mock_set_transfer_delay(0);
+    free(slow.data);
+
+    free(reader.out.data);
+    free(cb.data);
+    free(failing.data);
+    free(out);
+    free(data);
+    free(cid);
+    unlink("/tmp/fanout.dat");
+    unlink("/tmp/fanout_out.dat");
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+static void on_async_done(void *user, int status, char *result);
+
+static void test_should_compress_uploads(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+
+    // Log-like text, large enough to be compressed on several threads where there are CPUs.
+    size_t size = 9 * 1024 * 1024 + 321;
+    char *data = malloc(size), *out = malloc(size + 1);
+    assert(data != NULL && out != NULL);
+    for (size_t done = 0, line = 0; done < size; line++) {
+        char l[128];
+        int n = snprintf(l, sizeof(l), "2025-01-01 INFO [store] block %zu stored in %zu ms\n", line * 7919 % 100003,
+                         line % 97);
+        size_t take = size - done < (size_t) n ? size - done : (size_t) n;
+        memcpy(data + done, l, take);
+        done += take;
+    }
+    FILE *fp = fopen("/tmp/compress.log", "wb");
+    assert(fp != NULL && fwrite(data, 1, size, fp) == size);
+    fclose(fp);
+
+    transfer_opts up = {.compress = 3};
+    char *cid = e_storage_upload_opts(node, "/tmp/compress.log", &up);
+    assert(cid != NULL && up.status == RET_OK);
+    assert(up.stored_size > 0 && up.stored_size < size / 4);
+
+    // Plain downloads expand it, in place or not.
+    for (int in_place = 0; in_place < 2; in_place++) {
+        unlink("/tmp/compress_out.log");
+        transfer_opts down = {.preallocate = in_place};
+        assert(e_storage_download_opts(node, cid, "/tmp/compress_out.log", &down) == RET_OK);
+        fp = fopen("/tmp/compress_out.log", "rb");
+        assert(fp != NULL && fread(out, 1, size + 1, fp) == size);
+        fclose(fp);
+        assert(memcmp(data, out, size) == 0);
+    }
+    assert(count_files("/tmp", "compress_out.log.") == 0);
+
+    // Unless asked to keep the content as stored.
+    transfer_opts keep = {.keep_compressed = true};
+    assert(e_storage_download_opts(node, cid, "/tmp/compress_out.log", &keep) == RET_OK);
+    fp = fopen("/tmp/compress_out.log", "rb");
+    assert(fp != NULL && fread(out, 1, size + 1, fp) == up.stored_size);
+    fclose(fp);
+    assert(memcmp(out, "\x89" "ESZ\r\n\x1a\n", 8) == 0);
+
+    // Sinks can't expand it, so they refuse it rather than receive it as stored, unless asked to.
+    collector sunk = {.fail_after = -1};
+    download_sink sink = {.type = DOWNLOAD_SINK_CALLBACK, .fn = collect_chunk, .user = &sunk};
+    assert(e_storage_download_sinks(node, cid, &sink, 1, NULL) == RET_COMPRESSED);
+    assert(sink.status == RET_COMPRESSED && sunk.len == 0);
+    assert(e_storage_download_sinks(node, cid, &sink, 1, &keep) == RET_OK);
+    assert(sunk.len == up.stored_size && memcmp(sunk.data, out, sunk.len) == 0);
+    free(sunk.data);
+
+    // A damaged frame fails the download, which leaves the content as stored.
+    out[up.stored_size / 2] ^= 0x55;
+    fp = fopen("/tmp/compress.bad", "wb");
+    assert(fp != NULL && fwrite(out, 1, up.stored_size, fp) == up.stored_size);
+    fclose(fp);
+    char *bad = e_storage_upload(node, "/tmp/compress.bad", NULL);
+    assert(bad != NULL);
+    assert(e_storage_download(node, bad, "/tmp/compress_out.log", NULL) == RET_ERR);
+    struct stat st;
+    assert(stat("/tmp/compress_out.log", &st) == 0 && (size_t) st.st_size == up.stored_size);
+    assert(count_files("/tmp", "compress_out.log.") == 0);
+
+    // Content that merely starts like compressed content is left alone.
+    write_file("/tmp/compress.bad", "\x89" "ESZ\r\n\x1a\n" "but no frame follows");
+    char *lookalike = e_storage_upload(node, "/tmp/compress.bad", NULL);
+    assert(lookalike != NULL);
+    assert(e_storage_download(node, lookalike, "/tmp/compress_out.log", NULL) == RET_OK);
+    assert(stat("/tmp/compress_out.log", &st) == 0 && st.st_size == 28);
+    free(lookalike);
+
+    // Content that isn't marked is left alone, and async uploads don't compress.
+    write_file("/tmp/compress.txt", "plain contents");
+    char *plain = e_storage_upload(node, "/tmp/compress.txt", NULL);
+    assert(plain != NULL);
+    assert(e_storage_download(node, plain, "/tmp/compress_out.log", NULL) == RET_OK);
+    char buf[32] = {0};
+    fp = fopen("/tmp/compress_out.log", "rb");
+    assert(fp != NULL && fread(buf, 1, sizeof(buf) - 1, fp) == 14);
+    fclose(fp);
+    assert(strcmp(buf, "plain contents") == 0);
+    transfer_opts async = {.compress = 1};
+    assert(e_storage_upload_async(node, "/tmp/compress.txt", &async, on_async_done, NULL) == RET_ERR);
+
+    free(cid);
+    free(bad);
+    free(plain);
+    free(data);
+    free(out);
+    unlink("/tmp/compress.log");
+    unlink("/tmp/compress.bad");
+    unlink("/tmp/compress.txt");
+    unlink("/tmp/compress_out.log");
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+typedef struct {
+    STORAGE_NODE node;
+    char path[64];
+    transfer_opts opts;
+    char *cid;
+} admitted_upload;
+
+static void *upload_worker(void *arg) {
+    admitted_upload *u = arg;
+    u->cid = e_storage_upload_opts(u->node, u->path, &u->opts);
+    return NULL;
+}
+
+static void mark_sending(void *user, size_t complete) { __atomic_store_n((int *) user, 1, __ATOMIC_RELEASE); }
+
+static void write_sized(const char *path, size_t size, char fill) {
+    FILE *fp = fopen(path, "wb");
+    assert(fp != NULL);
+    for (size_t i = 0; i < size; i++) fputc(fill, fp);
+    fclose(fp);
+}
+
+static void test_uploads_should_be_admitted_against_free_space(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+    mock_set_free_space(250 * 1024);
+    size_t available = 0;
+    assert(e_storage_space_available(node, &available) == RET_OK);
+    assert(available == 250 * 1024);
+
+    // Too large to fit: turned away from the cached figure, before anything is sent.
+    write_sized("/tmp/admit_big.dat", 300 * 1024, 'b');
+    int queries = mock_space_queries();
+    transfer_opts big = {0};
+    assert(e_storage_upload_opts(node, "/tmp/admit_big.dat", &big) == NULL);
+    assert(big.status == RET_NOSPACE);
+    assert(mock_space_queries() == queries);
+    big = (transfer_opts) {0};
+    assert(e_storage_upload_async(node, "/tmp/admit_big.dat", &big, on_async_done, NULL) == RET_ERR);
+    assert(big.status == RET_NOSPACE);
+
+    // Concurrent uploads that would fit one by one can't oversubscribe the space together.
+    mock_set_transfer_delay(20);
+    admitted_upload uploads[3];
+    pthread_t threads[3];
+    for (int i = 0; i < 3; i++) {
+        uploads[i] = (admitted_upload) {.node = node};
+        snprintf(uploads[i].path, sizeof(uploads[i].path), "/tmp/admit_%d.dat", i);
+        write_sized(uploads[i].path, 100 * 1024, (char) ('0' + i));
+        assert(pthread_create(&threads[i], NULL, upload_worker, &uploads[i]) == 0);
+    }
+    int ok = 0, rejected = 0;
+    for (int i = 0; i < 3; i++) {
+        pthread_join(threads[i], NULL);
+        ok += uploads[i].opts.status == RET_OK;
+        rejected += uploads[i].opts.status == RET_NOSPACE;
+    }
+    mock_set_transfer_delay(0);
+    assert(ok == 2 && rejected == 1);
+    assert(e_storage_space_available(node, &available) == RET_OK);
+    assert(available == 50 * 1024);
+
+    // Deleting makes room again straight away.
+    for (int i = 0; i < 3; i++) {
+        if (uploads[i].cid)
+            assert(e_storage_delete(node, uploads[i].cid) == RET_OK);
+        free(uploads[i].cid);
+        unlink(uploads[i].path);
+    }
+    assert(e_storage_space_available(node, &available) == RET_OK);
+    assert(available == 250 * 1024);
+    write_sized("/tmp/admit_0.dat", 100 * 1024, '0');
+    char *cid = e_storage_upload_opts(node, "/tmp/admit_0.dat", &big);
+    assert(cid != NULL && big.status == RET_OK);
+
+    // A query made once an upload's data is stored counts it already; the upload finishing
+    // mustn't take it off the figure a second time.
+    int sending = 0;
+    admitted_upload slow = {.node = node, .path = "/tmp/admit_1.dat"};
+    slow.opts = (transfer_opts) {.progress = mark_sending, .user = &sending};
+    write_sized(slow.path, 50 * 1024, '1');
+    mock_set_transfer_delay(20);
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, upload_worker, &slow) == 0);
+    while (!__atomic_load_n(&sending, __ATOMIC_ACQUIRE)) usleep(1000);
+    assert(e_storage_delete(node, cid) == RET_OK);
+    assert(e_storage_space_available(node, &available) == RET_OK);
+    assert(available == 150 * 1024); // the rest is still reserved for it
+    pthread_join(thread, NULL);
+    mock_set_transfer_delay(0);
+    assert(slow.cid != NULL);
+    assert(e_storage_space_available(node, &available) == RET_OK);
+    assert(available == 200 * 1024);
+    assert(e_storage_delete(node, slow.cid) == RET_OK);
+    free(slow.cid);
+    unlink(slow.path);
+
+    free(cid);
+    unlink("/tmp/admit_0.dat");
+    unlink("/tmp/admit_big.dat");
+    mock_set_free_space(0);
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+static void sha256_expect(const void *data, size_t len, const char *want) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_HEX_SIZE];
+    sha256(data, len, digest);
+    sha256_hex(digest, hex);
+    assert(strcmp(hex, want) == 0);
+
+    // Fed in uneven pieces, straddling block boundaries, the digest comes out the same.
+    static const size_t steps[] = {1, 3, 63, 64, 65, 127, 1000};
+    const uint8_t *p = data;
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    for (size_t off = 0, i = 0; off < len; i++) {
+        size_t n = steps[i % (sizeof(steps) / sizeof(steps[0]))];
+        n = n < len - off ? n : len - off;
+        sha256_update(&ctx, p + off, n);
+        off += n;
+    }
+    sha256_final(&ctx, digest);
+    sha256_hex(digest, hex);
+    assert(strcmp(hex, want) == 0);
+}
+
+static void test_sha256_known_answers(void) {
+    const char *before = sha256_impl();
+    char *million = malloc(1000000);
+    assert(million != NULL);
+    memset(million, 'a', 1000000);
+
+    // FIPS 180-4 example vectors, through every block function this CPU can run.
+    const char *impls[] = {"generic", "sha-ni"};
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (sha256_use(impls[i]) != RET_OK)
+            continue;
+        assert(strcmp(sha256_impl(), impls[i]) == 0);
+        sha256_expect("", 0, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+        sha256_expect("abc", 3, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+        const char *two = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+        sha256_expect(two, strlen(two), "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+        const char *four = "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmno"
+                           "ijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu";
+        sha256_expect(four, strlen(four), "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1");
+        sha256_expect(million, 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+    }
+    assert(sha256_use("nonexistent") == RET_ERR);
+
+    free(million);
+    assert(sha256_use(before) == RET_OK);
+}
+
+static void test_should_verify_downloads(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+
+    const char *contents = "contents to verify on the way in";
+    write_file("/tmp/verify.txt", contents);
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char expected[SHA256_HEX_SIZE];
+    sha256(contents, strlen(contents), digest);
+    sha256_hex(digest, expected);
+
+    char *cid = e_storage_upload(node, "/tmp/verify.txt", NULL);
+    assert(cid != NULL);
+
+    for (int in_place = 0; in_place < 2; in_place++) {
+        transfer_opts opts = {.verify = true, .preallocate = in_place};
+        assert(e_storage_download_opts(node, cid, "/tmp/verify_out.txt", &opts) == RET_OK);
+        assert(strcmp(opts.sha256, expected) == 0);
+
+        transfer_opts matching = {.expected_sha256 = expected, .preallocate = in_place};
+        assert(e_storage_download_opts(node, cid, "/tmp/verify_out.txt", &matching) == RET_OK);
+
+        unlink("/tmp/verify_out.txt");
+        const char *wrong = "0000000000000000000000000000000000000000000000000000000000000000";
+        transfer_opts mismatch = {.expected_sha256 = wrong, .preallocate = in_place};
+        assert(e_storage_download_opts(node, cid, "/tmp/verify_out.txt", &mismatch) == RET_MISMATCH);
+        assert(mismatch.status == RET_MISMATCH);
+        assert(strcmp(mismatch.sha256, expected) == 0);
+        // In place, a corrupt download never shows up at the destination.
+        if (in_place)
+            assert(access("/tmp/verify_out.txt", F_OK) != 0);
+    }
+
+    free(cid);
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+// Collects the completions of async operations.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int completed;
+    int failed;
+    int cancelled;
+    char *results[64];
+    STORAGE_NODE chain; // if set, each upload's CID is downloaded from its completion
+} async_state;
+
+#define ASYNC_STATE_INIT {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, {0}, NULL}
+
+static void on_async_done(void *user, int status, char *result) {
+    async_state *st = user;
+    if (st->chain && result) {
+        assert(e_storage_download_async(st->chain, result, "/tmp/async_chain_out.txt", NULL, on_async_done, st) ==
+               RET_OK);
+    }
+
+    pthread_mutex_lock(&st->lock);
+    if (status == RET_CANCELLED)
+        st->cancelled++;
+    else if (status != RET_OK)
+        st->failed++;
+    if (result && st->completed < 64)
+        st->results[st->completed] = result;
+    else
+        free(result);
+    st->completed++;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+// Tries to tear down st->chain from its own dispatcher, which would have to wait for itself.
+static void on_async_teardown(void *user, int status, char *result) {
+    async_state *st = user;
+    assert(e_storage_stop(st->chain) == RET_ERR);
+    assert(e_storage_destroy(st->chain) == RET_ERR);
+    st->chain = NULL;
+    on_async_done(user, status, result);
+}
+
+static void async_wait(async_state *st, int completed) {
+    pthread_mutex_lock(&st->lock);
+    while (st->completed < completed) pthread_cond_wait(&st->cond, &st->lock);
+    pthread_mutex_unlock(&st->lock);
+}
+
+static void async_reset(async_state *st) {
+    for (int i = 0; i < 64; i++) {
+        free(st->results[i]);
+        st->results[i] = NULL;
+    }
+    st->completed = st->failed = st->cancelled = 0;
+}
+
+static void test_async_operations_should_complete(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+    async_state st = ASYNC_STATE_INIT;
+
+    // Many operations in flight from one thread.
+    char paths[32][64];
+    for (int i = 0; i < 32; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "/tmp/async-%d.txt", i);
+        char contents[32];
+        snprintf(contents, sizeof(contents), "async contents %d", i);
+        write_file(paths[i], contents);
+        assert(e_storage_upload_async(node, paths[i], NULL, on_async_done, &st) == RET_OK);
+    }
+    async_wait(&st, 32);
+    assert(st.failed == 0);
+    for (int i = 0; i < 32; i++) assert(st.results[i] != NULL && strncmp(st.results[i], "zDvZRwzm", 8) == 0);
+    async_reset(&st);
+
+    assert(e_storage_spr_async(node, on_async_done, &st) == RET_OK);
+    async_wait(&st, 1);
+    assert(st.failed == 0 && st.results[0] != NULL && strncmp(st.results[0], "spr:", 4) == 0);
+    async_reset(&st);
+
+    // Operations started from completions.
+    st.chain = node;
+    assert(e_storage_upload_async(node, paths[0], NULL, on_async_done, &st) == RET_OK);
+    async_wait(&st, 2);
+    assert(st.failed == 0);
+    FILE *fp = fopen("/tmp/async_chain_out.txt", "r");
+    char buf[64] = {0};
+    assert(fp != NULL && fgets(buf, sizeof(buf), fp) != NULL);
+    fclose(fp);
+    assert(strcmp(buf, "async contents 0") == 0);
+    st.chain = NULL;
+    async_reset(&st);
+
+    // Compressed content is expanded before the completion.
+    transfer_opts compressed = {.compress = 3};
+    char *cid = e_storage_upload_opts(node, paths[2], &compressed);
+    assert(cid != NULL);
+    assert(e_storage_download_async(node, cid, "/tmp/async_out.dat", NULL, on_async_done, &st) == RET_OK);
+    async_wait(&st, 1);
+    assert(st.failed == 0);
+    fp = fopen("/tmp/async_out.dat", "r");
+    memset(buf, 0, sizeof(buf));
+    assert(fp != NULL && fgets(buf, sizeof(buf), fp) != NULL);
+    fclose(fp);
+    assert(strcmp(buf, "async contents 2") == 0);
+    async_reset(&st);
+    free(cid);
+
+    // Deleting again fails, through the completion.
+    cid = e_storage_upload(node, paths[1], NULL);
+    assert(e_storage_delete_async(node, cid, on_async_done, &st) == RET_OK);
+    assert(e_storage_delete_async(node, cid, on_async_done, &st) == RET_OK);
+    async_wait(&st, 2);
+    assert(st.failed == 1);
+    async_reset(&st);
+    free(cid);
+
+    // Cancelled in flight.
+    mock_set_transfer_delay(20);
+    transfer_opts opts = {0};
+    assert(e_storage_download_async(node, "zDvZRwzmSomeCid", "/tmp/async_out.dat", &opts, on_async_done, &st) ==
+           RET_OK);
+    usleep(50 * 1000);
+    e_storage_cancel(&opts);
+    async_wait(&st, 1);
+    assert(st.cancelled == 1 && opts.status == RET_CANCELLED);
+    mock_set_transfer_delay(0);
+    async_reset(&st);
+
+    // The node can't be stopped or destroyed from a completion.
+    st.chain = node;
+    assert(e_storage_spr_async(node, on_async_teardown, &st) == RET_OK);
+    async_wait(&st, 1);
+    assert(st.failed == 0);
+    async_reset(&st);
+    char *spr = e_storage_spr(node);
+    assert(spr != NULL);
+    free(spr);
+
+    transfer_opts unsupported = {.preallocate = true};
+    assert(e_storage_download_async(node, "zDvZRwzmSomeCid", "/tmp/async_out.dat", &unsupported, on_async_done,
+                                    &st) == RET_ERR);
+
+    assert(e_storage_destroy(node) == RET_OK);
+    assert(st.completed == 0);
+}
+
+// Allocator that counts what goes through it.
+typedef struct {
+    int allocs;
+    int live;
+} counting_allocator;
+
+static void *counting_alloc(void *ctx, size_t size) {
+    counting_allocator *c = ctx;
+    __atomic_add_fetch(&c->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->live, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void counting_release(void *ctx, void *ptr) {
+    counting_allocator *c = ctx;
+    __atomic_sub_fetch(&c->live, 1, __ATOMIC_RELAXED);
+    free(ptr);
+}
+
+static int swapping;
+
+static void *swap_allocators(void *hooks) {
+    while (__atomic_load_n(&swapping, __ATOMIC_RELAXED)) {
+        e_storage_set_allocator(hooks);
+        e_storage_set_allocator(NULL);
+    }
+    return NULL;
+}
+
+static void test_should_use_allocator_hooks(void) {
+    counting_allocator counts = {0};
+    storage_allocator hooks = {counting_alloc, counting_release, &counts};
+    assert(e_storage_set_allocator(&hooks) == RET_OK);
+
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+    // Can't be swapped while its memory is in use.
+    assert(e_storage_set_allocator(NULL) == RET_ERR);
+
+    write_file("/tmp/hooks.txt", "allocated elsewhere");
+    char *cid = e_storage_upload(node, "/tmp/hooks.txt", NULL);
+    assert(cid != NULL);
+    transfer_opts opts = {.preallocate = true, .verify = true};
+    assert(e_storage_download_opts(node, cid, "/tmp/hooks_out.txt", &opts) == RET_OK);
+    free(cid); // caller-facing strings still come from malloc
+    assert(e_storage_memory_used(node) == 0);
+
+    assert(e_storage_destroy(node) == RET_OK);
+    assert(counts.allocs > 0 && counts.live == 0);
+    assert(e_storage_set_allocator(NULL) == RET_OK);
+
+    // Swapping it while nodes come and go only ever succeeds in between.
+    __atomic_store_n(&swapping, 1, __ATOMIC_RELAXED);
+    pthread_t t;
+    assert(pthread_create(&t, NULL, swap_allocators, &hooks) == 0);
+    for (int i = 0; i < 20; i++) {
+        node = e_storage_new(default_config());
+        assert(node != NULL);
+        cid = e_storage_upload(node, "/tmp/hooks.txt", NULL);
+        assert(cid != NULL);
+        free(cid);
+        assert(e_storage_destroy(node) == RET_OK);
+    }
+    __atomic_store_n(&swapping, 0, __ATOMIC_RELAXED);
+    pthread_join(t, NULL);
+    assert(e_storage_set_allocator(NULL) == RET_OK);
+    assert(counts.live == 0);
+}
+
+static void *slow_download(void *node) {
+    transfer_opts opts = {0};
+    e_storage_download_opts(node, "zDvZRwzmSomeCid", "/tmp/limit_out.dat", &opts);
+    return NULL;
+}
+
+static void test_memory_limit_should_hold_back_new_operations(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+    assert(e_storage_memory_used(node) == 0);
+    assert(e_storage_memory_used(NULL) > 0); // the node itself
+
+    // A transfer in flight holds memory...
+    mock_set_transfer_delay(20);
+    pthread_t t;
+    assert(pthread_create(&t, NULL, slow_download, node) == 0);
+    while (e_storage_memory_used(node) == 0) usleep(1000);
+
+    // ...so at a cap of one byte, new operations fail right away...
+    assert(e_storage_set_memory_limit(node, 1, false) == RET_OK);
+    assert(e_storage_spr(node) == NULL);
+    async_state st = ASYNC_STATE_INIT;
+    assert(e_storage_spr_async(node, on_async_done, &st) == RET_ERR);
+
+    // ...or wait until the transfer is done (it has a few hundred ms to go).
+    assert(e_storage_set_memory_limit(node, 1, true) == RET_OK);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char *spr = e_storage_spr(node);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(spr != NULL);
+    assert((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000 >= 100);
+    free(spr);
+
+    pthread_join(t, NULL);
+    mock_set_transfer_delay(0);
+    assert(e_storage_memory_used(node) == 0);
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+static void test_bench_should_verify_round_trips(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+    assert(e_storage_start(node) == RET_OK);
+
+    size_t sizes[] = {1000, 200 * 1024};
+    bench_result results[2];
+    bench_opts opts = {.sizes = sizes, .n_sizes = 2, .iterations = 6, .concurrency = 3};
+
+    for (int sparse = 0; sparse < 2; sparse++) {
+        opts.sparse = sparse;
+        assert(e_storage_bench(node, &opts, results) == RET_OK);
+        for (int i = 0; i < 2; i++) {
+            assert(results[i].size == sizes[i]);
+            assert(results[i].ok == 6);
+            assert(results[i].failed == 0);
+            assert(results[i].upload_ms[0] <= results[i].upload_ms[1]);
+            assert(results[i].download_ms[1] <= results[i].download_ms[2]);
+            assert(results[i].download_mibps > 0);
+        }
+    }
+
+    // Compressed round trips of log-like text, and the ratio they got.
+    opts.sparse = false;
+    opts.text = true;
+    opts.compress = 1;
+    assert(e_storage_bench(node, &opts, results) == RET_OK);
+    for (int i = 0; i < 2; i++) {
+        assert(results[i].ok == 6);
+        assert(results[i].ratio > 0 && results[i].ratio < 0.5);
+    }
+
+    opts.iterations = 0;
+    assert(e_storage_bench(node, &opts, results) == RET_ERR);
+
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+static void test_should_build_config_json(void) {
+    char *bootstrap[] = {"spr:second", "spr:third"};
+    config_option options[] = {{"cache-size", "1073741824"}, {"block-mi", "600"}, {"agent-string", "my \"agent\""},
+                               {"data-dir", "/elsewhere"}, {"api-port", "9999"}};
+    node_config cfg = default_config();
+    cfg.data_dir = "/tmp/dir \"with\" \\quotes\\\n";
+    cfg.bootstrap_node = "spr:first";
+    cfg.bootstrap_nodes = bootstrap;
+    cfg.n_bootstrap_nodes = 2;
+    cfg.options = options;
+    cfg.n_options = 5;
+
+    STORAGE_NODE node = e_storage_new(cfg);
+    assert(node != NULL);
+    char *json = mock_last_config();
+    assert(json != NULL);
+
+    assert(strncmp(json, "{\"api-port\":8080,\"disc-port\":8090,", 34) == 0);
+    assert(strstr(json, "\"data-dir\":\"/tmp/dir \\\"with\\\" \\\\quotes\\\\\\u000a\"") != NULL);
+    assert(strstr(json, "\"bootstrap-node\":[\"spr:first\",\"spr:second\",\"spr:third\"]") != NULL);
+    assert(strstr(json, "\"cache-size\":1073741824") != NULL);
+    assert(strstr(json, "\"block-mi\":600") != NULL);
+    assert(strstr(json, "\"agent-string\":\"my \\\"agent\\\"\"") != NULL);
+    // Options can't repeat a key the fields already wrote.
+    assert(strstr(json, "elsewhere") == NULL && strstr(json, "9999") == NULL);
+    assert(strstr(strstr(json, "\"data-dir\"") + 1, "\"data-dir\"") == NULL);
+    assert(json[strlen(json) - 1] == '}');
+    free(json);
+
+    // Configs larger than the old fixed-size buffer.
+    char big[8192];
+    memset(big, 'a', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    cfg.bootstrap_node = big;
+    STORAGE_NODE other = e_storage_new(cfg);
+    assert(other != NULL);
+    json = mock_last_config();
+    assert(strstr(json, big) != NULL);
+    free(json);
+
+    assert(e_storage_destroy(node) == RET_OK);
+    assert(e_storage_destroy(other) == RET_OK);
+}
+
+static void test_should_read_bootstrap_nodes_and_options(void) {
+    const char *conf = "[easystorage]\n"
+                       "bootstrap-node=spr:first\n"
+                       "bootstrap-node=spr:second\n"
+                       "bootstrap-node=spr:third\n"
+                       "cache-size=1073741824\n"
+                       "max-peers=80\n"
+                       "max-peers=160\n";
+
+    node_config cfg = {0};
+    FILE *cfg_file = write_to_temp(conf);
+    assert(e_storage_read_config_file(cfg_file, &cfg) == RET_OK);
+    fclose(cfg_file);
+
+    assert(strcmp(cfg.bootstrap_node, "spr:first") == 0);
+    assert(cfg.n_bootstrap_nodes == 2);
+    assert(strcmp(cfg.bootstrap_nodes[0], "spr:second") == 0);
+    assert(strcmp(cfg.bootstrap_nodes[1], "spr:third") == 0);
+    assert(cfg.n_options == 2);
+    assert(strcmp(cfg.options[0].key, "cache-size") == 0);
+    assert(strcmp(cfg.options[0].value, "1073741824") == 0);
+    assert(strcmp(cfg.options[1].key, "max-peers") == 0);
+    assert(strcmp(cfg.options[1].value, "160") == 0);
+
+    // Merged over the defaults, only what the file set changes.
+    node_config merged = DEFAULT_STORAGE_NODE_CONFIG;
+    e_storage_merge_config(&merged, &cfg);
+    assert(merged.api_port == DEFAULT_STORAGE_NODE_CONFIG.api_port);
+    assert(merged.data_dir == DEFAULT_STORAGE_NODE_CONFIG.data_dir);
+    assert(merged.bootstrap_node == cfg.bootstrap_node && merged.n_bootstrap_nodes == 2);
+    assert(merged.options == cfg.options && merged.n_options == 2);
+
+    STORAGE_NODE node = e_storage_new(cfg);
+    assert(node != NULL);
+    char *json = mock_last_config();
+    assert(strstr(json, "\"max-peers\":160") != NULL);
+    free(json);
+    assert(e_storage_destroy(node) == RET_OK);
+
+    e_storage_free_config(&cfg);
+    assert(cfg.bootstrap_nodes == NULL && cfg.n_bootstrap_nodes == 0);
+    assert(cfg.options == NULL && cfg.n_options == 0);
+}
+
+static long long elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000LL + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void test_download_policy_should_retry_stalls(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+    write_file("/tmp/policy.txt", "retried contents");
+    char *cid = e_storage_upload(node, "/tmp/policy.txt", NULL);
+    assert(cid != NULL);
+
+    // A stalled transfer is given up on after stall_ms rather than the request timeout.
+    download_policy policy = {.stall_ms = 100};
+    transfer_opts opts = {.policy = &policy};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mock_stall_downloads(1);
+    assert(e_storage_download_opts(node, cid, "/tmp/policy.out", &opts) == RET_ERR);
+    assert(opts.status == RET_ERR);
+    assert(elapsed_ms(&start) < 2000);
+
+    // With retries, it goes through once the stalls stop.
+    unlink("/tmp/policy.out");
+    policy = (download_policy) {.stall_ms = 100, .max_attempts = 3, .backoff_ms = 10};
+    opts = (transfer_opts) {.policy = &policy};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mock_stall_downloads(2);
+    assert(e_storage_download_opts(node, cid, "/tmp/policy.out", &opts) == RET_OK);
+    assert(opts.status == RET_OK);
+    assert(elapsed_ms(&start) >= 200);
+    FILE *fp = fopen("/tmp/policy.out", "r");
+    char buf[64] = {0};
+    assert(fp != NULL && fgets(buf, sizeof(buf), fp) != NULL);
+    fclose(fp);
+    assert(strcmp(buf, "retried contents") == 0);
+
+    // Cancellation ends the retries.
+    opts = (transfer_opts) {.policy = &policy};
+    e_storage_cancel(&opts);
+    assert(e_storage_download_opts(node, cid, "/tmp/policy.out", &opts) == RET_CANCELLED);
+    mock_stall_downloads(0);
+
+    free(cid);
+    unlink("/tmp/policy.txt");
+    unlink("/tmp/policy.out");
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+static void test_download_policy_should_hedge(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    node_config cfg = default_config();
+    cfg.api_port++;
+    cfg.disc_port++;
+    STORAGE_NODE other = e_storage_new(cfg);
+    assert(node != NULL && other != NULL);
+    write_file("/tmp/hedge.txt", "hedged contents");
+    char *cid = e_storage_upload(node, "/tmp/hedge.txt", NULL);
+    assert(cid != NULL);
+    unlink("/tmp/hedge.out");
+
+    // The first attempt stalls with no stall detection, so only the hedge can finish it.
+    download_policy policy = {.hedge_node = other, .hedge_after_ms = 50};
+    transfer_opts opts = {.policy = &policy};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mock_stall_downloads(1);
+    assert(e_storage_download_opts(node, cid, "/tmp/hedge.out", &opts) == RET_OK);
+    assert(elapsed_ms(&start) >= 50 && elapsed_ms(&start) < 2000);
+    FILE *fp = fopen("/tmp/hedge.out", "r");
+    char buf[64] = {0};
+    assert(fp != NULL && fgets(buf, sizeof(buf), fp) != NULL);
+    fclose(fp);
+    assert(strcmp(buf, "hedged contents") == 0);
+
+    // Fast downloads finish before the hedge is due and leave only the output behind.
+    for (int i = 0; i < 10; i++) {
+        assert(e_storage_download_opts(node, cid, "/tmp/hedge.out", &opts) == RET_OK);
+    }
+    assert(count_files("/tmp", "hedge.out.") == 0);
+
+    free(cid);
+    unlink("/tmp/hedge.txt");
+    unlink("/tmp/hedge.out");
+    assert(e_storage_destroy(other) == RET_OK);
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+static void test_should_delete_in_batches(void) {
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+
+    char *uploaded[6];
+    for (int i = 0; i < 6; i++) {
+        char path[64], contents[32];
+        snprintf(path, sizeof(path), "/tmp/batch-%d.txt", i);
+        snprintf(contents, sizeof(contents), "batch contents %d", i);
+        write_file(path, contents);
+        uploaded[i] = e_storage_upload(node, path, NULL);
+        assert(uploaded[i] != NULL);
+        unlink(path);
+    }
+
+    const char *cids[8] = {uploaded[0], uploaded[1], "zDvZRwzmMissing", uploaded[2],
+                           uploaded[3], uploaded[4], NULL,              uploaded[5]};
+    int status[8];
+    assert(e_storage_delete_many(node, cids, 8, 2, status) == RET_ERR);
+    for (int i = 0; i < 8; i++) assert(status[i] == (i == 2 || i == 6 ? RET_ERR : RET_OK));
+    for (int i = 0; i < 6; i++) assert(e_storage_delete(node, uploaded[i]) == RET_ERR);
+
+    assert(e_storage_delete_many(node, NULL, 0, 0, NULL) == RET_OK);
+    assert(e_storage_delete_many(NULL, cids, 8, 0, NULL) == RET_ERR);
+
+    for (int i = 0; i < 6; i++) free(uploaded[i]);
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+static void test_gc_should_delete_expired_cids(void) {
+    char index[64];
+    snprintf(index, sizeof(index), "/tmp/easystorage-gc-%d.idx", (int) getpid());
+    unlink(index);
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+
+    write_file("/tmp/gc-old.txt", "expires right away");
+    write_file("/tmp/gc-new.txt", "kept for an hour");
+    char *old = e_storage_upload(node, "/tmp/gc-old.txt", NULL);
+    char *kept = e_storage_upload(node, "/tmp/gc-new.txt", NULL);
+    assert(old != NULL && kept != NULL);
+
+    STORAGE_GC gc = e_storage_gc_new(node, index);
+    assert(gc != NULL);
+    assert(e_storage_gc_track(gc, old, 3600) == RET_OK);
+    assert(e_storage_gc_track(gc, old, 0) == RET_OK); // tracking again replaces the expiry
+    assert(e_storage_gc_track(gc, kept, 3600) == RET_OK);
+    assert(e_storage_gc_track(gc, "zDvZRwzmGone", 0) == RET_OK);
+
+    gc_stats stats;
+    e_storage_gc_stats(gc, &stats);
+    assert(stats.tracked == 3 && stats.expired == 2);
+
+    // Content that is already gone counts as reclaimed rather than failing every collection.
+    assert(e_storage_gc_collect(gc, 0) == RET_OK);
+    e_storage_gc_stats(gc, &stats);
+    assert(stats.tracked == 1 && stats.expired == 0 && stats.deleted == 2 && stats.failed == 0);
+    bool exists;
+    assert(e_storage_exists(node, old, &exists) == RET_OK && !exists);
+    assert(e_storage_exists(node, kept, &exists) == RET_OK && exists);
+    assert(e_storage_gc_forget(gc, "zDvZRwzmGone") == RET_ERR);
+    assert(e_storage_gc_track(gc, "zDvZRwzmGone", 3600) == RET_OK);
+    assert(e_storage_gc_forget(gc, "zDvZRwzmGone") == RET_OK);
+    assert(e_storage_gc_collect(gc, 0) == RET_OK);
+    e_storage_gc_destroy(gc);
+
+    // The index carries the expiries across restarts.
+    gc = e_storage_gc_new(node, index);
+    assert(gc != NULL);
+    e_storage_gc_stats(gc, &stats);
+    assert(stats.tracked == 1 && stats.expired == 0 && stats.deleted == 0);
+
+    // Enough CIDs, tracked and retracked out of order, to go through several merges.
+    char many[64];
+    for (int i = 999; i >= 0; i--) {
+        snprintf(many, sizeof(many), "zDvZRwzmMany%d", i);
+        assert(e_storage_gc_track(gc, many, 3600) == RET_OK);
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        snprintf(many, sizeof(many), "zDvZRwzmMany%d", i);
+        assert(e_storage_gc_track(gc, many, 0) == RET_OK);
+    }
+    e_storage_gc_stats(gc, &stats);
+    assert(stats.tracked == 1001 && stats.expired == 500);
+    for (int i = 1; i < 1000; i += 2) {
+        snprintf(many, sizeof(many), "zDvZRwzmMany%d", i);
+        assert(e_storage_gc_forget(gc, many) == RET_OK);
+        assert(e_storage_gc_forget(gc, many) == RET_ERR);
+    }
+    assert(e_storage_gc_collect(gc, 0) == RET_OK);
+    e_storage_gc_stats(gc, &stats);
+    assert(stats.tracked == 1 && stats.expired == 0 && stats.deleted == 500 && stats.failed == 0);
+    e_storage_gc_destroy(gc);
+    gc = e_storage_gc_new(node, index);
+    assert(gc != NULL);
+    e_storage_gc_stats(gc, &stats);
+    assert(stats.tracked == 1);
+    e_storage_gc_destroy(gc);
+    assert(e_storage_delete(node, kept) == RET_OK);
+
+    free(old);
+    free(kept);
+    unlink(index);
+    unlink("/tmp/gc-old.txt");
+    unlink("/tmp/gc-new.txt");
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+static void make_sync_dir(char *dir, size_t len) {
+    snprintf(dir, len, "/tmp/easystorage-sync-%d", (int) getpid());
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s && mkdir -p %s/sub", dir, dir);
+    assert(system(cmd) == 0);
+}
+
+static void remove_dir(const char *dir) {
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    assert(system(cmd) == 0);
+}
+
+static void test_sync_should_mirror_directory(void) {
+    char dir[256], path[512], state[512];
+    make_sync_dir(dir, sizeof(dir));
+    snprintf(state, sizeof(state), "%s/.state", dir);
+
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+
+    snprintf(path, sizeof(path), "%s/a.txt", dir);
+    write_file(path, "first version");
+    snprintf(path, sizeof(path), "%s/sub/b.txt", dir);
+    write_file(path, "nested file");
+
+    STORAGE_SYNC sync = e_storage_sync_new(node, dir, state, NULL);
+    assert(sync != NULL);
+    assert(e_storage_sync_scan(sync) == RET_OK);
+
+    sync_stats stats;
+    e_storage_sync_stats(sync, &stats);
+    assert(stats.files == 2 && stats.uploaded == 2 && stats.failed == 0);
+    char *a1 = e_storage_sync_cid(sync, "a.txt");
+    char *b = e_storage_sync_cid(sync, "sub/b.txt");
+    assert(a1 != NULL && b != NULL);
+    assert(e_storage_sync_cid(sync, ".state") == NULL);
+
+    // Unchanged trees cost nothing.
+    assert(e_storage_sync_scan(sync) == RET_OK);
+    e_storage_sync_stats(sync, &stats);
+    assert(stats.uploaded == 2);
+
+    // Changed files are re-uploaded and their old content deleted; removed files are deleted.
+    snprintf(path, sizeof(path), "%s/a.txt", dir);
+    write_file(path, "second, longer version");
+    snprintf(path, sizeof(path), "%s/sub/b.txt", dir);
+    assert(unlink(path) == 0);
+    assert(e_storage_sync_scan(sync) == RET_OK);
+
+    e_storage_sync_stats(sync, &stats);
+    assert(stats.files == 1 && stats.uploaded == 3 && stats.deleted == 2);
+    char *a2 = e_storage_sync_cid(sync, "a.txt");
+    assert(a2 != NULL && strcmp(a1, a2) != 0);
+    assert(e_storage_sync_cid(sync, "sub/b.txt") == NULL);
+    assert(e_storage_delete(node, a1) == RET_ERR);
+    assert(e_storage_delete(node, b) == RET_ERR);
+    e_storage_sync_destroy(sync);
+
+    // The state file carries the mapping across restarts.
+    sync = e_storage_sync_new(node, dir, state, NULL);
+    assert(sync != NULL);
+    char *reloaded = e_storage_sync_cid(sync, "a.txt");
+    assert(reloaded != NULL && strcmp(reloaded, a2) == 0);
+    assert(e_storage_sync_scan(sync) == RET_OK);
+    e_storage_sync_stats(sync, &stats);
+    assert(stats.uploaded == 0);
+
+    // Names with a newline (or a backslash) in them come back as they were.
+    snprintf(path, sizeof(path), "%s/two\nlines\\n.txt", dir);
+    write_file(path, "oddly named");
+    assert(e_storage_sync_scan(sync) == RET_OK);
+    char *odd = e_storage_sync_cid(sync, "two\nlines\\n.txt");
+    assert(odd != NULL);
+    e_storage_sync_destroy(sync);
+    sync = e_storage_sync_new(node, dir, state, NULL);
+    assert(sync != NULL);
+    char *odd_reloaded = e_storage_sync_cid(sync, "two\nlines\\n.txt");
+    assert(odd_reloaded != NULL && strcmp(odd, odd_reloaded) == 0);
+    assert(e_storage_sync_cid(sync, "lines\\n.txt") == NULL);
+    assert(e_storage_sync_scan(sync) == RET_OK);
+    e_storage_sync_stats(sync, &stats);
+    assert(stats.files == 2 && stats.uploaded == 0 && stats.deleted == 0);
+    e_storage_sync_destroy(sync);
+    free(odd);
+    free(odd_reloaded);
+
+    free(a1);
+    free(a2);
+    free(b);
+    free(reloaded);
+    remove_dir(dir);
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
+static void *sync_thread(void *sync) {
+    assert(e_storage_sync_run(sync) == RET_OK);
+    return NULL;
+}
+
+// Polls until the sync has (or, if want is false, no longer has) a CID for path.
+static bool wait_for_cid(STORAGE_SYNC sync, const char *path, bool want) {
+    for (int i = 0; i < 500; i++) {
+        char *cid = e_storage_sync_cid(sync, path);
+        free(cid);
+        if ((cid != NULL) == want)
+            return true;
+        usleep(10 * 1000);
+    }
+    return false;
+}
+
+static void test_sync_should_follow_changes(void) {
+    char dir[256], path[512], state[512];
+    make_sync_dir(dir, sizeof(dir));
+    snprintf(state, sizeof(state), "%s.state", dir);
+
+    STORAGE_NODE node = e_storage_new(default_config());
+    assert(node != NULL);
+    sync_opts opts = {.debounce_ms = 20, .concurrency = 2};
+    STORAGE_SYNC sync = e_storage_sync_new(node, dir, state, &opts);
+    assert(sync != NULL);
+
+    pthread_t t;
+    assert(pthread_create(&t, NULL, sync_thread, sync) == 0);
+
+    snprintf(path, sizeof(path), "%s/sub/new.txt", dir);
+    write_file(path, "created while watching");
+    assert(wait_for_cid(sync, "sub/new.txt", true));
+
+    // Directories created after the watch started are followed too.
+    snprintf(path, sizeof(path), "%s/later", dir);
+    assert(mkdir(path, 0755) == 0);
+    snprintf(path, sizeof(path), "%s/later/deep.txt", dir);
+    write_file(path, "in a new directory");
+    assert(wait_for_cid(sync, "later/deep.txt", true));
+
+    snprintf(path, sizeof(path), "%s/sub/new.txt", dir);
+    assert(unlink(path) == 0);
+    assert(wait_for_cid(sync, "sub/new.txt", false));
+
+    // Moving a directory out drops what was under it, but not its siblings that sort in between.
+    char moved[512];
+    snprintf(path, sizeof(path), "%s/logs", dir);
+    assert(mkdir(path, 0755) == 0);
+    snprintf(path, sizeof(path), "%s/logs/a.txt", dir);
+    write_file(path, "under logs");
+    snprintf(path, sizeof(path), "%s/logs.old", dir);
+    write_file(path, "sibling");
+    assert(wait_for_cid(sync, "logs/a.txt", true));
+    assert(wait_for_cid(sync, "logs.old", true));
+    snprintf(path, sizeof(path), "%s/logs", dir);
+    snprintf(moved, sizeof(moved), "%s.moved", dir);
+    assert(rename(path, moved) == 0);
+    assert(wait_for_cid(sync, "logs/a.txt", false));
+    assert(wait_for_cid(sync, "logs.old", true));
+
+    // Watches on directories that were deleted or moved away are let go of.
+    snprintf(path, sizeof(path), "%s/gone", dir);
+    assert(mkdir(path, 0755) == 0);
+    snprintf(path, sizeof(path), "%s/gone/f.txt", dir);
+    write_file(path, "short-lived");
+    assert(wait_for_cid(sync, "gone/f.txt", true));
+    sync_stats stats;
+    e_storage_sync_stats(sync, &stats);
+    assert(stats.watched == 4); // the root, sub, later and gone
+    assert(unlink(path) == 0);
+    snprintf(path, sizeof(path), "%s/gone", dir);
+    assert(rmdir(path) == 0);
+    assert(wait_for_cid(sync, "gone/f.txt", false));
+    for (int i = 0; i < 500 && stats.watched != 3; i++) {
+        usleep(10 * 1000);
+        e_storage_sync_stats(sync, &stats);
+    }
+    assert(stats.watched == 3);
+
+    // A file that keeps changing is still picked up, after at most a few debounce periods.
+    snprintf(path, sizeof(path), "%s/churn.txt", dir);
+    bool picked_up = false;
+    for (int i = 0; i < 200 && !picked_up; i++) {
+        write_file(path, i % 2 ? "odd" : "even");
+        usleep(5 * 1000);
+        char *cid = e_storage_sync_cid(sync, "churn.txt");
+        picked_up = cid != NULL;
+        free(cid);
+    }
+    assert(picked_up);
+
+    e_storage_sync_stop(sync);
+    pthread_join(t, NULL);
+    e_storage_sync_destroy(sync);
+    remove_dir(dir);
+    remove_dir(moved);
+    unlink(state);
+    assert(e_storage_destroy(node) == RET_OK);
+}
+
 int main(void) {
     printf("Running easylibstorage tests...\n");
 
@@ -213,6 +1850,33 @@ int main(void) {
     RUN_TEST(test_get_should_get_node_spr);
     RUN_TEST(test_full_lifecycle);
     RUN_TEST(test_should_read_configuration_file);
+    RUN_TEST(test_should_build_config_json);
+    RUN_TEST(test_should_read_bootstrap_nodes_and_options);
+    RUN_TEST(test_should_run_nodes_from_multiple_threads);
+    RUN_TEST(test_nodes_should_be_isolated);
+    RUN_TEST(test_pool_should_hand_out_distinct_nodes);
+    RUN_TEST(test_pool_checkout_should_wait_for_checkin);
+    RUN_TEST(test_pool_destroy_should_not_pull_the_pool_from_under_a_checkout);
+    RUN_TEST(test_daemon_should_serve_clients);
+    RUN_TEST(test_transfer_opts_should_report_progress_with_user_data);
+    RUN_TEST(test_should_cancel_transfers);
+    RUN_TEST(test_should_download_in_place);
+    RUN_TEST(test_file_sink_should_write_through_each_engine);
+    RUN_TEST(test_sha256_known_answers);
+    RUN_TEST(test_should_verify_downloads);
+    RUN_TEST(test_download_should_fan_out_to_sinks);
+    RUN_TEST(test_should_compress_uploads);
+    RUN_TEST(test_uploads_should_be_admitted_against_free_space);
+    RUN_TEST(test_async_operations_should_complete);
+    RUN_TEST(test_should_use_allocator_hooks);
+    RUN_TEST(test_memory_limit_should_hold_back_new_operations);
+    RUN_TEST(test_bench_should_verify_round_trips);
+    RUN_TEST(test_download_policy_should_retry_stalls);
+    RUN_TEST(test_download_policy_should_hedge);
+    RUN_TEST(test_should_delete_in_batches);
+    RUN_TEST(test_gc_should_delete_expired_cids);
+    RUN_TEST(test_sync_should_mirror_directory);
+    RUN_TEST(test_sync_should_follow_changes);
 
     printf("\n%d/%d tests passed.\n", tests_passed, tests_run);
     return tests_passed == tests_run ? 0 : 1;